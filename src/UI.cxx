@@ -35,7 +35,7 @@ void Game::drawSplash() {
   const static auto X_O = m_main_win->m_width * (0.2);
   const static auto Y_O = m_main_win->m_height - 100;
   // draw texture and print title
-  m_main_win->textureWindow(m_splash_tex);
+  m_main_win->textureWindow(*m_splash_tex);
   m_main_win->printOnScreen([&] {
     m_env.setColor(agl::WHITE);
     m_text_big->render(X_O, Y_O, title);
@@ -105,6 +105,49 @@ void Game::drawHUD() {
                              (m_deadline_time / 1000.0));
     m_text_renderer->renderf(X_O + 2 * offset, Y_O, "RINGS: %d/%d",
                              m_cur_ring_index, m_num_rings);
+    // debug view: GL state changes of the last frame
+    if (m_env.isLodDebug()) {
+      m_text_renderer->renderf(X_O, Y_O - 40, "GL STATE: %zu SENT %zu SKIPPED",
+                               m_env.stateChangesIssued(),
+                               m_env.stateChangesFiltered());
+      // draw items and state changes of each pass of the render queue
+      const char *names[] = {"OPAQUE", "BACKGROUND", "TRANSPARENT"};
+      for (size_t i = 0; i < size_t(agl::RenderPass::N_PASSES); ++i) {
+        const auto &stats = m_env.passStats(agl::RenderPass(i));
+        m_text_renderer->renderf(X_O, Y_O - 80 - 40 * i,
+                                 "%s: %zu ITEMS %zu STATE CHANGES", names[i],
+                                 stats.items, stats.state_changes);
+      }
+      // frustum culling of the entities (F6 toggles it)
+      m_text_renderer->renderf(
+          X_O, Y_O - 80 - 40 * size_t(agl::RenderPass::N_PASSES),
+          "CULLING %s: %zu VISIBLE %zu CULLED",
+          m_env.isCulling() ? "ON" : "OFF", m_env.visibleCount(),
+          m_env.culledCount());
+      // shadow of the ship (F7 toggles it) and the cost of its last update
+      const auto &shadow = m_env.shadowStats();
+      const char *mode = !m_env.isShadow()             ? "OFF"
+                         : m_env.isShadowMapActive()   ? "MAP"
+                                                       : "BLOB";
+      m_text_renderer->renderf(
+          X_O, Y_O - 120 - 40 * size_t(agl::RenderPass::N_PASSES),
+          "SHADOW %s: %zu UPDATES %.2f MS CPU", mode, shadow.updates,
+          shadow.cpu_ms);
+      // time the CPU waited for the GPU (see Env::paceFrame)
+      m_text_renderer->renderf(
+          X_O, Y_O - 160 - 40 * size_t(agl::RenderPass::N_PASSES),
+          "PACING: %zu FRAMES IN FLIGHT %.2f MS WAIT",
+          m_env.framesInFlight(), m_env.frameWaitAverageMs());
+      // time of each part of the frame, see Env::timedScope
+      auto y = Y_O - 200 - 40 * size_t(agl::RenderPass::N_PASSES);
+      for (const auto &name : m_env.timerNames()) {
+        auto stats = m_env.timerStats(name);
+        m_text_renderer->renderf(X_O, y, "%s %s: %.2f MS P95 %.2f MS",
+                                 m_env.isGpuTiming() ? "GPU" : "CPU",
+                                 name.c_str(), stats.average_ms, stats.p95_ms);
+        y -= 40;
+      }
+    }
   });
 
   // draw minimap
@@ -150,7 +193,7 @@ void Game::renderMenu() {
   const static auto Ybottom = 150;
 
   // menu texture
-  m_main_win->textureWindow(m_menu_tex);
+  m_main_win->textureWindow(*m_menu_tex);
   // print settings
   m_main_win->printOnScreen([&] {
     // title
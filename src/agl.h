@@ -1,10 +1,15 @@
 #ifndef _AGL_H_
 #define _AGL_H_
 
+#include <array>
+#include <cstdint>
+#include <deque>
 #include <functional>
+#include <future>
 #include <memory>
 #include <queue>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -72,35 +77,161 @@ struct Vertex {
   void render(bool send_normal = false) const;
 };
 
+// vetores 3d em layout "structure of arrays": um array por componente.
+// Os kernels SIMD (mesh_kernels.h) leem 4/8 componentes consecutivos de vez.
+struct Vec3Array {
+  std::vector<float> x, y, z;
+
+  inline size_t size() const { return x.size(); }
+  inline void resize(size_t n) {
+    x.resize(n);
+    y.resize(n);
+    z.resize(n);
+  }
+  inline void reserve(size_t n) {
+    x.reserve(n);
+    y.reserve(n);
+    z.reserve(n);
+  }
+  inline void push_back(float px, float py, float pz) {
+    x.push_back(px);
+    y.push_back(py);
+    z.push_back(pz);
+  }
+  inline Point3 at(size_t i) const { return Point3(x[i], y[i], z[i]); }
+  inline void set(size_t i, const Point3 &p) {
+    x[i] = p.x;
+    y[i] = p.y;
+    z[i] = p.z;
+  }
+};
+
+// Vertices comprimidos (Mesh::quantize), ver mesh_quant.h
+struct QuantizedVertices {
+  std::vector<uint16_t> x, y, z; // posicoes no bounding box, 0..65535
+  std::vector<uint32_t> normals; // normais octaedricas, 2 x 16 bit
+};
+
 struct Edge {
 public:
-  Vertex *v[2]; // ponteiros para 2 bordas extremas
+  uint32_t v[2]; // indices das 2 extremidades em Mesh::m_pos
 };
 
-struct Face {
-public:
-  Vertex *verts[3]; // ponteiros para 3 vértices
+// posicoes dos atributos genericos dos shaders (glBindAttribLocation). As
+// dos vertices sao as que o GL compatibility de alguns drivers confunde com
+// glVertexPointer, glNormalPointer e glTexCoordPointer: os dois arrays
+// apontam para os mesmos dados
+enum VertexAttrib : GLuint {
+  ATTRIB_POSITION = 0,
+  ATTRIB_NORMAL = 2,
+  ATTRIB_INSTANCE_POSE = 6,
+  ATTRIB_INSTANCE_COLOR = 7,
+  ATTRIB_TEXCOORD = 8,
+};
 
-  // public
-  Face(Vertex *a, Vertex *b, Vertex *c);
+// matriz 4x4 por colunas, como no OpenGL (ver matrices.cxx)
+using Matrix4 = std::array<GLfloat, 16>;
+Matrix4 identityMatrix();
+
+// buffers de uma mesh na GPU (ver Mesh::upload): vertices intercalados
+// (posicao, normal e coordenadas de textura, se houver) e indices
+struct MeshBuffers {
+  GLuint vao = 0; // 0 se o driver nao tem vertex array objects
+  GLuint vbo = 0, ibo = 0;
+  GLsizei stride = 0; // bytes por vertice
+  bool normals = true, uv = false;
+  size_t bytes = 0; // memoria ocupada na GPU
+};
 
-  // cada face tem uma normal 
-  Normal3 normal; 
+// o driver tem vertex buffer objects?
+bool buffersSupported();
+// cria os buffers (normals e uv ja definidos): false se nao suportado
+bool createBuffers(MeshBuffers &buffers, const std::vector<float> &vertices,
+                   const std::vector<uint32_t> &indices);
+void deleteBuffers(MeshBuffers &buffers);
+// ativa os arrays para glDrawElements/glDrawArrays, e os desativa depois
+void bindBuffers(const MeshBuffers &buffers);
+void unbindBuffers(const MeshBuffers &buffers);
+
+// uma copia de uma primitiva: posicao, rotacao em torno de Y (graus) e cor
+struct Instance {
+  float x, y, z, angle;
+  Color color;
+};
 
-  // computa a normal da face
-  inline void computeNormal() {
-    normal = -((verts[1]->point - verts[0]->point) %
-               (verts[2]->point - verts[0]->point))
-                  .normalize();
+/* Instancias de uma primitiva, desenhadas com uma so chamada (ver
+ * Env::instancedDrawing). Ficam num buffer da GPU, reenviado somente nos
+ * trechos que mudaram. Sem cores proprias (colored = false) as instancias
+ * usam a cor corrente.
+ */
+class InstanceBuffer {
+private:
+  std::vector<Instance> m_instances;
+  std::vector<uint32_t> m_order; // ordem de desenho, vazio: a do vetor
+  bool m_colored;
+  GLuint m_vbo;
+  size_t m_capacity;                 // instancias alocadas na GPU
+  size_t m_dirty_begin, m_dirty_end; // trecho a reenviar
+
+public:
+  explicit InstanceBuffer(bool colored = true);
+  ~InstanceBuffer();
+  InstanceBuffer(const InstanceBuffer &) = delete;
+  InstanceBuffer &operator=(const InstanceBuffer &) = delete;
+
+  void clear();
+  void add(const Instance &instance);
+  // marca a instancia para reenvio somente se mudou
+  void set(size_t i, const Instance &instance);
+  // desenha as instancias nesta ordem (indices em add), reenviando tudo
+  // somente se a ordem mudou. As primeiras order.size() sao desenhadas
+  void setOrder(const std::vector<uint32_t> &order);
+
+  inline size_t size() const { return m_instances.size(); }
+  inline bool colored() const { return m_colored; }
+  inline const Instance &operator[](size_t i) const { return m_instances[i]; }
+  // instancias na ordem de desenho
+  inline size_t drawable() const {
+    return m_order.empty() ? m_instances.size() : m_order.size();
   }
+  inline const Instance &drawn(size_t i) const {
+    return m_instances[m_order.empty() ? i : m_order[i]];
+  }
+
+  // envia as mudancas para a GPU, retorna o buffer
+  GLuint upload();
 };
 
-// Cria objeto intrelaçado 
+class Bvh; // arvore de colisao, ver bvh.h
+struct Obb; // caixa orientada, ver bvh.h
+namespace io {
+struct ObjData; // ver mesh_io.h
+}
+
+// Cria objeto intrelaçado
+// Representação indexada: cada triângulo são 3 índices (32 bits) no vetor
+// de vértices, o mesmo buffer serve para normais, colisão e GPU.
 class Mesh {
 private:
-  std::vector<Vertex> m_verts; // vetor de vértices
-  std::vector<Face> m_faces;   // vetor de vértices
-  //  std::vector<Edge> m_edges;   // vetor de bordas (per ora, non usato)
+  Vec3Array m_pos;                 // posições dos vértices
+  Vec3Array m_norm;                // normais dos vértices
+  std::vector<float> m_uv;         // coordenadas de textura (u, v) ou vazio
+  bool m_authored_normals;         // normais lidas do OBJ (vn)
+  std::vector<uint32_t> m_indices; // 3 índices por face (triângulo)
+  Vec3Array m_face_normals;        // uma normal por face
+  std::vector<Edge> m_edges;       // bordas unicas, para o wireframe
+  // formato comprimido: se m_quantized, m_pos, m_norm e m_face_normals
+  // estao vazios (m_uv continua em float)
+  bool m_quantized;
+  QuantizedVertices m_qverts;
+  std::vector<uint32_t> m_qface_normals;
+  // niveis de detalhe simplificados: m_lods[i] e' o nivel i + 1
+  std::vector<std::unique_ptr<Mesh>> m_lods;
+  // hierarquia de volumes para colisao (so no nivel 0), ver buildBvh
+  std::unique_ptr<Bvh> m_bvh;
+  // copia na GPU, criada no primeiro render: indices dos triangulos
+  // seguidos dos das bordas. Para o flat shading, 3 vertices por face.
+  MeshBuffers m_gpu, m_gpu_flat;
   // construtor vazio. loadMesh deve ser usado neste caso. 
   Mesh();
 
@@ -108,16 +239,43 @@ private:
   // classe esta carregando o mesh
   void renderWire();
   void render(bool wireframe = false, bool gouraud_shading = true);
+  void sendVertex(uint32_t v) const;
+  void sendNormal(uint32_t v) const;
+  void sendTexCoord(uint32_t v) const;
+  void sendFaceNormal(size_t f) const;
+  // atributos em float, decodificados se a mesh for quantizada
+  Point3 position(uint32_t v) const;
+  Point3 normal(uint32_t v) const;
+  Point3 faceNormal(size_t f) const;
+
+  // envia a mesh para a GPU (uma vez so, precisa do contexto GL): false se
+  // o driver nao tem vertex buffer objects
+  bool upload(bool flat);
 
   // use os dois métodos a seguir para configurar o mesh
   void init();
   // bordas: coordenadas minimas e maximas
   void computeBoundingBox();
+  void computeFaceNormals();
   void computeNormalsPerVertex();
+  void computeEdges();
+  // junta vértices com a mesma posição (remapeando os índices)
+  void weldVertices();
+  // um vertice por combinacao distinta de posicao/textura/normal do OBJ
+  // (os vertices nas costuras sao duplicados)
+  void splitVertices(io::ObjData &obj);
+  void optimizeVertexCache();
+
+  // cache binario (.agm) ao lado do OBJ, ver mesh_cache.cxx
+  bool readCache(const char *cache_filename, const char *mesh_filename);
+  void writeCache(const char *cache_filename, const char *mesh_filename,
+                  uint64_t src_hash) const;
 
 public:
   // Funçao amiga  para carregar objeto intrelaçado invés de exportar
   friend std::unique_ptr<Mesh> loadMesh(const char *mesh_filename);
+  ~Mesh(); // Bvh e' incompleto aqui; libera os buffers da GPU
+
   Point3 bbmin, bbmax; // bordas
 
   // renderiza frontend 
@@ -126,11 +284,216 @@ public:
 
   // centro de eixos alinhados
   // Point3 center();
-  Point3 center() { return (bbmin + bbmax) / 2.0; }
+  Point3 center() const { return (bbmin + bbmax) / 2.0; }
+  // raio da esfera que contem o bounding box
+  float radius() const;
+
+  // niveis de detalhe (LOD): o nivel 0 e' a propria mesh, cada nivel
+  // seguinte tem ratio vezes as faces do anterior (quadric error metric)
+  void buildLods(size_t n_levels = 3, float ratio = 0.5f);
+  inline size_t numLods() const { return m_lods.size() + 1; }
+  Mesh &lod(size_t level);
+  // nivel a usar para um diametro projetado na tela de 'pixels'
+  size_t selectLod(float pixels) const;
+
+  // passa para o formato comprimido (tambem os niveis de detalhe)
+  void quantize();
+  inline bool isQuantized() const { return m_quantized; }
+
+  // BVH dos triangulos para as consultas de colisao: deve ser construida
+  // antes de quantize. bvh() e' nullptr se nao foi construida
+  void buildBvh();
+  inline const Bvh *bvh() const { return m_bvh.get(); }
+
+  // accessors (somente leitura)
+  inline size_t numFaces() const { return m_indices.size() / 3; }
+  inline size_t numVertices() const {
+    return m_quantized ? m_qverts.x.size() : m_pos.size();
+  }
+  // vazios se a mesh for quantizada
+  inline const Vec3Array &positions() const { return m_pos; }
+  inline const Vec3Array &normals() const { return m_norm; }
+  inline const std::vector<float> &texCoords() const { return m_uv; }
+  // com coordenadas de textura do OBJ nao precisa de texgen
+  inline bool hasTexCoords() const { return !m_uv.empty(); }
+  inline const std::vector<uint32_t> &indices() const { return m_indices; }
+  inline const Vec3Array &faceNormals() const { return m_face_normals; }
+  inline const std::vector<Edge> &edges() const { return m_edges; }
 };
 
+// nullptr se o arquivo nao existe ou nao e' uma mesh valida (erro no log)
 std::unique_ptr<Mesh> loadMesh(const char *mesh_filename);
 
+/* Carregamento assincrono: loadMeshAsync le a mesh (e chama prepare, se
+ * houver) numa thread de trabalho e devolve um MeshHandle. A thread de
+ * render consulta o handle a cada frame e, enquanto a mesh nao esta pronta,
+ * desenha um placeholder com o bounding box guardado no cache (.agm).
+ */
+class MeshHandle {
+private:
+  std::string m_filename;
+  mutable std::future<std::unique_ptr<Mesh>> m_loading;
+  mutable std::unique_ptr<Mesh> m_mesh;
+  Point3 m_bbmin, m_bbmax; // placeholder
+  bool m_has_bounds;
+  mutable bool m_failed;
+
+public:
+  MeshHandle();
+  MeshHandle(const std::string &filename,
+             std::future<std::unique_ptr<Mesh>> loading, bool has_bounds,
+             const Point3 &bbmin, const Point3 &bbmax);
+
+  // a mesh, ou nullptr se ainda carregando (ou se falhou): nunca bloqueia.
+  // E' aqui que a mesh pronta passa da thread de trabalho para a de render.
+  Mesh *get() const;
+  // o carregamento falhou: fica o placeholder
+  inline bool failed() const { return m_failed; }
+
+  // bounding box do placeholder: false se nao ha cache para le-lo
+  inline bool hasBounds() const { return m_has_bounds; }
+  inline const Point3 &bbmin() const { return m_bbmin; }
+  inline const Point3 &bbmax() const { return m_bbmax; }
+  // bounding box da mesh pronta, ou a do placeholder enquanto carrega:
+  // false se nenhuma das duas e' conhecida
+  bool bounds(Point3 &bbmin, Point3 &bbmax) const;
+};
+
+MeshHandle loadMeshAsync(const char *mesh_filename,
+                         std::function<void(Mesh &)> prepare = nullptr);
+
+// numero de threads usados para ler OBJ grandes (0 = um por core)
+void setMeshLoaderThreads(size_t n_threads);
+size_t getMeshLoaderThreads();
+// reordena faces e vertices dos OBJ para o cache de vertices (padrao: sim)
+void setMeshOptimization(bool enabled);
+bool getMeshOptimization();
+// formato comprimido para as meshes da cena (padrao: nao)
+void setMeshQuantization(bool enabled);
+bool getMeshQuantization();
+// desenha as meshes com vertex buffers e glDrawElements (padrao: sim) ou
+// em modo imediato com glBegin/glEnd
+void setMeshBuffers(bool enabled);
+bool getMeshBuffers();
+
+// primitiva (toro, esfera, cubo, circulo) identificada pelos parametros
+// da tesselacao: raios e numero de segmentos
+struct PrimitiveKey {
+  enum Shape {
+    CIRCLE,
+    CUBE_FILL,
+    CUBE_WIRE,
+    PLANE,
+    SPHERE,
+    SQUARE,
+    TORUS
+  } shape;
+  float a, b; // raios, lado ou altura
+  int n, m;   // segmentos
+  bool operator==(const PrimitiveKey &other) const {
+    return shape == other.shape && a == other.a && b == other.b &&
+           n == other.n && m == other.m;
+  }
+};
+
+struct PrimitiveKeyHash {
+  size_t operator()(const PrimitiveKey &key) const;
+};
+
+// primitiva tesselada uma vez so: vertices (posicao [, normal] [, u v])
+// nos buffers da GPU, ou em memoria central para o modo imediato
+struct Primitive {
+  GLenum mode = GL_TRIANGLES;
+  MeshBuffers buffers;
+  GLsizei count = 0;             // indices (ou vertices se nao ha indices)
+  std::vector<float> vertices;   // so sem buffers
+  std::vector<uint32_t> indices; // vazio: vertices em ordem
+};
+
+// passos da fila de renderizacao, executados nesta ordem: opacos da
+// frente para tras, o fundo (ceu) que so pinta o que sobrou, e os
+// transparentes de tras para frente
+enum class RenderPass { OPAQUE, BACKGROUND, TRANSPARENT, N_PASSES };
+
+// item da fila: chave de ordenacao (passo, material, profundidade) e a
+// funcao que desenha, chamada com a matriz da camera
+struct DrawItem {
+  uint64_t key;
+  std::function<void()> draw;
+};
+
+// por passo, no ultimo frame
+struct PassStats {
+  size_t items = 0;
+  size_t state_changes = 0; // enviadas ao driver (ver Env::setEnabled)
+};
+
+// pipeline de desenho da cena (ver shaders.cxx)
+enum class Pipeline { FIXED_FUNCTION, GLSL };
+
+// luz spot (farol), posicao e direcao nas coordenadas do modelo atual
+struct SpotLight {
+  Point3 position;
+  Vec3 direction;
+  Color diffuse, ambient;
+  float cutoff, exponent; // graus
+  float constant_attenuation, linear_attenuation;
+};
+
+// bloco de uniforms das luzes (std140), nas coordenadas do olho
+// Os valores iniciais sao os do OpenGL.
+struct LightsBlock {
+  GLfloat sun_direction[4] = {0, 0, 1, 0};
+  GLfloat scene_ambient[4] = {.2f, .2f, .2f, 1}; // global + da luz 0
+  GLfloat sun_diffuse[4] = {1, 1, 1, 1};
+  GLfloat sun_specular[4] = {1, 1, 1, 1};
+  GLfloat spot_position[4] = {0, 0, 0, 1};
+  GLfloat spot_direction[4] = {0, 0, -1, 0};
+  GLfloat spot_diffuse[4] = {0, 0, 0, 1};
+  GLfloat spot_ambient[4] = {0, 0, 0, 1};
+  // expoente, atenuacao constante e linear, cos(cutoff)
+  GLfloat spot_params[4] = {0, 1, 0, -1};
+  GLfloat material[4] = {0, 0, 0, 0}; // especular (rgb) e shininess
+  // olho -> coordenadas do shadow map, e quanto escurece a sombra
+  GLfloat eye_to_shadow[16] = {1, 0, 0, 0, 0, 1, 0, 0,
+                               0, 0, 1, 0, 0, 0, 0, 1};
+  GLfloat shadow_params[4] = {1, 0, 0, 0};
+};
+
+// sombra da nave: mancha sob ela ou shadow map (ver shadow_map.cxx)
+enum class ShadowQuality { BLOB, MAP };
+
+// custo do shadow map (ver Env::updateShadowMap)
+struct ShadowStats {
+  size_t updates = 0, reused = 0; // mapas redesenhados / reaproveitados
+  double cpu_ms = 0.0; // ultimo redesenho, do lado da CPU (a GPU: escopo
+                       // "shadow", ver Env::timedScope)
+};
+
+// tempos de um escopo (ver Env::timedScope), nos ultimos frames
+struct TimerStats {
+  double average_ms = 0.0, p50_ms = 0.0, p95_ms = 0.0, max_ms = 0.0;
+  size_t samples = 0;
+};
+
+// escopo medido: tempo por frame dos ultimos frames (anel) e do corrente
+struct FrameTimer {
+  std::string name;
+  std::vector<float> samples;
+  size_t next = 0;
+  double frame_ms = 0.0;
+  bool used = false; // medido no frame corrente
+};
+
+// frames entre uma timer query e a leitura do resultado
+const size_t TIMER_LATENCY = 4;
+
+// programa compilado para uma combinacao de recursos (id 0: falhou)
+struct ShaderProgram {
+  GLuint id = 0;
+  GLint modelview_loc = -1, normal_matrix_loc = -1, color_loc = -1;
+};
+
 using game::Key;        // chave padrao 
 using game::MouseEvent; // chave padrao para eventos do mouse
 
@@ -161,9 +524,121 @@ private:
   std::function<void(game::Key)> m_key_up_handler, m_key_down_handler;
   std::function<void(game::MouseEvent, int32_t, int32_t)> m_mouse_event_handler;
 
+  // cache das primitivas de desenho (ver drawPrimitive)
+  std::unordered_map<PrimitiveKey, Primitive, PrimitiveKeyHash> m_primitives;
+  size_t m_primitive_hits, m_primitive_misses;
+
+  // desenha a primitiva key, tesselada por tessellate (vertices, indices,
+  // mode e buffers.normals) somente na primeira vez
+  void drawPrimitive(const PrimitiveKey &key,
+                     const std::function<void(Primitive &)> &tessellate);
+  void renderPrimitive(const Primitive &prim);
+
+  // instancias desenhadas por instancedDrawing, nullptr fora dele
+  InstanceBuffer *m_instances;
+  size_t m_instance_count;
+  // shader das instancias: 0 se ainda nao compilado, -1 se nao suportado
+  GLint m_instance_program;
+  GLint m_lighting_loc, m_instance_color_loc;
+  GLint m_instance_shadow_loc, m_instance_eye_to_shadow_loc,
+      m_instance_darkness_loc;
+
+  void renderInstances(const Primitive &prim);
+  bool instanceProgram();
+
+  // copia do estado GL (ver gl_state.cxx)
+  bool m_state_cache;
+  std::unordered_map<GLenum, bool> m_caps;
+  TexID m_texture;
+  GLenum m_blend_src, m_blend_dst;
+  bool m_texture_known, m_blend_known;
+  // mudancas de estado enviadas ao driver / filtradas: frame corrente e
+  // ultimo frame completo
+  size_t m_state_issued, m_state_filtered;
+  size_t m_last_issued, m_last_filtered;
+
+  void newStateFrame();
+
+  // fila de renderizacao (ver render_queue.cxx)
+  std::vector<DrawItem> m_queue;
+  GLfloat m_view[16]; // matriz da camera quando a fila foi aberta
+  PassStats m_pass_stats[size_t(RenderPass::N_PASSES)];
+  // planos do frustum nas coordenadas do mundo (a, b, c, d normalizados,
+  // normal para dentro), extraidos em beginQueue
+  GLfloat m_frustum[6][4];
+  bool m_culling;
+  size_t m_visible, m_culled; // esferas testadas no frame corrente
+
+  // pipeline GLSL (ver shaders.cxx)
+  Pipeline m_pipeline;
+  bool m_shading; // desenhando a fila com os shaders
+  GLuint m_program;
+  bool m_program_known;
+  // um programa por combinacao de recursos (iluminacao, textura...)
+  std::unordered_map<uint32_t, ShaderProgram> m_programs;
+  // blocos de uniforms compartilhados: 0 se ainda nao criados
+  GLuint m_camera_ubo, m_lights_ubo;
+  GLfloat m_camera[16]; // projecao enviada no bloco da camera
+  LightsBlock m_lights;
+  bool m_lights_dirty;
+  GLenum m_spot_light; // luz do spot no bloco, 0 se nenhuma
+
+  bool shadersSupported();
+  const ShaderProgram &shaderProgram(uint32_t features);
+  void releaseShaders();
+
+  // shadow map (ver shadow_map.cxx)
+  ShadowQuality m_shadow_quality;
+  GLsizei m_shadow_size;
+  GLuint m_shadow_fbo, m_shadow_tex; // 0 se ainda nao criados
+  bool m_shadow_valid;    // o mapa tem o caster de m_shadow_caster
+  bool m_shadow_frame;    // o mapa vale para o frame corrente
+  bool m_shadow_receiver; // desenhando dentro de shadowedDrawing
+  GLfloat m_shadow_caster[4];  // esfera do caster no ultimo mapa
+  GLfloat m_shadow_matrix[16]; // mundo -> coordenadas do shadow map
+  ShadowStats m_shadow_stats;
+
+  bool shadowMapSupported();
+  // recebedores: sombra do frame corrente (chamado por flushQueue)
+  void prepareShadowReceivers();
+  void releaseShadowMap();
+
+  // ritmo dos frames (ver frame_pacing.cxx)
+  std::deque<GLsync> m_frame_fences; // frames enviados, nao terminados
+  size_t m_frames_in_flight;
+  double m_frame_wait_ms, m_frame_wait_avg_ms; // CPU esperando a GPU
+
+  void releaseFrameFences();
+
+  // tempos por escopo (ver gpu_timer.cxx)
+  std::vector<FrameTimer> m_timers;
+  bool m_gpu_timing, m_timing_known; // timer queries, ou tempo de CPU
+  bool m_timer_active;               // dentro de timedScope
+  std::vector<GLuint> m_free_queries;
+  // queries de cada um dos ultimos frames: (timer, query)
+  std::vector<std::pair<size_t, GLuint>> m_timer_queries[TIMER_LATENCY];
+  size_t m_timer_frame;
+  double m_last_timer_log; // segundos
+
+  FrameTimer &frameTimer(const char *name);
+  void logTimers(const char *tag) const;
+  void releaseTimers();
+
+  // frames desenhados por render(), e o limite (0: sem limite)
+  size_t m_frames, m_frame_limit;
+
+  // pilhas das matrizes, o topo e' a corrente (ver matrices.cxx)
+  std::vector<Matrix4> m_modelview, m_projection;
+  GLenum m_matrix_mode;
+  Color m_color; // cor corrente (setColor), para os shaders
+
+  std::vector<Matrix4> &matrixStack();
+  void multMatrix(const Matrix4 &m);
+  void loadMatrix(); // o topo da pilha corrente vai ao GL
+
 public:
   // expoes janelas de ambiente fora da classe
-  bool m_wireframe, m_envmap, m_headlight, m_shadow, m_blending;
+  bool m_wireframe, m_envmap, m_headlight, m_shadow, m_blending, m_lod_debug;
 
   // Amigos podem modificar partes privadas.
   friend Env &get_env();
@@ -177,10 +652,19 @@ public:
   inline decltype(m_headlight) isHeadlight() { return m_headlight; }
   inline decltype(m_shadow) isShadow() { return m_shadow; }
   inline decltype(m_blending) isBlending() { return m_blending; }
+  inline decltype(m_lod_debug) isLodDebug() { return m_lod_debug; }
   inline decltype(m_screenH) get_win_height() { return m_screenH; }
   inline decltype(m_screenW) get_win_width() { return m_screenW; }
   inline decltype(m_fps) get_fps() { return m_fps; }
 
+  // estatisticas do cache de primitivas
+  inline size_t primitiveCacheSize() const { return m_primitives.size(); }
+  size_t primitiveCacheBytes() const;
+  double primitiveHitRate() const;
+  // libera os buffers das primitivas, os shaders, o shadow map, as cercas
+  // dos frames e as timer queries (antes de destruir o contexto GL)
+  void releasePrimitives();
+
   /*
     inline decltype(m_eye_dist) eyeDist() { return m_eye_dist; }
     inline decltype(m_view_alpha) alpha() {return m_view_alpha; }
@@ -191,6 +675,7 @@ public:
   inline void toggle_headlight() { m_headlight = !m_headlight; }
   inline void toggle_shadow() { m_shadow = !m_shadow; }
   inline void toggle_blending() { m_blending = !m_blending; }
+  inline void toggle_lod_debug() { m_lod_debug = !m_lod_debug; }
 
   // Setters callbacks
   // Default: vazio
@@ -214,6 +699,8 @@ public:
   void drawCircle(double cx, double cy, double radius);
   void drawCubeFill(const float side);
   void drawCubeWire(const float side);
+  // placeholder: caixa em wireframe entre min e max
+  void drawBoundingBox(const Point3 &min, const Point3 &max);
   void drawCube(const float side);
   void drawFloor(TexID texbind, float sz, float height, size_t num_quads);
   void drawPlane(float sz, float height, size_t num_quads);
@@ -223,8 +710,98 @@ public:
   void drawSquare(const float side);
   void drawTorus(double r, double R);
 
-  inline void disableLighting() { glDisable(GL_LIGHTING); }
-  inline void enableLighting() { glEnable(GL_LIGHTING); }
+  inline void disableLighting() { disable(GL_LIGHTING); }
+  inline void enableLighting() { enable(GL_LIGHTING); }
+
+  // mudancas de estado GL, ignoradas se nao mudam nada
+  void setEnabled(GLenum cap, bool enabled);
+  inline void enable(GLenum cap) { setEnabled(cap, true); }
+  inline void disable(GLenum cap) { setEnabled(cap, false); }
+  bool isEnabled(GLenum cap);
+  void bindTexture(TexID texbind);
+  void deleteTexture(TexID texbind);
+  void blendFunc(GLenum src, GLenum dst);
+  // esquece o estado conhecido (novo contexto GL)
+  void invalidateState();
+  // desligado: todas as mudancas vao ao driver (para comparacao)
+  void setStateCache(bool enabled);
+  void useProgram(GLuint program);
+
+  // Pipeline da cena: com GLSL os desenhos da fila (flushQueue) usam os
+  // shaders de shaders.cxx em vez da iluminacao e do texgen fixos
+  void setPipeline(Pipeline pipeline);
+  inline Pipeline pipeline() const { return m_pipeline; }
+  // chamado antes de cada desenho da cena: liga o programa para o estado
+  // corrente (iluminacao, textura, texgen, spot) e a matriz do modelo.
+  // instanced: para as instancias de instancedDrawing. false se nenhum
+  // programa foi ligado (fora da fila, pipeline fixo ou erro)
+  bool applyProgram(bool instanced = false);
+
+  // Fila de renderizacao: beginQueue guarda a matriz da camera, submit
+  // enfileira um desenho (material: textura ou 0, center: nas coordenadas
+  // do mundo, para a profundidade) e flushQueue ordena e desenha tudo
+  void beginQueue();
+  void submit(RenderPass pass, uint32_t material, const Point3 &center,
+              std::function<void()> draw);
+  void flushQueue();
+  // distancia do ponto ao olho, ao longo da direcao de visao
+  float eyeDepth(const Point3 &center) const;
+  inline const PassStats &passStats(RenderPass pass) const {
+    return m_pass_stats[size_t(pass)];
+  }
+  // a esfera (coordenadas do mundo) toca o frustum da camera de beginQueue?
+  // Conta os visiveis e os descartados. Com culling desligado e' sempre true
+  bool isVisible(const Point3 &center, float radius);
+  void setCulling(bool enabled);
+  inline bool isCulling() const { return m_culling; }
+  inline size_t visibleCount() const { return m_visible; }
+  inline size_t culledCount() const { return m_culled; }
+
+  // Sombra da nave: MAP precisa do pipeline GLSL e de framebuffer objects,
+  // senao (ou com BLOB) a nave desenha so uma mancha
+  inline void setShadowQuality(ShadowQuality quality) {
+    m_shadow_quality = quality;
+  }
+  inline ShadowQuality shadowQuality() const { return m_shadow_quality; }
+  // resolucao do shadow map (lado, em texels)
+  void setShadowMapSize(size_t size);
+  bool isShadowMapActive();
+  // redesenha o shadow map com draw (o caster nas coordenadas do mundo)
+  // somente se moved ou se a esfera do caster mudou; senao reaproveita
+  void updateShadowMap(const Point3 &center, float radius, bool moved,
+                       std::function<void()> draw);
+  // os desenhos de callback recebem a sombra (chao, aneis, cubos)
+  void shadowedDrawing(std::function<void()> callback);
+  inline const ShadowStats &shadowStats() const { return m_shadow_stats; }
+
+  // mudancas de estado no ultimo frame
+  inline size_t stateChangesIssued() const { return m_last_issued; }
+  inline size_t stateChangesFiltered() const { return m_last_filtered; }
+
+  // Ritmo dos frames: no maximo n (1-3) frames enviados a GPU e ainda nao
+  // terminados. Com 1 a CPU espera cada frame (como glFinish), com 2 ou 3
+  // prepara o proximo enquanto a GPU termina o anterior (mais latencia)
+  void setFramesInFlight(size_t n);
+  inline size_t framesInFlight() const { return m_frames_in_flight; }
+  // chamado depois de cada swap (SmartWindow::refresh)
+  void paceFrame();
+  // tempo que a CPU esperou a GPU no ultimo frame, e a media
+  inline double frameWaitMs() const { return m_frame_wait_ms; }
+  inline double frameWaitAverageMs() const { return m_frame_wait_avg_ms; }
+
+  // Tempos por escopo: os desenhos de callback contam para name (na GPU
+  // com timer queries, senao na CPU). Escopos aninhados contam no externo
+  void timedScope(const char *name, std::function<void()> callback);
+  // fecha o frame dos tempos, chamado por render() a cada frame
+  void newTimerFrame();
+  TimerStats timerStats(const std::string &name) const;
+  std::vector<std::string> timerNames() const; // na ordem do primeiro uso
+  inline bool isGpuTiming() const { return m_gpu_timing; }
+
+  // renderLoop termina depois de frames frames (0: so com SDL_QUIT), e
+  // registra a media de fps e os tempos: para rodar sem ninguem no teclado
+  inline void setFrameLimit(size_t frames) { m_frame_limit = frames; }
+  inline size_t frameCount() const { return m_frames; }
 
   void enableDoubleBuffering();
   void enableVSync();
@@ -234,8 +811,11 @@ public:
   Uint32 getTicks();
 
   void lineWidth(float width);
-  // Carrega a textura e retorna um boleano se der certo, deve se mudar para
-  // retornar o ID da textura 
+
+  // diametro em pixels da esfera (center, radius) dada nas coordenadas
+  // do modelo atual (usado para escolher o nivel de detalhe)
+  float projectedSize(const Point3 &center, float radius);
+  // Carrega a textura e retorna o ID da textura, 0 se nao foi possivel
   TexID loadTexture(const char *filename, bool repeat = false,
                     bool nearest = false);
 
@@ -253,6 +833,18 @@ public:
   void renderLoop();
   void quitLoop();
 
+  // Matrizes: como glMatrixMode, glLoadIdentity, glPushMatrix... mas
+  // guardadas no Env, de onde os shaders as leem
+  void matrixMode(GLenum mode);
+  void loadIdentity();
+  void pushMatrix();
+  void popMatrix();
+  void perspective(double fovy, double aspect, double z_near, double z_far);
+  void ortho(double left, double right, double bottom, double top,
+             double z_near, double z_far);
+  inline const Matrix4 &modelview() const { return m_modelview.back(); }
+  inline const Matrix4 &projection() const { return m_projection.back(); }
+
   void rotate(float angle, const Vec3 &axis);
   void scale(float scale_x, float scale_y, float scale_z);
 
@@ -271,12 +863,21 @@ public:
   // Configura as luzes
   void setupLightPosition();
   void setupModelLights();
+  void setupSpotLight(GLenum light, const SpotLight &spot);
 
   void translate(float scale_x, float scale_y, float scale_z);
 
   // desenha a testura
   void textureDrawing(TexID texbind, std::function<void()> callback,
                       bool gen_coordinates = true);
+  // as primitivas desenhadas em callback sao repetidas para as primeiras
+  // count instancias, com uma so chamada instanciada se o driver permite
+  void instancedDrawing(InstanceBuffer &instances, size_t count,
+                        std::function<void()> callback);
+  // desenha um nivel de detalhe: com textura ou, em modo debug, com a cor
+  // do nivel (LOD_COLORS). gen_coordinates como em textureDrawing
+  void lodDrawing(TexID texbind, size_t level, std::function<void()> callback,
+                  bool gen_coordinates = true);
 };
 
 // returna isntancia do singleton 
@@ -295,6 +896,18 @@ private:
   std::string m_name;        // nome da janela
   Env &m_env;
 
+  // sem janela (ver headless.cxx): contexto EGL e framebuffer object onde
+  // os frames sao desenhados. Os tipos EGL sao ponteiros, sem o egl.h aqui
+  bool m_headless;
+  void *m_egl_display, *m_egl_surface, *m_egl_context;
+  GLuint m_fbo, m_fbo_buffers[2]; // cor e profundidade
+  size_t m_frame;                 // frames mostrados, para os dumps
+
+  void createHeadlessContext();
+  void createHeadlessFramebuffer();
+  void releaseHeadlessContext();
+  void dumpFrame();
+
 public:
   size_t m_width, m_height;
 
@@ -310,6 +923,17 @@ public:
   void textureWindow(TexID texbind);
 };
 
+// Sem janela nem display: a SmartWindow desenha num framebuffer object de
+// um contexto EGL (surfaceless ou pbuffer, Mesa llvmpipe serve). Chamar
+// antes de get_env(): o SDL inicia com o driver de video dummy
+void setHeadless(bool enabled);
+bool getHeadless();
+// sem janela, grava um frame a cada every frames em dir/frame_NNNNN.ppm
+// (every 0: nenhum). O dump espera o frame: deixar desligado ao medir
+void setFrameDump(const std::string &dir, size_t every = 1);
+// ha um contexto GL corrente (janela SDL ou EGL sem janela)
+bool hasGLContext();
+
 /* __FONTS__
   * Uma biblioteca leve e rápida para carregar e usar TTF em OpenGL.
   * A única maneira de renderizar TTF no OpenGL é renderizar cada glifo como uma textura,
@@ -394,6 +1018,51 @@ public:
 // AGLTextRenderer *getTextRenderer(const char *font_path, size_t font_size);
 std::unique_ptr<AGLTextRenderer> getTextRenderer(const char *font_path,
                                                  size_t font_size);
+
+// textura compartilhada: liberada quando a ultima referencia some
+using TexRef = std::shared_ptr<const TexID>;
+
+/* Registro de assets (meshes, texturas, fontes) indexados pelo caminho.
+ * Quem pede um asset ainda carregado recebe o mesmo (contagem de
+ * referencias), assim reiniciar o jogo ou trocar de nave nao recarrega
+ * nada. O registro guarda so referencias fracas: o asset e' liberado
+ * quando o ultimo usuario o solta.
+ */
+class Assets final {
+private:
+  std::unordered_map<std::string, std::weak_ptr<const TexID>> m_textures;
+  std::unordered_map<std::string, std::weak_ptr<MeshHandle>> m_meshes;
+  std::unordered_map<std::string, std::weak_ptr<AGLTextRenderer>> m_fonts;
+  size_t m_hits, m_misses;
+
+  Assets();
+
+  // busca em um dos mapas, carregando com load() se necessario
+  template <typename T, typename Load>
+  std::shared_ptr<T>
+  lookup(std::unordered_map<std::string, std::weak_ptr<T>> &map,
+         const std::string &key, Load load);
+
+public:
+  friend Assets &get_assets();
+
+  // textura 0 se a imagem nao carrega: nao fica no registro, e' tentada de
+  // novo na proxima vez
+  TexRef texture(const char *filename, bool repeat = false,
+                 bool nearest = false);
+  // prepare so e' usado no primeiro carregamento
+  std::shared_ptr<MeshHandle>
+  mesh(const char *filename, std::function<void(Mesh &)> prepare = nullptr);
+  std::shared_ptr<AGLTextRenderer> font(const char *filename, size_t size);
+
+  // estatisticas
+  inline size_t hits() const { return m_hits; }
+  inline size_t misses() const { return m_misses; }
+  size_t resident() const; // assets ainda em uso
+};
+
+// instancia unica do registro
+Assets &get_assets();
 } // namespace agl
 
 #endif // AGL_H
\ No newline at end of file
@@ -0,0 +1,92 @@
+#include "agl.h"
+
+/*
+ * Shared asset registry. See agl.h
+ */
+
+namespace agl {
+
+Assets &get_assets() {
+  static std::unique_ptr<Assets> s_assets(nullptr);
+  if (!s_assets) {
+    s_assets.reset(new Assets());
+  }
+
+  return *s_assets;
+}
+
+Assets::Assets() : m_hits(0), m_misses(0) {}
+
+template <typename T, typename Load>
+std::shared_ptr<T>
+Assets::lookup(std::unordered_map<std::string, std::weak_ptr<T>> &map,
+               const std::string &key, Load load) {
+  static const auto TAG = __func__;
+
+  auto &entry = map[key];
+  if (auto asset = entry.lock()) {
+    ++m_hits;
+    return asset;
+  }
+
+  ++m_misses;
+  lg::i(TAG, "Asset %s not resident, loading it", key.c_str());
+  std::shared_ptr<T> asset = load();
+  entry = asset;
+  return asset;
+}
+
+TexRef Assets::texture(const char *filename, bool repeat, bool nearest) {
+  // the same image with different sampling is a different texture
+  std::string key = std::string(filename) + (repeat ? "|repeat" : "") +
+                    (nearest ? "|nearest" : "");
+
+  TexRef tex = lookup(m_textures, key, [&] {
+    TexID id = get_env().loadTexture(filename, repeat, nearest);
+    return TexRef(new TexID(id), [](const TexID *tex) {
+      // nothing to free if the GL context is already gone, or if the
+      // image never loaded
+      if (*tex != 0 && hasGLContext()) {
+        get_env().deleteTexture(*tex);
+      }
+      delete tex;
+    });
+  });
+  // a failed load is not cached: it is tried again next time
+  if (*tex == 0) {
+    m_textures.erase(key);
+  }
+  return tex;
+}
+
+std::shared_ptr<MeshHandle>
+Assets::mesh(const char *filename, std::function<void(Mesh &)> prepare) {
+  return lookup(m_meshes, filename, [&] {
+    return std::make_shared<MeshHandle>(loadMeshAsync(filename, prepare));
+  });
+}
+
+std::shared_ptr<AGLTextRenderer> Assets::font(const char *filename,
+                                              size_t size) {
+  std::string key = std::string(filename) + "|" + std::to_string(size);
+
+  return lookup(m_fonts, key, [&] {
+    return std::shared_ptr<AGLTextRenderer>(getTextRenderer(filename, size));
+  });
+}
+
+size_t Assets::resident() const {
+  size_t count = 0;
+  for (const auto &entry : m_textures) {
+    count += !entry.second.expired();
+  }
+  for (const auto &entry : m_meshes) {
+    count += !entry.second.expired();
+  }
+  for (const auto &entry : m_fonts) {
+    count += !entry.second.expired();
+  }
+  return count;
+}
+
+} // namespace agl
@@ -0,0 +1,820 @@
+#include "bench.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "agl.h"
+#include "bvh.h"
+#include "elements.h"
+#include "mesh_io.h"
+#include "mesh_kernels.h"
+
+/*
+ * Benchmarks. Each one is a function taking its own command line arguments
+ * and printing a small report on stdout. See bench.h
+ */
+
+namespace bench {
+
+namespace {
+
+using clock = std::chrono::steady_clock;
+
+// milliseconds spent by fn, best of n_runs
+double bestOf(size_t n_runs, const std::function<void()> &fn) {
+  double best = INFINITY;
+  for (size_t i = 0; i < n_runs; ++i) {
+    auto start = clock::now();
+    fn();
+    std::chrono::duration<double, std::milli> elapsed = clock::now() - start;
+    best = std::min(best, elapsed.count());
+  }
+  return best;
+}
+
+size_t argOr(int argc, char **argv, int i, size_t fallback) {
+  return argc > i ? std::strtoul(argv[i], nullptr, 10) : fallback;
+}
+
+// Synthetic OBJ: a grid x grid heightfield made of quads, using the v/t/n
+// face syntax so that the tokenizer has to skip texture and normal indices.
+std::string syntheticObj(size_t grid) {
+  std::string obj;
+  obj.reserve(grid * grid * 80);
+
+  char line[128];
+  for (size_t z = 0; z < grid; ++z) {
+    for (size_t x = 0; x < grid; ++x) {
+      int n = std::snprintf(line, sizeof(line), "v %.6f %.6f %.6f\n",
+                            x * 0.01, std::sin(x * 0.1) * std::cos(z * 0.1),
+                            z * 0.01);
+      obj.append(line, n);
+    }
+  }
+  obj.append("vt 0 0\nvn 0 1 0\n");
+  for (size_t z = 0; z + 1 < grid; ++z) {
+    for (size_t x = 0; x + 1 < grid; ++x) {
+      size_t a = z * grid + x + 1, b = a + 1, c = a + grid + 1, d = a + grid;
+      int n = std::snprintf(line, sizeof(line),
+                            "f %zu/1/1 %zu/1/1 %zu/1/1 %zu/1/1\n", a, b, c, d);
+      obj.append(line, n);
+    }
+  }
+  return obj;
+}
+
+// Removes a synthetic OBJ and the cache written by its load
+void removeObj(const std::string &obj_filename) {
+  std::remove(obj_filename.c_str());
+  std::remove(agl::io::cachePath(obj_filename.c_str()).c_str());
+}
+
+// The grid of syntheticObj with about n_tris triangles, written to
+// /tmp/<name>.obj and loaded as a scene mesh would be. nullptr if the load
+// failed.
+std::unique_ptr<agl::Mesh> loadSyntheticMesh(const char *name, size_t n_tris) {
+  std::string obj_filename = std::string("/tmp/") + name + ".obj";
+  size_t grid = size_t(std::ceil(std::sqrt(n_tris / 2.0))) + 1;
+  std::ofstream(obj_filename) << syntheticObj(grid);
+  auto mesh = agl::loadMesh(obj_filename.c_str());
+  removeObj(obj_filename);
+  return mesh;
+}
+
+// A 2x2 checkerboard in place of the textures of the game
+agl::TexID checkerTexture(bool repeat) {
+  const GLubyte texels[] = {255, 255, 255, 64, 64, 64, 64, 64, 64, 255, 255,
+                            255};
+  agl::TexID tex;
+  glGenTextures(1, &tex);
+  agl::get_env().bindTexture(tex);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 2, 2, 0, GL_RGB, GL_UNSIGNED_BYTE,
+               texels);
+  if (repeat) {
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+  }
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  return tex;
+}
+
+// The projection of Env::setupPersp for the 800x600 window, and an identity
+// model view
+void benchPerspective(double z_far) {
+  auto &env = agl::get_env();
+  env.matrixMode(GL_PROJECTION);
+  env.loadIdentity();
+  env.perspective(70, 800.0 / 600.0, .2, z_far);
+  env.matrixMode(GL_MODELVIEW);
+  env.loadIdentity();
+}
+
+// OBJ parsing throughput with 1..N worker threads
+// args: [grid size = 1500] [max threads = cores]
+int objThreads(int argc, char **argv) {
+  size_t grid = argOr(argc, argv, 1, 1500);
+  size_t max_threads =
+      argOr(argc, argv, 2, std::max(1U, std::thread::hardware_concurrency()));
+
+  std::printf("generating a %zux%zu grid OBJ...\n", grid, grid);
+  auto obj = syntheticObj(grid);
+  double mbytes = obj.size() / (1024.0 * 1024.0);
+  std::printf("%.1f MB, %zu vertices, %zu triangles\n\n", mbytes, grid * grid,
+              2 * (grid - 1) * (grid - 1));
+
+  std::printf("%8s %12s %12s %10s\n", "threads", "time (ms)", "MB/s",
+              "speedup");
+  double single = 0.0;
+  for (size_t n = 1; n <= max_threads; ++n) {
+    double ms = bestOf(3, [&] {
+      agl::io::ObjData data;
+      if (!agl::io::parseObjParallel(obj.data(), obj.data() + obj.size(), data,
+                                     n)) {
+        std::exit(EXIT_FAILURE);
+      }
+    });
+    single = n == 1 ? ms : single;
+    std::printf("%8zu %12.1f %12.1f %9.2fx\n", n, ms, mbytes / (ms / 1000.0),
+                single / ms);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+// Synthetic mesh: a heightfield grid with (at least) n_tris triangles
+void syntheticMesh(size_t n_tris, agl::Vec3Array &pos,
+                   std::vector<uint32_t> &indices) {
+  size_t grid = size_t(std::ceil(std::sqrt(n_tris / 2.0))) + 1;
+
+  pos.resize(0);
+  pos.reserve(grid * grid);
+  for (size_t z = 0; z < grid; ++z) {
+    for (size_t x = 0; x < grid; ++x) {
+      pos.push_back(x * 0.01f, std::sin(x * 0.1f) * std::cos(z * 0.1f),
+                    z * 0.01f);
+    }
+  }
+
+  indices.clear();
+  indices.reserve(6 * (grid - 1) * (grid - 1));
+  for (size_t z = 0; z + 1 < grid; ++z) {
+    for (size_t x = 0; x + 1 < grid; ++x) {
+      uint32_t a = z * grid + x, b = a + 1, c = a + grid + 1, d = a + grid;
+      indices.insert(indices.end(), {a, c, b, a, d, c});
+    }
+  }
+  indices.resize(std::min(indices.size(), 3 * n_tris));
+}
+
+// The same per-mesh work done with the old array-of-structures layout and
+// the Point3 operators: face normals, vertex normals, bounding box.
+void normalsAoS(std::vector<agl::Vertex> &verts,
+                const std::vector<uint32_t> &indices,
+                std::vector<agl::Normal3> &face_normals, agl::Point3 &min,
+                agl::Point3 &max) {
+  size_t n_faces = indices.size() / 3;
+  face_normals.resize(n_faces);
+  for (size_t f = 0; f < n_faces; ++f) {
+    const auto &p0 = verts[indices[3 * f]].point;
+    const auto &p1 = verts[indices[3 * f + 1]].point;
+    const auto &p2 = verts[indices[3 * f + 2]].point;
+    auto n = -((p1 - p0) % (p2 - p0)).normalize();
+    face_normals[f] = agl::Normal3(n.x, n.y, n.z);
+  }
+
+  for (auto &v : verts) {
+    v.normal = agl::Normal3(0, 0, 0);
+  }
+  for (size_t f = 0; f < n_faces; ++f) {
+    for (size_t k = 0; k < 3; ++k) {
+      verts[indices[3 * f + k]].normal += face_normals[f];
+    }
+  }
+  for (auto &v : verts) {
+    auto n = v.normal.normalize();
+    v.normal = agl::Normal3(n.x, n.y, n.z);
+  }
+
+  min = max = verts[0].point;
+  for (const auto &v : verts) {
+    min = agl::Point3(std::min(min.x, v.point.x), std::min(min.y, v.point.y),
+                      std::min(min.z, v.point.z));
+    max = agl::Point3(std::max(max.x, v.point.x), std::max(max.y, v.point.y),
+                      std::max(max.z, v.point.z));
+  }
+}
+
+// Face normals + vertex normals + bounding box, array-of-structures against
+// structure-of-arrays with each of the supported instruction sets
+// args: [max triangles = 10000000]
+int meshNormals(int argc, char **argv) {
+  using namespace agl::kernels;
+  size_t max_tris = argOr(argc, argv, 1, 10000000);
+
+  std::printf("%10s %10s", "triangles", "AoS (ms)");
+  for (int isa = SCALAR; isa <= bestIsa(); ++isa) {
+    std::printf(" %10s", (std::string(isaName(Isa(isa))) + " (ms)").c_str());
+  }
+  std::printf(" %10s\n", "speedup");
+
+  Isa initial = currentIsa();
+  for (size_t n_tris = 10000; n_tris <= max_tris; n_tris *= 10) {
+    agl::Vec3Array pos;
+    std::vector<uint32_t> indices;
+    syntheticMesh(n_tris, pos, indices);
+    size_t n_faces = indices.size() / 3;
+    size_t n_runs = std::max<size_t>(3, 10000000 / n_tris);
+
+    std::vector<agl::Vertex> verts;
+    verts.reserve(pos.size());
+    for (size_t i = 0; i < pos.size(); ++i) {
+      verts.emplace_back(pos.at(i));
+    }
+    std::vector<agl::Normal3> aos_face_normals;
+    agl::Point3 min, max;
+    double aos = bestOf(n_runs, [&] {
+      normalsAoS(verts, indices, aos_face_normals, min, max);
+    });
+    std::printf("%10zu %10.2f", n_faces, aos);
+
+    agl::Vec3Array face_normals, normals;
+    face_normals.resize(n_faces);
+    normals.resize(pos.size());
+    double best = INFINITY;
+    for (int isa = SCALAR; isa <= bestIsa(); ++isa) {
+      setIsa(Isa(isa));
+      double ms = bestOf(n_runs, [&] {
+        faceNormals(pos, indices.data(), n_faces, face_normals);
+        accumulateNormals(face_normals, indices.data(), n_faces, normals);
+        normalize(normals);
+        bounds(pos, min, max);
+      });
+      best = std::min(best, ms);
+      std::printf(" %10.2f", ms);
+    }
+    std::printf(" %9.2fx\n", aos / best);
+  }
+  setIsa(initial);
+
+  return EXIT_SUCCESS;
+}
+
+// Segment against every triangle, the reference for the BVH
+bool segmentBruteForce(const agl::Vec3Array &pos,
+                       const std::vector<uint32_t> &indices,
+                       const agl::Point3 &from, const agl::Point3 &to) {
+  auto dot = [](const agl::Point3 &a, const agl::Point3 &b) {
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+  };
+  agl::Point3 dir = to - from;
+  for (size_t f = 0; f < indices.size() / 3; ++f) {
+    agl::Point3 p0 = pos.at(indices[3 * f]);
+    agl::Point3 e1 = pos.at(indices[3 * f + 1]) - p0;
+    agl::Point3 e2 = pos.at(indices[3 * f + 2]) - p0;
+    agl::Point3 p = dir % e2, s = from - p0, q = s % e1;
+    float det = dot(e1, p);
+    if (std::fabs(det) < 1e-12f) {
+      continue;
+    }
+    float u = dot(s, p) / det, v = dot(dir, q) / det, t = dot(e2, q) / det;
+    if (u >= 0 && v >= 0 && u + v <= 1 && t >= 0 && t <= 1) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// BVH build time and cost of the collision queries: short segments (a
+// physics step of the ship), segments through the whole mesh and oriented
+// boxes, against brute force for the segments
+// args: [max triangles = 1000000] [queries = 100000]
+int bvhQueries(int argc, char **argv) {
+  size_t max_tris = argOr(argc, argv, 1, 1000000);
+  size_t n_queries = std::max<size_t>(argOr(argc, argv, 2, 100000), 1);
+  const size_t N_BRUTE = 200; // brute force queries, it is slow
+
+  std::printf("%10s %10s %8s %12s %12s %10s %12s %10s\n", "triangles",
+              "build (ms)", "nodes", "step (ns)", "long (ns)", "obb (ns)",
+              "brute (ns)", "hits");
+
+  for (size_t n_tris = 10000; n_tris <= max_tris; n_tris *= 10) {
+    agl::Vec3Array pos;
+    std::vector<uint32_t> indices;
+    syntheticMesh(n_tris, pos, indices);
+
+    std::unique_ptr<agl::Bvh> bvh;
+    double build = bestOf(3, [&] { bvh.reset(new agl::Bvh(pos, indices)); });
+
+    // the heightfield spans x, z in [0, extent], y in [-1, 1]
+    float extent = pos.x.back();
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> coord(0.0f, extent);
+    std::uniform_real_distribution<float> height(-1.2f, 1.2f);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+    auto randomDir = [&](float length) {
+      agl::Point3 d(unit(rng), unit(rng), unit(rng));
+      return d.normalize() / (1.0f / length);
+    };
+
+    std::vector<agl::Point3> steps(2 * n_queries), longs(2 * n_queries);
+    for (size_t q = 0; q < n_queries; ++q) {
+      steps[2 * q] = agl::Point3(coord(rng), height(rng), coord(rng));
+      steps[2 * q + 1] = steps[2 * q] + randomDir(extent * 0.02f);
+      longs[2 * q] = agl::Point3(coord(rng), 1.5f, coord(rng));
+      longs[2 * q + 1] = agl::Point3(coord(rng), -1.5f, coord(rng));
+    }
+    std::vector<agl::Obb> boxes(n_queries);
+    for (auto &box : boxes) {
+      box.center = agl::Point3(coord(rng), height(rng), coord(rng));
+      box.axis[0] = randomDir(1.0f);
+      box.axis[1] = (box.axis[0] % randomDir(1.0f)).normalize();
+      box.axis[2] = box.axis[0] % box.axis[1];
+      box.half[0] = box.half[1] = box.half[2] = extent * 0.01f;
+    }
+
+    size_t hits = 0;
+    auto perQuery = [&](const std::function<bool(size_t)> &query) {
+      double ms = bestOf(3, [&] {
+        hits = 0;
+        for (size_t q = 0; q < n_queries; ++q) {
+          hits += query(q);
+        }
+      });
+      return ms * 1e6 / n_queries;
+    };
+    double step = perQuery([&](size_t q) {
+      return bvh->intersectSegment(steps[2 * q], steps[2 * q + 1]);
+    });
+    double lng = perQuery([&](size_t q) {
+      return bvh->intersectSegment(longs[2 * q], longs[2 * q + 1]);
+    });
+    size_t long_hits = hits;
+    double obb = perQuery([&](size_t q) { return bvh->intersectObb(boxes[q]); });
+
+    // brute force on the first long segments: must agree with the BVH
+    size_t n_brute = std::min(n_queries, N_BRUTE), mismatches = 0;
+    double brute = bestOf(1, [&] {
+      for (size_t q = 0; q < n_brute; ++q) {
+        bool hit = segmentBruteForce(pos, indices, longs[2 * q],
+                                     longs[2 * q + 1]);
+        mismatches += hit != bvh->intersectSegment(longs[2 * q],
+                                                   longs[2 * q + 1]);
+      }
+    }) * 1e6 / n_brute;
+
+    std::printf("%10zu %10.2f %8zu %12.1f %12.1f %10.1f %12.0f %9.1f%%\n",
+                bvh->numTriangles(), build, bvh->numNodes(), step, lng, obb,
+                brute, 100.0 * long_hits / n_queries);
+    if (mismatches > 0) {
+      std::printf("  %zu of %zu segments differ from brute force\n",
+                  mismatches, n_brute);
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+// average milliseconds per frame of draw: submit is the time spent issuing
+// the draw calls on the CPU, frame is until the GPU is done
+void frameTimes(size_t n_frames, const std::function<void()> &draw,
+                double &submit, double &frame) {
+  auto &env = agl::get_env();
+  draw(); // first upload out of the measure
+  glFinish();
+
+  submit = frame = 0.0;
+  for (size_t f = 0; f < n_frames; ++f) {
+    env.clearBuffer();
+    auto start = clock::now();
+    draw();
+    auto submitted = clock::now();
+    glFinish();
+    std::chrono::duration<double, std::milli> s = submitted - start;
+    std::chrono::duration<double, std::milli> t = clock::now() - start;
+    submit += s.count();
+    frame += t.count();
+  }
+  submit /= n_frames;
+  frame /= n_frames;
+}
+
+// CPU time per frame drawing a mesh in immediate mode (glBegin/glEnd)
+// against the vertex buffers (glDrawElements). Opens a window.
+// args: [triangles = 1000000] [frames = 50]
+int meshDraw(int argc, char **argv) {
+  size_t n_tris = argOr(argc, argv, 1, 1000000);
+  size_t n_frames = std::max<size_t>(argOr(argc, argv, 2, 50), 1);
+
+  auto &env = agl::get_env();
+  std::string title("mesh-draw");
+  auto win = env.createWindow(title, 0, 0, 800, 600);
+  win->setupViewport();
+  std::printf("%s, %s\n", glGetString(GL_RENDERER), glGetString(GL_VERSION));
+
+  auto mesh = loadSyntheticMesh("mesh-draw-bench", n_tris);
+  if (!mesh) {
+    return EXIT_FAILURE;
+  }
+
+  benchPerspective(100);
+  agl::Point3 c = mesh->center();
+  env.setCamera(c.x, c.y + mesh->radius(), c.z + mesh->radius(), c.x, c.y,
+                c.z, 0, 1, 0);
+
+  std::printf("%zu triangles, %zu frames\n\n", mesh->numFaces(), n_frames);
+  std::printf("%-14s %-10s %12s %12s\n", "variant", "mode", "submit (ms)",
+              "frame (ms)");
+
+  struct Variant {
+    const char *name;
+    std::function<void()> draw;
+  };
+  const Variant variants[] = {
+      {"gouraud", [&] { mesh->renderGouraud(false); }},
+      {"flat", [&] { mesh->renderFlat(false); }},
+      {"wireframe", [&] { mesh->renderGouraud(true); }},
+  };
+
+  for (const auto &variant : variants) {
+    for (bool buffers : {false, true}) {
+      agl::setMeshBuffers(buffers);
+      double submit, frame;
+      frameTimes(n_frames, variant.draw, submit, frame);
+      std::printf("%-14s %-10s %12.2f %12.2f\n", variant.name,
+                  buffers ? "buffers" : "immediate", submit, frame);
+    }
+  }
+  agl::setMeshBuffers(true);
+
+  return EXIT_SUCCESS;
+}
+
+// Frame time of a lit mesh with sphere map texgen, like the ship, drawn
+// through the render queue by the fixed function pipeline and by the GLSL
+// one. Opens a window.
+// args: [triangles = 1000000] [frames = 50]
+int pipelineDraw(int argc, char **argv) {
+  size_t n_tris = argOr(argc, argv, 1, 1000000);
+  size_t n_frames = std::max<size_t>(argOr(argc, argv, 2, 50), 1);
+
+  auto &env = agl::get_env();
+  std::string title("pipeline-draw");
+  auto win = env.createWindow(title, 0, 0, 800, 600);
+  win->setupViewport();
+  std::printf("%s, %s\n", glGetString(GL_RENDERER), glGetString(GL_VERSION));
+
+  auto mesh = loadSyntheticMesh("pipeline-draw-bench", n_tris);
+  if (!mesh) {
+    return EXIT_FAILURE;
+  }
+
+  agl::TexID tex = checkerTexture(false);
+
+  benchPerspective(100);
+  env.setupLightPosition();
+  env.setupModelLights();
+  env.enable(GL_LIGHT0);
+  agl::Point3 c = mesh->center();
+  env.setCamera(c.x, c.y + mesh->radius(), c.z + mesh->radius(), c.x, c.y,
+                c.z, 0, 1, 0);
+
+  std::printf("%zu triangles, %zu frames\n\n", mesh->numFaces(), n_frames);
+  std::printf("%-16s %12s %12s\n", "pipeline", "submit (ms)", "frame (ms)");
+
+  for (auto pipeline : {agl::Pipeline::FIXED_FUNCTION, agl::Pipeline::GLSL}) {
+    env.setPipeline(pipeline);
+    auto draw = [&] {
+      env.beginQueue();
+      env.submit(agl::RenderPass::OPAQUE, tex, c, [&] {
+        env.textureDrawing(tex, [&] { mesh->renderGouraud(false); }, true);
+      });
+      env.flushQueue();
+    };
+    double submit, frame;
+    frameTimes(n_frames, draw, submit, frame);
+    std::printf("%-16s %12.2f %12.2f\n",
+                env.pipeline() == agl::Pipeline::GLSL ? "glsl"
+                                                      : "fixed function",
+                submit, frame);
+  }
+  env.deleteTexture(tex);
+
+  return EXIT_SUCCESS;
+}
+
+// Frame time of the floor of the game, textured and in wireframe: the
+// num_quads^2 grid sent in immediate mode every frame against the same
+// grid uploaded once. Opens a window.
+// args: [quads per side = 150] [frames = 100]
+int floorDraw(int argc, char **argv) {
+  size_t num_quads = std::max<size_t>(argOr(argc, argv, 1, 150), 1);
+  size_t n_frames = std::max<size_t>(argOr(argc, argv, 2, 100), 1);
+
+  auto &env = agl::get_env();
+  std::string title("floor-draw");
+  auto win = env.createWindow(title, 0, 0, 800, 600);
+  win->setupViewport();
+  std::printf("%s, %s\n", glGetString(GL_RENDERER), glGetString(GL_VERSION));
+
+  // in place of the sea texture
+  agl::TexID tex = checkerTexture(true);
+
+  benchPerspective(2000);
+  env.setCamera(0, 20, 60, 0, 0, 0, 0, 1, 0);
+  env.enable(GL_LIGHTING);
+  env.enable(GL_LIGHT0);
+
+  std::printf("%zu quads, %zu frames\n\n", num_quads * num_quads, n_frames);
+  std::printf("%-14s %-10s %12s %12s\n", "variant", "mode", "submit (ms)",
+              "frame (ms)");
+
+  for (bool wireframe : {false, true}) {
+    env.m_wireframe = wireframe;
+    for (bool buffers : {false, true}) {
+      // the grid is cached at the first draw, as buffers or not
+      env.releasePrimitives();
+      agl::setMeshBuffers(buffers);
+      double submit, frame;
+      auto draw = [&] {
+        env.drawFloor(tex, elements::FLOOR_SIZE, 0.0f, num_quads);
+      };
+      frameTimes(n_frames, draw, submit, frame);
+      std::printf("%-14s %-10s %12.2f %12.2f\n",
+                  wireframe ? "wireframe" : "textured",
+                  buffers ? "buffers" : "immediate", submit, frame);
+    }
+  }
+  env.m_wireframe = false;
+  agl::setMeshBuffers(true);
+  env.deleteTexture(tex);
+
+  return EXIT_SUCCESS;
+}
+
+// Frame time of a stress scene of bad cubes spread over the floor and the
+// final door, seen from the height of the ship with the camera of the game:
+// with and without the frustum culling. Opens a window.
+// args: [obstacles = 10000] [frames = 50]
+int cullStress(int argc, char **argv) {
+  size_t n_cubes = std::max<size_t>(argOr(argc, argv, 1, 10000), 1);
+  size_t n_frames = std::max<size_t>(argOr(argc, argv, 2, 50), 1);
+
+  auto &env = agl::get_env();
+  std::string title("cull-stress");
+  auto win = env.createWindow(title, 0, 0, 800, 600);
+  win->setupViewport();
+  std::printf("%s, %s\n", glGetString(GL_RENDERER), glGetString(GL_VERSION));
+
+  std::mt19937 rng(42);
+  std::uniform_real_distribution<float> coord(-elements::FLOOR_SIZE,
+                                              elements::FLOOR_SIZE);
+  std::uniform_real_distribution<float> angle(0.0f, 360.0f);
+  agl::InstanceBuffer cubes(false);
+  for (size_t i = 0; i < n_cubes; ++i) {
+    elements::BadCube cube(coord(rng), 2.5f, coord(rng), false, angle(rng));
+    cubes.add(cube.instance());
+  }
+
+  // the final door too, with a synthetic mesh: its sphere comes from the
+  // mesh bounds, known once the background load is done
+  std::string obj_filename = "/tmp/cull-stress-door.obj";
+  std::ofstream(obj_filename) << syntheticObj(64);
+  auto door = elements::get_door(obj_filename.c_str(), "texturas/BRUSHED.jpg");
+  agl::Point3 door_center;
+  float door_radius;
+  while (!door->boundingSphere(door_center, door_radius)) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  removeObj(obj_filename);
+
+  // the ship camera in the middle
+  benchPerspective(1000);
+  env.setCamera(0, 5, 10, 0, 2.5, 0, 0, 1, 0);
+  env.enable(GL_LIGHTING);
+  env.enable(GL_LIGHT0);
+
+  std::printf("%zu obstacles + door (radius %.1f), %zu frames\n\n", n_cubes,
+              door_radius, n_frames);
+  std::printf("%-10s %10s %10s %12s %12s\n", "culling", "visible", "culled",
+              "submit (ms)", "frame (ms)");
+
+  for (bool culling : {false, true}) {
+    env.setCulling(culling);
+    auto draw = [&] {
+      env.beginQueue();
+      elements::BadCube::submit(cubes, n_cubes);
+      door->submit();
+      env.flushQueue();
+    };
+    double submit, frame;
+    frameTimes(n_frames, draw, submit, frame);
+    std::printf("%-10s %10zu %10zu %12.2f %12.2f\n", culling ? "on" : "off",
+                env.visibleCount(), env.culledCount(), submit, frame);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+// Frame time of the floor with a hovering mesh casting its shadow: no
+// shadow, the blob, the shadow map reused (still caster) and redrawn every
+// frame (moving caster), with the cost of the shadow pass alone. Opens a
+// window.
+// args: [caster triangles = 50000] [frames = 50] [map size = 1024]
+int shadowPass(int argc, char **argv) {
+  size_t n_tris = argOr(argc, argv, 1, 50000);
+  size_t n_frames = std::max<size_t>(argOr(argc, argv, 2, 50), 1);
+  size_t map_size = argOr(argc, argv, 3, 1024);
+
+  auto &env = agl::get_env();
+  std::string title("shadow-pass");
+  auto win = env.createWindow(title, 0, 0, 800, 600);
+  win->setupViewport();
+  std::printf("%s, %s\n", glGetString(GL_RENDERER), glGetString(GL_VERSION));
+
+  auto mesh = loadSyntheticMesh("shadow-pass-bench", n_tris);
+  if (!mesh) {
+    return EXIT_FAILURE;
+  }
+
+  agl::TexID tex = checkerTexture(true);
+
+  // the caster: 4 units wide, 2 units above the floor like the ship
+  const float scale = 4.0f / (2.0f * mesh->radius());
+  const agl::Point3 position(-2.0f, 2.0f, -2.0f);
+  agl::Point3 c = mesh->center();
+  agl::Point3 center(position.x + scale * c.x, position.y + scale * c.y,
+                     position.z + scale * c.z);
+  float radius = scale * mesh->radius();
+  auto caster = [&] {
+    env.mat_scope([&] {
+      env.translate(position.x, position.y, position.z);
+      env.scale(scale, scale, scale);
+      mesh->renderGouraud(false);
+    });
+  };
+
+  benchPerspective(1000);
+  env.setupLightPosition();
+  env.setupModelLights();
+  env.enable(GL_LIGHT0);
+  env.setCamera(0, 8, 12, 0, 0, 0, 0, 1, 0);
+  env.setShadowMapSize(map_size);
+
+  std::printf("%zu caster triangles, %zux%zu map, %zu frames\n\n",
+              mesh->numFaces(), map_size, map_size, n_frames);
+  std::printf("%-10s %12s %12s %12s %12s\n", "shadow", "submit (ms)",
+              "frame (ms)", "pass cpu", "pass gpu");
+
+  const char *variants[] = {"none", "blob", "map-still", "map-moving"};
+  for (size_t v = 0; v < 4; ++v) {
+    env.setShadowQuality(v == 1 ? agl::ShadowQuality::BLOB
+                                : agl::ShadowQuality::MAP);
+    auto draw = [&] {
+      env.newTimerFrame();
+      env.beginQueue();
+      env.submit(agl::RenderPass::OPAQUE, tex, agl::Point3(), [&] {
+        env.shadowedDrawing([&] {
+          env.drawFloor(tex, elements::FLOOR_SIZE, 0.0f, 150);
+        });
+      });
+      env.submit(agl::RenderPass::OPAQUE, 0, center, caster);
+      if (v == 1) {
+        env.submit(agl::RenderPass::TRANSPARENT, 0, center, [&] {
+          env.mat_scope([&] {
+            env.disableLighting();
+            env.enable(GL_BLEND);
+            env.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+            env.setColor(agl::SHADOW_BLOB);
+            env.translate(center.x + center.y, 0.01, center.z + center.y);
+            env.rotate(90, agl::Vec3(1, 0, 0));
+            env.drawCircle(0, 0, radius);
+            env.disable(GL_BLEND);
+            env.enableLighting();
+          });
+        });
+      } else if (v > 1) {
+        env.updateShadowMap(center, radius, v == 3, caster);
+      }
+      env.flushQueue();
+    };
+    double submit, frame;
+    frameTimes(n_frames, draw, submit, frame);
+    const auto &stats = env.shadowStats();
+    double gpu = env.timerStats("shadow").average_ms;
+    std::printf("%-10s %12.2f %12.2f %12.2f %12.2f\n", variants[v], submit,
+                frame, v > 1 ? stats.cpu_ms : 0.0, v > 1 ? gpu : 0.0);
+  }
+  std::printf("\nshadow map: %zu updates, %zu reused\n",
+              env.shadowStats().updates, env.shadowStats().reused);
+  env.deleteTexture(tex);
+
+  return EXIT_SUCCESS;
+}
+
+// Frame time of the cull-stress scene swapped by SmartWindow::refresh: the
+// old glFinish before each swap against 1, 2 and 3 frames in flight, with
+// the time the CPU waited for the GPU. Opens a window.
+// args: [obstacles = 2000] [frames = 100]
+int framePacing(int argc, char **argv) {
+  size_t n_cubes = std::max<size_t>(argOr(argc, argv, 1, 2000), 1);
+  size_t n_frames = std::max<size_t>(argOr(argc, argv, 2, 100), 1);
+
+  auto &env = agl::get_env();
+  std::string title("frame-pacing");
+  auto win = env.createWindow(title, 0, 0, 800, 600);
+  win->setupViewport();
+  std::printf("%s, %s\n", glGetString(GL_RENDERER), glGetString(GL_VERSION));
+
+  std::mt19937 rng(42);
+  std::uniform_real_distribution<float> coord(-elements::FLOOR_SIZE,
+                                              elements::FLOOR_SIZE);
+  std::uniform_real_distribution<float> angle(0.0f, 360.0f);
+  agl::InstanceBuffer cubes(false);
+  for (size_t i = 0; i < n_cubes; ++i) {
+    elements::BadCube cube(coord(rng), 2.5f, coord(rng), false, angle(rng));
+    cubes.add(cube.instance());
+  }
+
+  benchPerspective(1000);
+  env.setCamera(0, 5, 10, 0, 2.5, 0, 0, 1, 0);
+  env.enable(GL_LIGHTING);
+  env.enable(GL_LIGHT0);
+  env.setCulling(false);
+
+  std::printf("%zu obstacles, %zu frames\n\n", n_cubes, n_frames);
+  std::printf("%-12s %12s %12s\n", "pacing", "frame (ms)", "wait (ms)");
+
+  // 0: glFinish before the swap, as SmartWindow::refresh used to
+  for (size_t in_flight = 0; in_flight <= 3; ++in_flight) {
+    env.setFramesInFlight(std::max<size_t>(in_flight, 1));
+    double wait = 0.0;
+    auto start = clock::now();
+    for (size_t f = 0; f < n_frames; ++f) {
+      env.clearBuffer();
+      env.beginQueue();
+      elements::BadCube::submit(cubes, n_cubes);
+      env.flushQueue();
+      if (in_flight == 0) {
+        auto finish = clock::now();
+        glFinish();
+        std::chrono::duration<double, std::milli> w = clock::now() - finish;
+        wait += w.count();
+      }
+      win->refresh();
+      wait += env.frameWaitMs();
+    }
+    glFinish();
+    std::chrono::duration<double, std::milli> elapsed = clock::now() - start;
+
+    char name[32];
+    std::snprintf(name, sizeof(name), "%zu in flight", in_flight);
+    std::printf("%-12s %12.2f %12.2f\n", in_flight ? name : "glFinish",
+                elapsed.count() / n_frames, wait / n_frames);
+  }
+  env.setFramesInFlight(2);
+  env.setCulling(true);
+
+  return EXIT_SUCCESS;
+}
+
+const std::map<std::string, std::function<int(int, char **)>> s_benchmarks{
+    {"bvh-queries", bvhQueries},
+    {"cull-stress", cullStress},
+    {"floor-draw", floorDraw},
+    {"frame-pacing", framePacing},
+    {"mesh-draw", meshDraw},
+    {"mesh-normals", meshNormals},
+    {"obj-threads", objThreads},
+    {"pipeline-draw", pipelineDraw},
+    {"shadow-pass", shadowPass},
+};
+
+} // namespace
+
+int run(int argc, char **argv) {
+  auto it = argc > 0 ? s_benchmarks.find(argv[0]) : s_benchmarks.end();
+
+  if (it == s_benchmarks.end()) {
+    std::printf("Usage: ./game --bench <name> [args...]\nBenchmarks:\n");
+    for (const auto &entry : s_benchmarks) {
+      std::printf("  %s\n", entry.first.c_str());
+    }
+    return EXIT_FAILURE;
+  }
+
+  return it->second(argc, argv);
+}
+
+} // namespace bench
@@ -0,0 +1,18 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+/*
+ * Micro-benchmarks built into the game binary.
+ * Run them with: ./game --bench <name> [args...]
+ * Without a name, the list of the available benchmarks is printed.
+ */
+
+namespace bench {
+
+// argv[0] is the name of the benchmark, the rest are its arguments.
+// Returns the process exit status.
+int run(int argc, char **argv);
+
+} // namespace bench
+
+#endif // _BENCH_H_
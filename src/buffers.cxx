@@ -0,0 +1,228 @@
+#include "agl.h"
+
+#include <algorithm>
+#include <cstring>
+
+/*
+ * Vertex buffers. See MeshBuffers in agl.h. The same arrays feed the fixed
+ * function pipeline (glVertexPointer...) and the shaders, through the
+ * generic attributes at the locations of VertexAttrib.
+ */
+
+namespace agl {
+
+namespace {
+
+// the generic attributes need GL 2.0
+bool genericAttribs() { return GLEW_VERSION_2_0; }
+
+void setAttribArray(GLuint attrib, GLint size, GLsizei stride,
+                    const void *offset) {
+  glEnableVertexAttribArray(attrib);
+  glVertexAttribPointer(attrib, size, GL_FLOAT, GL_FALSE, stride, offset);
+}
+
+// vertex layout of MeshBuffers: position [, normal] [, u v]
+void setupArrays(const MeshBuffers &buffers) {
+  glBindBuffer(GL_ARRAY_BUFFER, buffers.vbo);
+  if (buffers.ibo) {
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers.ibo);
+  }
+  auto offset = [](size_t floats) {
+    return reinterpret_cast<const void *>(floats * sizeof(float));
+  };
+  size_t next = 3;
+  bool generic = genericAttribs();
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glVertexPointer(3, GL_FLOAT, buffers.stride, offset(0));
+  if (generic) {
+    setAttribArray(ATTRIB_POSITION, 3, buffers.stride, offset(0));
+  }
+  if (buffers.normals) {
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glNormalPointer(GL_FLOAT, buffers.stride, offset(next));
+    if (generic) {
+      setAttribArray(ATTRIB_NORMAL, 3, buffers.stride, offset(next));
+    }
+    next += 3;
+  }
+  if (buffers.uv) {
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glTexCoordPointer(2, GL_FLOAT, buffers.stride, offset(next));
+    if (generic) {
+      setAttribArray(ATTRIB_TEXCOORD, 2, buffers.stride, offset(next));
+    }
+  }
+}
+
+} // namespace
+
+bool buffersSupported() {
+  return GLEW_VERSION_1_5 || GLEW_ARB_vertex_buffer_object;
+}
+
+bool createBuffers(MeshBuffers &buffers, const std::vector<float> &vertices,
+                   const std::vector<uint32_t> &indices) {
+  if (!buffersSupported()) {
+    return false;
+  }
+
+  buffers.stride =
+      (3 + (buffers.normals ? 3 : 0) + (buffers.uv ? 2 : 0)) * sizeof(float);
+  buffers.bytes = vertices.size() * sizeof(float) +
+                  indices.size() * sizeof(uint32_t);
+
+  if (GLEW_VERSION_3_0 || GLEW_ARB_vertex_array_object) {
+    glGenVertexArrays(1, &buffers.vao);
+    glBindVertexArray(buffers.vao);
+  }
+  glGenBuffers(1, &buffers.vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, buffers.vbo);
+  glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float),
+               vertices.data(), GL_STATIC_DRAW);
+
+  if (!indices.empty()) {
+    glGenBuffers(1, &buffers.ibo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers.ibo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(uint32_t),
+                 indices.data(), GL_STATIC_DRAW);
+  }
+
+  // with a vertex array object, this is recorded once for all
+  setupArrays(buffers);
+  unbindBuffers(buffers);
+  return true;
+}
+
+void deleteBuffers(MeshBuffers &buffers) {
+  // without a context (e.g. after the window is gone) there's nothing left
+  // to free on the GPU
+  if (hasGLContext()) {
+    if (buffers.vao) {
+      glDeleteVertexArrays(1, &buffers.vao);
+    }
+    if (buffers.vbo) {
+      glDeleteBuffers(1, &buffers.vbo);
+    }
+    if (buffers.ibo) {
+      glDeleteBuffers(1, &buffers.ibo);
+    }
+  }
+  buffers = MeshBuffers();
+}
+
+void bindBuffers(const MeshBuffers &buffers) {
+  if (buffers.vao) {
+    glBindVertexArray(buffers.vao);
+  } else {
+    setupArrays(buffers);
+  }
+}
+
+// the rest of the game draws in immediate mode: leave no array enabled
+void unbindBuffers(const MeshBuffers &buffers) {
+  if (buffers.vao) {
+    glBindVertexArray(0);
+  } else {
+    glDisableClientState(GL_VERTEX_ARRAY);
+    if (buffers.normals) {
+      glDisableClientState(GL_NORMAL_ARRAY);
+    }
+    if (buffers.uv) {
+      glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    }
+    if (genericAttribs()) {
+      glDisableVertexAttribArray(ATTRIB_POSITION);
+      glDisableVertexAttribArray(ATTRIB_NORMAL);
+      glDisableVertexAttribArray(ATTRIB_TEXCOORD);
+    }
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+  }
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+InstanceBuffer::InstanceBuffer(bool colored)
+    : m_colored(colored), m_vbo(0), m_capacity(0), m_dirty_begin(0),
+      m_dirty_end(0) {}
+
+InstanceBuffer::~InstanceBuffer() {
+  if (m_vbo && hasGLContext()) {
+    glDeleteBuffers(1, &m_vbo);
+  }
+}
+
+void InstanceBuffer::clear() {
+  m_instances.clear();
+  m_order.clear();
+  m_dirty_begin = m_dirty_end = 0;
+}
+
+void InstanceBuffer::add(const Instance &instance) {
+  if (m_dirty_begin == m_dirty_end) {
+    m_dirty_begin = m_instances.size();
+  }
+  m_instances.push_back(instance);
+  m_dirty_end = m_instances.size();
+}
+
+void InstanceBuffer::set(size_t i, const Instance &instance) {
+  if (std::memcmp(&m_instances[i], &instance, sizeof(Instance)) == 0) {
+    return;
+  }
+  m_instances[i] = instance;
+  if (!m_order.empty()) {
+    // its place in the buffer is not i
+    m_dirty_begin = 0;
+    m_dirty_end = m_order.size();
+  } else if (m_dirty_begin == m_dirty_end) {
+    m_dirty_begin = i;
+    m_dirty_end = i + 1;
+  } else {
+    m_dirty_begin = std::min(m_dirty_begin, i);
+    m_dirty_end = std::max(m_dirty_end, i + 1);
+  }
+}
+
+void InstanceBuffer::setOrder(const std::vector<uint32_t> &order) {
+  if (order == m_order) {
+    return;
+  }
+  m_order = order;
+  m_dirty_begin = 0;
+  m_dirty_end = m_order.size();
+}
+
+GLuint InstanceBuffer::upload() {
+  if (!m_vbo) {
+    glGenBuffers(1, &m_vbo);
+  }
+  glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
+
+  if (m_capacity < m_instances.size()) {
+    // grown: everything is sent again
+    m_capacity = m_instances.capacity();
+    glBufferData(GL_ARRAY_BUFFER, m_capacity * sizeof(Instance), nullptr,
+                 GL_DYNAMIC_DRAW);
+    m_dirty_begin = 0;
+    m_dirty_end = m_instances.size();
+  }
+  if (m_dirty_begin < m_dirty_end && m_order.empty()) {
+    glBufferSubData(GL_ARRAY_BUFFER, m_dirty_begin * sizeof(Instance),
+                    (m_dirty_end - m_dirty_begin) * sizeof(Instance),
+                    &m_instances[m_dirty_begin]);
+  } else if (m_dirty_begin < std::min(m_dirty_end, m_order.size())) {
+    m_dirty_end = std::min(m_dirty_end, m_order.size());
+    std::vector<Instance> ordered(m_dirty_end - m_dirty_begin);
+    for (size_t i = m_dirty_begin; i < m_dirty_end; ++i) {
+      ordered[i - m_dirty_begin] = m_instances[m_order[i]];
+    }
+    glBufferSubData(GL_ARRAY_BUFFER, m_dirty_begin * sizeof(Instance),
+                    ordered.size() * sizeof(Instance), ordered.data());
+  }
+  m_dirty_begin = m_dirty_end = 0;
+
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  return m_vbo;
+}
+
+} // namespace agl
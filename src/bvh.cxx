@@ -0,0 +1,370 @@
+#include "bvh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+/*
+ * Mesh BVH. See bvh.h
+ */
+
+namespace agl {
+
+namespace {
+
+const size_t MAX_LEAF = 4;  // a leaf is created below this many triangles
+const size_t N_BINS = 16;   // SAH candidate splits per axis
+const float TRAVERSAL = 1.0f; // cost of visiting a node, in triangle tests
+// The queries walk the tree with a fixed stack, which holds at most
+// depth + 1 nodes: past MAX_DEPTH the builder makes a leaf, however big
+const size_t STACK_SIZE = 64;
+const size_t MAX_DEPTH = STACK_SIZE - 1;
+
+inline float dot(const Point3 &a, const Point3 &b) {
+  return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+inline float comp(const Point3 &p, size_t axis) {
+  return axis == 0 ? p.x : (axis == 1 ? p.y : p.z);
+}
+
+struct Box {
+  float min[3] = {INFINITY, INFINITY, INFINITY};
+  float max[3] = {-INFINITY, -INFINITY, -INFINITY};
+
+  void grow(const Point3 &p) {
+    for (size_t k = 0; k < 3; ++k) {
+      min[k] = std::min(min[k], comp(p, k));
+      max[k] = std::max(max[k], comp(p, k));
+    }
+  }
+
+  void grow(const Box &b) {
+    for (size_t k = 0; k < 3; ++k) {
+      min[k] = std::min(min[k], b.min[k]);
+      max[k] = std::max(max[k], b.max[k]);
+    }
+  }
+
+  float area() const {
+    float d[3];
+    for (size_t k = 0; k < 3; ++k) {
+      d[k] = std::max(max[k] - min[k], 0.0f);
+    }
+    return 2.0f * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+  }
+};
+
+// Moller-Trumbore. t along from + t * dir
+bool segmentTriangle(const Point3 &from, const Point3 &dir, const Point3 *tri,
+                     float &t) {
+  Point3 e1 = tri[1] - tri[0], e2 = tri[2] - tri[0];
+  Point3 p = dir % e2;
+  float det = dot(e1, p);
+  if (std::fabs(det) < 1e-12f) {
+    return false; // parallel
+  }
+
+  float inv = 1.0f / det;
+  Point3 s = from - tri[0];
+  float u = dot(s, p) * inv;
+  if (u < 0.0f || u > 1.0f) {
+    return false;
+  }
+  Point3 q = s % e1;
+  float v = dot(dir, q) * inv;
+  if (v < 0.0f || u + v > 1.0f) {
+    return false;
+  }
+
+  t = dot(e2, q) * inv;
+  return true;
+}
+
+// projections of the triangle on axis don't overlap [-r, r]
+inline bool separated(const Point3 &axis, const Point3 *v, const float *h) {
+  float p0 = dot(v[0], axis), p1 = dot(v[1], axis), p2 = dot(v[2], axis);
+  float r = h[0] * std::fabs(axis.x) + h[1] * std::fabs(axis.y) +
+            h[2] * std::fabs(axis.z);
+  return std::min({p0, p1, p2}) > r || std::max({p0, p1, p2}) < -r;
+}
+
+// separating axis test between a triangle and the box [-h, h] (Akenine-Moller)
+bool triangleBox(const Point3 *v, const float *h) {
+  const Point3 unit[3] = {Point3(1, 0, 0), Point3(0, 1, 0), Point3(0, 0, 1)};
+  const Point3 edge[3] = {v[1] - v[0], v[2] - v[1], v[0] - v[2]};
+
+  // box faces
+  for (const auto &axis : unit) {
+    if (separated(axis, v, h)) {
+      return false;
+    }
+  }
+  // triangle plane
+  if (separated(edge[0] % edge[1], v, h)) {
+    return false;
+  }
+  // box edges x triangle edges
+  for (const auto &u : unit) {
+    for (const auto &e : edge) {
+      if (separated(u % e, v, h)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+Bvh::Bvh(const Vec3Array &positions, const std::vector<uint32_t> &indices) {
+  size_t n_tris = indices.size() / 3;
+
+  std::vector<Point3> tris(3 * n_tris);
+  std::vector<Point3> centroids(n_tris);
+  for (size_t i = 0; i < 3 * n_tris; ++i) {
+    tris[i] = positions.at(indices[i]);
+  }
+  for (size_t f = 0; f < n_tris; ++f) {
+    centroids[f] = (tris[3 * f] + tris[3 * f + 1] + tris[3 * f + 2]) / 3.0f;
+  }
+
+  std::vector<uint32_t> order(n_tris);
+  std::iota(order.begin(), order.end(), 0);
+
+  m_nodes.reserve(2 * n_tris / MAX_LEAF + 1);
+  if (n_tris > 0) {
+    build(order, 0, n_tris, 0, centroids, tris);
+  }
+
+  // leaves point into the triangles in build order
+  m_tris.reserve(3 * n_tris);
+  for (auto f : order) {
+    m_tris.insert(m_tris.end(), &tris[3 * f], &tris[3 * f] + 3);
+  }
+}
+
+uint32_t Bvh::build(std::vector<uint32_t> &order, size_t begin, size_t end,
+                    size_t depth, const std::vector<Point3> &centroids,
+                    const std::vector<Point3> &tris) {
+  uint32_t index = m_nodes.size();
+  m_nodes.emplace_back();
+
+  Box bounds, centers;
+  for (size_t i = begin; i < end; ++i) {
+    for (size_t k = 0; k < 3; ++k) {
+      bounds.grow(tris[3 * order[i] + k]);
+    }
+    centers.grow(centroids[order[i]]);
+  }
+  std::copy(bounds.min, bounds.min + 3, m_nodes[index].min);
+  std::copy(bounds.max, bounds.max + 3, m_nodes[index].max);
+
+  size_t n = end - begin;
+  auto makeLeaf = [&] {
+    m_nodes[index].offset = begin;
+    m_nodes[index].count = n;
+    return index;
+  };
+  if (n <= MAX_LEAF || depth >= MAX_DEPTH) {
+    return makeLeaf();
+  }
+
+  // binned SAH: try N_BINS - 1 planes on each axis
+  float best_cost = INFINITY;
+  size_t best_axis = 0, best_bin = 0;
+  for (size_t axis = 0; axis < 3; ++axis) {
+    float lo = centers.min[axis], extent = centers.max[axis] - lo;
+    if (extent <= 0.0f) {
+      continue;
+    }
+
+    Box bin_box[N_BINS];
+    size_t bin_count[N_BINS] = {};
+    for (size_t i = begin; i < end; ++i) {
+      size_t b = std::min(
+          size_t((comp(centroids[order[i]], axis) - lo) / extent * N_BINS),
+          N_BINS - 1);
+      ++bin_count[b];
+      for (size_t k = 0; k < 3; ++k) {
+        bin_box[b].grow(tris[3 * order[i] + k]);
+      }
+    }
+
+    // areas and counts on the right of each plane, then sweep from the left
+    float right_area[N_BINS];
+    size_t right_count[N_BINS];
+    Box acc;
+    size_t count = 0;
+    for (size_t b = N_BINS - 1; b > 0; --b) {
+      acc.grow(bin_box[b]);
+      count += bin_count[b];
+      right_area[b] = acc.area();
+      right_count[b] = count;
+    }
+    acc = Box();
+    count = 0;
+    for (size_t b = 1; b < N_BINS; ++b) {
+      acc.grow(bin_box[b - 1]);
+      count += bin_count[b - 1];
+      float cost = count * acc.area() + right_count[b] * right_area[b];
+      if (count > 0 && right_count[b] > 0 && cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_bin = b;
+      }
+    }
+  }
+
+  size_t mid;
+  float area = bounds.area();
+  if (best_cost < INFINITY) {
+    // not worth splitting?
+    if (area > 0.0f && TRAVERSAL + best_cost / area >= n && n <= 4 * MAX_LEAF) {
+      return makeLeaf();
+    }
+    float lo = centers.min[best_axis];
+    float extent = centers.max[best_axis] - lo;
+    auto it = std::partition(
+        order.begin() + begin, order.begin() + end, [&](uint32_t f) {
+          size_t b = std::min(
+              size_t((comp(centroids[f], best_axis) - lo) / extent * N_BINS),
+              N_BINS - 1);
+          return b < best_bin;
+        });
+    mid = it - order.begin();
+  } else {
+    // all the centroids in the same point: split in half
+    mid = begin + n / 2;
+  }
+
+  build(order, begin, mid, depth + 1, centroids, tris);
+  uint32_t right = build(order, mid, end, depth + 1, centroids, tris);
+  m_nodes[index].offset = right;
+  m_nodes[index].count = 0;
+  return index;
+}
+
+bool Bvh::intersectSegment(const Point3 &from, const Point3 &to,
+                           float *t_hit) const {
+  if (m_nodes.empty()) {
+    return false;
+  }
+
+  Point3 dir = to - from;
+  float inv[3] = {1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z};
+  float o[3] = {from.x, from.y, from.z};
+
+  float best = INFINITY;
+  uint32_t stack[STACK_SIZE];
+  size_t top = 0;
+  stack[top++] = 0;
+
+  while (top > 0) {
+    const Node &node = m_nodes[stack[--top]];
+
+    // slab test against [0, min(1, best)]
+    float t0 = 0.0f, t1 = std::min(1.0f, best);
+    for (size_t k = 0; k < 3 && t0 <= t1; ++k) {
+      float ta = (node.min[k] - o[k]) * inv[k];
+      float tb = (node.max[k] - o[k]) * inv[k];
+      if (ta > tb) {
+        std::swap(ta, tb);
+      }
+      // 0 * inf = NaN when the segment lies on a slab plane: keep the range
+      t0 = ta > t0 ? ta : t0;
+      t1 = tb < t1 ? tb : t1;
+    }
+    if (t0 > t1) {
+      continue;
+    }
+
+    if (node.count == 0) {
+      uint32_t self = &node - m_nodes.data();
+      stack[top++] = node.offset;
+      stack[top++] = self + 1;
+      continue;
+    }
+
+    for (uint32_t f = node.offset; f < node.offset + node.count; ++f) {
+      float t;
+      if (segmentTriangle(from, dir, &m_tris[3 * f], t) && t >= 0.0f &&
+          t <= 1.0f && t < best) {
+        best = t;
+      }
+    }
+  }
+
+  if (best == INFINITY) {
+    return false;
+  }
+  if (t_hit) {
+    *t_hit = best;
+  }
+  return true;
+}
+
+bool Bvh::intersectObb(const Obb &box) const {
+  if (m_nodes.empty()) {
+    return false;
+  }
+
+  // axis aligned bounds of the box, for a quick rejection of the nodes
+  float box_ext[3];
+  for (size_t k = 0; k < 3; ++k) {
+    box_ext[k] = 0.0f;
+    for (size_t a = 0; a < 3; ++a) {
+      box_ext[k] += std::fabs(comp(box.axis[a], k)) * box.half[a];
+    }
+  }
+
+  uint32_t stack[STACK_SIZE];
+  size_t top = 0;
+  stack[top++] = 0;
+
+  while (top > 0) {
+    uint32_t index = stack[--top];
+    const Node &node = m_nodes[index];
+
+    bool overlap = true;
+    for (size_t k = 0; k < 3 && overlap; ++k) {
+      float c = comp(box.center, k);
+      overlap = node.min[k] <= c + box_ext[k] && node.max[k] >= c - box_ext[k];
+    }
+    // the node on the axes of the box
+    for (size_t a = 0; a < 3 && overlap; ++a) {
+      Point3 c((node.min[0] + node.max[0]) / 2, (node.min[1] + node.max[1]) / 2,
+               (node.min[2] + node.max[2]) / 2);
+      float r = (node.max[0] - node.min[0]) / 2 * std::fabs(box.axis[a].x) +
+                (node.max[1] - node.min[1]) / 2 * std::fabs(box.axis[a].y) +
+                (node.max[2] - node.min[2]) / 2 * std::fabs(box.axis[a].z);
+      float d = dot(c - box.center, box.axis[a]);
+      overlap = std::fabs(d) <= r + box.half[a];
+    }
+    if (!overlap) {
+      continue;
+    }
+
+    if (node.count == 0) {
+      stack[top++] = node.offset;
+      stack[top++] = index + 1;
+      continue;
+    }
+
+    for (uint32_t f = node.offset; f < node.offset + node.count; ++f) {
+      // the triangle in the frame of the box
+      Point3 v[3];
+      for (size_t k = 0; k < 3; ++k) {
+        Point3 d = m_tris[3 * f + k] - box.center;
+        v[k] = Point3(dot(d, box.axis[0]), dot(d, box.axis[1]),
+                      dot(d, box.axis[2]));
+      }
+      if (triangleBox(v, box.half)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+} // namespace agl
@@ -0,0 +1,59 @@
+#ifndef _BVH_H_
+#define _BVH_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "agl.h"
+
+/*
+ * Bounding volume hierarchy over the triangles of a mesh, for collision
+ * queries. Axis aligned boxes, built top-down with the surface area
+ * heuristic (binned). All the queries are in the coordinates of the mesh.
+ */
+
+namespace agl {
+
+// oriented bounding box
+struct Obb {
+  Point3 center;
+  Point3 axis[3]; // orthonormal
+  float half[3];  // half extent along each axis
+};
+
+class Bvh {
+private:
+  struct Node {
+    float min[3], max[3];
+    // inner node: index of the right child (the left one follows the node)
+    // leaf: index of the first triangle
+    uint32_t offset;
+    uint32_t count; // triangles in the leaf, 0 for inner nodes
+  };
+
+  std::vector<Node> m_nodes;
+  // triangle corners, reordered so that each leaf is a contiguous range
+  std::vector<Point3> m_tris;
+
+  uint32_t build(std::vector<uint32_t> &order, size_t begin, size_t end,
+                 size_t depth, const std::vector<Point3> &centroids,
+                 const std::vector<Point3> &tris);
+
+public:
+  // triangles as 3 indices each into positions
+  Bvh(const Vec3Array &positions, const std::vector<uint32_t> &indices);
+
+  // first hit of the segment from -> to: t in [0, 1] along it
+  bool intersectSegment(const Point3 &from, const Point3 &to,
+                        float *t = nullptr) const;
+  // does the box touch any triangle?
+  bool intersectObb(const Obb &box) const;
+
+  inline size_t numNodes() const { return m_nodes.size(); }
+  inline size_t numTriangles() const { return m_tris.size() / 3; }
+};
+
+} // namespace agl
+
+#endif // _BVH_H_
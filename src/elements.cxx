@@ -1,21 +1,52 @@
 
 #include "elements.h"
+#include "bvh.h"
+#include <algorithm>
 #include <cmath>
 
 // Implementation of the objects in elements.h
 namespace elements {
 
+void prepareSceneMesh(agl::Mesh &mesh) {
+  mesh.buildLods();
+  mesh.buildBvh();
+  if (agl::getMeshQuantization()) {
+    mesh.quantize();
+  }
+}
+
+bool meshBoundingSphere(const agl::MeshHandle &mesh,
+                        const agl::Point3 &position, float scale,
+                        agl::Point3 &center, float &radius) {
+  agl::Point3 bbmin, bbmax;
+  if (!mesh.bounds(bbmin, bbmax)) {
+    return false;
+  }
+  // the box center moves around the origin of the mesh with the rotation:
+  // a sphere around the origin contains all its positions
+  agl::Point3 box_center = (bbmin + bbmax) / 2.0f;
+  center = position;
+  radius = scale * (box_center.modulo() + (bbmax - bbmin).modulo() / 2.0f);
+  return true;
+}
+
 /*
  * Floor
  */
 Floor::Floor(const char *texture_filename)
     : m_size(FLOOR_SIZE), m_height(0.0f), m_env(agl::get_env()),
       // repat = true, linear interpolation
-      m_tex(m_env.loadTexture(texture_filename, true, false)) {}
+      m_tex(agl::get_assets().texture(texture_filename, true, false)) {}
 
 void Floor::render() {
   // lg::i(__func__, "Rendering floor...");
-  m_env.drawFloor(m_tex, m_size, m_height, 150);
+  m_env.shadowedDrawing(
+      [&] { m_env.drawFloor(*m_tex, m_size, m_height, 150); });
+}
+
+void Floor::submit() {
+  m_env.submit(agl::RenderPass::OPAQUE, *m_tex, agl::Point3(0, m_height, 0),
+               [this] { m_env.timedScope("floor", [this] { render(); }); });
 }
 
 Floor *get_floor(const char *texture_filename) {
@@ -36,12 +67,20 @@ Floor *get_floor(const char *texture_filename) {
 
 Sky::Sky(const char *texture_filename)
     : m_radius(SKY_RADIUS), m_lats(20.0f), m_longs(20.0f),
-      m_env(agl::get_env()), m_tex(m_env.loadTexture(texture_filename, false)) {
+      m_env(agl::get_env()),
+      m_tex(agl::get_assets().texture(texture_filename, false)) {
 }
 
 void Sky::render() {
   // lg::i(__func__, "Rendering Sky...");
-  m_env.drawSky(m_tex, m_radius, m_lats, m_longs);
+  m_env.drawSky(*m_tex, m_radius, m_lats, m_longs);
+}
+
+// everything else is inside the sky: drawn last, the depth test skips what
+// is already covered
+void Sky::submit() {
+  m_env.submit(agl::RenderPass::BACKGROUND, *m_tex, agl::Point3(0, 0, 0),
+               [this] { m_env.timedScope("sky", [this] { render(); }); });
 }
 
 void Sky::set_params(double radius, int lats, int longs) {
@@ -85,27 +124,74 @@ const agl::Vec3 Ring::s_viewUP = agl::Vec3(0.0, 1.0, 0.0);
 // radius values
 const float Ring::s_r = 0.3; // inner radius
 const float Ring::s_R = 2.5; // outer radius
+// drawTorus doubles both radii
+const float Ring::s_bounding_radius = 2.0f * (s_r + s_R);
 
-void Ring::render() {
-  m_env.mat_scope([&] {
-    m_env.translate(m_px, m_py, m_pz);
-    m_env.rotate(m_angle, s_viewUP);
-    // set the proper color if triggered
-    m_env.setColor(m_triggered ? TRIGGERED : NOT_TRIGGERED);
-
-    if (m_env.isBlending()) {
-      // maybe move this to Env helper function
-      glEnable(GL_BLEND);
-      glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+agl::Instance Ring::instance() const {
+  // the proper color if triggered
+  return {m_px, m_py, m_pz, m_angle, m_triggered ? TRIGGERED : NOT_TRIGGERED};
+}
 
-      m_env.drawTorus(s_r, s_R);
+void Ring::render(agl::InstanceBuffer &rings, size_t count) {
+  auto &env = agl::get_env();
+  env.shadowedDrawing([&] {
+    env.instancedDrawing(rings, count, [&] {
+      if (env.isBlending()) {
+        // maybe move this to Env helper function
+        env.enable(GL_BLEND);
+        env.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+        env.drawTorus(s_r, s_R);
+
+        env.disable(GL_BLEND);
+      } else {
+        env.drawTorus(s_r, s_R);
+      }
+    });
+  });
+}
 
-      glDisable(GL_BLEND);
-    } else {
-      m_env.drawTorus(s_r, s_R);
+// the visible ones among the first count instances (spheres of the given
+// radius), sorted by depth: back to front, or front to back
+static std::vector<uint32_t> depthOrder(const agl::InstanceBuffer &instances,
+                                        size_t count, float radius,
+                                        bool back_to_front) {
+  auto &env = agl::get_env();
+  count = std::min(count, instances.size());
+
+  std::vector<float> depth(count);
+  std::vector<uint32_t> order;
+  order.reserve(count);
+  for (uint32_t i = 0; i < count; ++i) {
+    const auto &instance = instances[i];
+    agl::Point3 center(instance.x, instance.y, instance.z);
+    if (env.isVisible(center, radius)) {
+      depth[i] = env.eyeDepth(center);
+      order.push_back(i);
     }
-
+  }
+  std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return back_to_front ? depth[a] > depth[b] : depth[a] < depth[b];
   });
+  return order;
+}
+
+void Ring::submit(agl::InstanceBuffer &rings, size_t count) {
+  auto &env = agl::get_env();
+  // without blending they are just opaque
+  bool blending = env.isBlending();
+  auto order = depthOrder(rings, count, s_bounding_radius, blending);
+  if (order.empty()) {
+    return;
+  }
+  rings.setOrder(order);
+
+  // the batch is as far as its farthest ring (nearest if opaque)
+  const auto &first = rings[order.front()];
+  env.submit(blending ? agl::RenderPass::TRANSPARENT : agl::RenderPass::OPAQUE,
+             0, agl::Point3(first.x, first.y, first.z), [&env, &rings, count] {
+               env.timedScope("rings", [&] { render(rings, count); });
+             });
 }
 
 void Ring::checkCrossing(float x, float z) {
@@ -190,29 +276,50 @@ BadCube::BadCube(float x, float y, float z, bool flight_mode, float angle)
 // view UP vector
 const agl::Vec3 BadCube::s_viewUP = agl::Vec3(0.0, 1.0, 0.0);
 const float BadCube::side = 2.5; // side of the cube
+// the cube spans [-side, side] on each axis
+const float BadCube::s_bounding_radius = side * std::sqrt(3.0f);
 
-void BadCube::render() {
-  m_env.mat_scope([&] {
-    m_env.translate(m_px, m_py, m_pz);
-    m_env.rotate(m_angle, s_viewUP);
-    
-    // if blending is not active the cubes will be just plain squares
-    if (m_env.isBlending()) {
-      // maybe move this to Env helper function
-      glEnable(GL_BLEND);
-      glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
-      m_env.drawCube(side);
-
-      glDisable(GL_BLEND);
-    } else {
-      m_env.setColor(agl::YELLOW);
-      m_env.drawSquare(side);
-    }
+agl::Instance BadCube::instance() const {
+  return {m_px, m_py, m_pz, m_angle, agl::Color()};
+}
 
+void BadCube::render(agl::InstanceBuffer &cubes, size_t count) {
+  auto &env = agl::get_env();
+  env.shadowedDrawing([&] {
+    env.instancedDrawing(cubes, count, [&] {
+      // if blending is not active the cubes will be just plain squares
+      if (env.isBlending()) {
+        // maybe move this to Env helper function
+        env.enable(GL_BLEND);
+        env.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+        env.drawCube(side);
+
+        env.disable(GL_BLEND);
+      } else {
+        env.setColor(agl::YELLOW);
+        env.drawSquare(side);
+      }
+    });
   });
 }
 
+void BadCube::submit(agl::InstanceBuffer &cubes, size_t count) {
+  auto order = depthOrder(cubes, count, s_bounding_radius, false);
+  if (order.empty()) {
+    return;
+  }
+  cubes.setOrder(order);
+
+  const auto &nearest = cubes[order.front()];
+  auto &env = agl::get_env();
+  env.submit(agl::RenderPass::OPAQUE, 0,
+             agl::Point3(nearest.x, nearest.y, nearest.z),
+             [&env, &cubes, count] {
+               env.timedScope("cubes", [&] { render(cubes, count); });
+             });
+}
+
 bool BadCube::checkCrossing(float x, float z) {
   // get distance wrt to the cube center
   x -= m_px;
@@ -281,7 +388,8 @@ Door::Door(const char *mesh_filename, const char *texture_filename)
     : m_px(0), m_py(6.0), m_pz(-(FLOOR_SIZE - 1.0)), m_scaleX(DOOR_SCALE),
       m_scaleY(DOOR_SCALE), m_scaleZ(DOOR_SCALE), m_angle(30),
       m_ship_old_z(INFINITY), m_env(agl::get_env()),
-      m_mesh(agl::loadMesh(mesh_filename)), m_tex(m_env.loadTexture(texture_filename)) {}
+      m_mesh(agl::get_assets().mesh(mesh_filename, prepareSceneMesh)),
+      m_tex(agl::get_assets().texture(texture_filename)) {}
 
 // initaliazing static members of Door class
 // view UP vector
@@ -289,7 +397,6 @@ const agl::Vec3 Door::s_viewUP = agl::Vec3(0.0, 1.0, 0.0);
 const float Door::side = 2.5; // door side
 
 void Door::render() {
-    m_env.textureDrawing(m_tex, [&] {
   m_env.mat_scope([&] {
     m_env.translate(m_px, m_py, m_pz);
     // adjust mesh pre-defined angle
@@ -298,9 +405,41 @@ void Door::render() {
     m_env.rotate(45, agl::Vec3(0, 0, 1));
     // scale mesh
     m_env.scale(m_scaleX, m_scaleY, m_scaleZ);
-    m_mesh->renderGouraud(m_env.isWireframe());
+
+    // still loading: draw its bounding box
+    auto *mesh = m_mesh->get();
+    if (!mesh) {
+      if (m_mesh->hasBounds()) {
+        m_env.drawBoundingBox(m_mesh->bbmin(), m_mesh->bbmax());
+      }
+      return;
+    }
+
+    // level of detail from the size on screen
+    size_t level =
+        mesh->selectLod(m_env.projectedSize(mesh->center(), mesh->radius()));
+    // texture coordinates from the OBJ, or generated by OpenGL
+    auto &lod = mesh->lod(level);
+    m_env.lodDrawing(
+        *m_tex, level, [&] { lod.renderGouraud(m_env.isWireframe()); },
+        !lod.hasTexCoords());
   });
-    });
+}
+
+void Door::submit() {
+  agl::Point3 center;
+  float radius;
+  if (boundingSphere(center, radius) && !m_env.isVisible(center, radius)) {
+    return;
+  }
+  m_env.submit(agl::RenderPass::OPAQUE, *m_tex, agl::Point3(m_px, m_py, m_pz),
+               [this] { m_env.timedScope("door", [this] { render(); }); });
+}
+
+bool Door::boundingSphere(agl::Point3 &center, float &radius) const {
+  float scale = std::max({m_scaleX, m_scaleY, m_scaleZ});
+  return meshBoundingSphere(*m_mesh, agl::Point3(m_px, m_py, m_pz), scale,
+                            center, radius);
 }
 
 bool Door::checkCrossing(float x, float z) {
@@ -327,4 +466,54 @@ bool Door::checkCrossing(float x, float z) {
   return check_X && check_Z;
 }
 
+// rotation of p by -deg degrees around the X, Y or Z axis
+static agl::Point3 unrotateX(const agl::Point3 &p, float deg) {
+  float c = cosf(deg * M_PI / 180.0f), s = sinf(deg * M_PI / 180.0f);
+  return agl::Point3(p.x, p.y * c + p.z * s, -p.y * s + p.z * c);
+}
+
+static agl::Point3 unrotateY(const agl::Point3 &p, float deg) {
+  float c = cosf(deg * M_PI / 180.0f), s = sinf(deg * M_PI / 180.0f);
+  return agl::Point3(p.x * c - p.z * s, p.y, p.x * s + p.z * c);
+}
+
+static agl::Point3 unrotateZ(const agl::Point3 &p, float deg) {
+  float c = cosf(deg * M_PI / 180.0f), s = sinf(deg * M_PI / 180.0f);
+  return agl::Point3(p.x * c + p.y * s, -p.x * s + p.y * c, p.z);
+}
+
+agl::Point3 Door::unrotate(const agl::Point3 &v) const {
+  return unrotateZ(unrotateX(unrotateY(v, m_angle), 90), 45);
+}
+
+agl::Point3 Door::toMesh(const agl::Point3 &p) const {
+  agl::Point3 q = unrotate(p - agl::Point3(m_px, m_py, m_pz));
+  return agl::Point3(q.x / m_scaleX, q.y / m_scaleY, q.z / m_scaleZ);
+}
+
+bool Door::collides(const agl::Point3 &from, const agl::Point3 &to) const {
+  auto *mesh = m_mesh->get();
+  if (!mesh || !mesh->bvh()) {
+    return false;
+  }
+  return mesh->bvh()->intersectSegment(toMesh(from), toMesh(to));
+}
+
+bool Door::collides(const agl::Obb &box) const {
+  auto *mesh = m_mesh->get();
+  if (!mesh || !mesh->bvh()) {
+    return false;
+  }
+
+  // the door is scaled the same on all axes (DOOR_SCALE): the box stays a
+  // box, with orthonormal axes, in the mesh coords
+  agl::Obb mesh_box;
+  mesh_box.center = toMesh(box.center);
+  for (size_t i = 0; i < 3; ++i) {
+    mesh_box.axis[i] = unrotate(box.axis[i]);
+    mesh_box.half[i] = box.half[i] / m_scaleX;
+  }
+  return mesh->bvh()->intersectObb(mesh_box);
+}
+
 } // namespace elements
@@ -17,6 +17,17 @@ namespace elements {
 // utility function, returns the string related to the motion
 const std::string motion_to_str(spaceship::Motion mt);
 
+// Work done on the meshes of the scene once loaded: levels of detail, the
+// collision BVH and, if enabled, quantization. Runs on the mesh loader thread.
+void prepareSceneMesh(agl::Mesh &mesh);
+
+// Sphere in world coords containing a mesh drawn at position, with any
+// rotation and scaled at most by scale. False while its bounds are unknown
+// (still loading, no cache): then it can't be culled.
+bool meshBoundingSphere(const agl::MeshHandle &mesh,
+                        const agl::Point3 &position, float scale,
+                        agl::Point3 &center, float &radius);
+
 /*
  * The floor.
  * Construcor loads the texture and stores it in m_tex
@@ -30,7 +41,7 @@ class Floor {
 private:
   float m_size, m_height;
   agl::Env &m_env;  // reference to env, needed in the constructor
-  agl::TexID m_tex; // floor texture
+  agl::TexRef m_tex; // floor texture
 
   // construct the floor loading the texture
   Floor(const char *texture_filename);
@@ -40,6 +51,8 @@ public:
   friend Floor *get_floor(const char *filename);
 
   void render();
+  // queue the rendering (see agl::Env::submit)
+  void submit();
 };
 
 // get singleton instance of floor
@@ -49,7 +62,7 @@ Floor *get_floor(const char *filename);
 class Sky {
 private:
   agl::Env &m_env;
-  agl::TexID m_tex;
+  agl::TexRef m_tex;
   double m_radius;
   int m_lats, m_longs;
 
@@ -61,6 +74,8 @@ public:
   friend Sky *get_sky(const char *filename);
 
   void render();
+  // queue the rendering, in the background pass
+  void submit();
 
   // accessors
   void set_params(double radius = 100.0, int lats = 20, int longs = 20);
@@ -102,10 +117,18 @@ public:
   // radius values
   static const float s_r;
   static const float s_R;
+  // sphere around the drawn torus, for the frustum culling
+  static const float s_bounding_radius;
 
   Ring(float x, float y, float z, bool m_3D_FLIGHT = false, float angle = 30.0);
 
-  void render();
+  // position, angle and color of the ring, for the instance buffer
+  agl::Instance instance() const;
+  // draws the first count rings of the buffer with a single call
+  static void render(agl::InstanceBuffer &rings, size_t count);
+  // queue the rendering of the visible ones: the rings are transparent,
+  // sorted back to front
+  static void submit(agl::InstanceBuffer &rings, size_t count);
 
   // check if the new ship position has crossed the ring
   void checkCrossing(float x, float z);
@@ -145,11 +168,18 @@ public:
   static const agl::Vec3 s_viewUP;
   // radius values
   static const float side;
+  // sphere around the drawn cube, for the frustum culling
+  static const float s_bounding_radius;
 
   BadCube(float x, float y, float z, bool m_3D_FLIGHT = false,
           float angle = 30.0);
 
-  void render();
+  // position and angle of the cube (no color), for the instance buffer
+  agl::Instance instance() const;
+  // draws the first count cubes of the buffer with a single call
+  static void render(agl::InstanceBuffer &cubes, size_t count);
+  // queue the rendering of the visible ones, sorted front to back
+  static void submit(agl::InstanceBuffer &cubes, size_t count);
 
   // check if the new ship position has crossed the ring
   bool checkCrossing(float x, float z);
@@ -171,8 +201,8 @@ public:
 class Door {
 
 private:
-  std::unique_ptr<agl::Mesh> m_mesh;
-  agl::TexID m_tex;
+  std::shared_ptr<agl::MeshHandle> m_mesh; // loaded in background
+  agl::TexRef m_tex;
   float m_px, m_py, m_pz;             // coords
   float m_scaleX, m_scaleY, m_scaleZ; // scaling factors
   float m_ship_old_z; // the previous ship position wrt ring ref frame
@@ -183,6 +213,11 @@ private:
   // private cons, see get_door
   Door(const char *mesh_filename, const char *texture_filename);
 
+  // world -> mesh coords, the inverse of the transformations in render().
+  // unrotate only undoes the rotations (for directions)
+  agl::Point3 unrotate(const agl::Point3 &v) const;
+  agl::Point3 toMesh(const agl::Point3 &p) const;
+
 public:
   friend std::unique_ptr<Door> get_door(const char *mesh_filename,
                                         const char *texture_filename);
@@ -194,9 +229,18 @@ public:
   static const float side;
 
   void render();
+  // queue the rendering, unless it is out of the view frustum
+  void submit();
+  bool boundingSphere(agl::Point3 &center, float &radius) const;
 
   // check if the new ship position has crossed the ring
   bool checkCrossing(float x, float z);
+  // does the ship motion from -> to (world coords) hit the door geometry?
+  // Always false while the mesh is loading.
+  bool collides(const agl::Point3 &from, const agl::Point3 &to) const;
+  // does the box (world coords) touch the door geometry? Same as above
+  // while loading
+  bool collides(const agl::Obb &box) const;
 
   // accessors
   inline float x() { return m_px; }
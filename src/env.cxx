@@ -1,6 +1,9 @@
 #include "agl.h"
 #include <SDL2/SDL_ttf.h>
 
+#include <algorithm>
+#include <cstddef>
+
 namespace agl {
 
 // Returns the singleton instance of agl::Env, initializing it if necessary
@@ -22,8 +25,26 @@ Env::Env()
       m_key_up_handler([](Key) {}),
 
       // all environment variables
-      m_screenH(750), m_screenW(900), m_wireframe(false), m_envmap(true),
-      m_headlight(false), m_shadow(false), m_blending(true) {
+      m_screenH(750), m_screenW(900), m_primitive_hits(0),
+      m_primitive_misses(0), m_instances(nullptr), m_instance_count(0), m_instance_program(0),
+      m_state_cache(true), m_texture(0), m_blend_src(GL_ONE),
+      m_blend_dst(GL_ZERO), m_texture_known(false), m_blend_known(false),
+      m_state_issued(0), m_state_filtered(0), m_last_issued(0),
+      m_last_filtered(0), m_frustum(), m_culling(true), m_visible(0),
+      m_culled(0), m_pipeline(Pipeline::GLSL), m_shading(false), m_program(0),
+      m_program_known(false), m_camera_ubo(0), m_lights_ubo(0), m_camera(),
+      m_lights_dirty(true), m_spot_light(0),
+      m_shadow_quality(ShadowQuality::MAP), m_shadow_size(1024),
+      m_shadow_fbo(0), m_shadow_tex(0), m_shadow_valid(false),
+      m_shadow_frame(false), m_shadow_receiver(false), m_shadow_caster(),
+      m_shadow_matrix(), m_frames_in_flight(2), m_frame_wait_ms(0.0),
+      m_frame_wait_avg_ms(0.0), m_gpu_timing(false), m_timing_known(false),
+      m_timer_active(false), m_timer_frame(0), m_last_timer_log(0.0),
+      m_frames(0), m_frame_limit(0), m_modelview(1, identityMatrix()),
+      m_projection(1, identityMatrix()), m_matrix_mode(GL_MODELVIEW),
+      m_color(WHITE), m_wireframe(false), m_envmap(true),
+      m_headlight(false), m_shadow(false), m_blending(true),
+      m_lod_debug(false) {
 
   // -----> "__func__" == function name
   // it will be used systematically thorugh the code 
@@ -133,9 +154,9 @@ void Env::enableJoystick() {
 // that have been previously pushed.
 // Takes a lambda as argument
 void Env::mat_scope(const std::function<void(void)> callback) {
-  glPushMatrix();
+  pushMatrix();
   callback();
-  glPopMatrix();
+  popMatrix();
 }
 
 Uint32 Env::getTicks() { return SDL_GetTicks(); }
@@ -156,97 +177,381 @@ std::unique_ptr<SmartWindow> Env::createWindow(std::string &name, size_t x,
   return std::unique_ptr<SmartWindow>(new SmartWindow(name, x, y, w, h));
 }
 
-// draw a circle
-void Env::drawCircle(double cx, double cy, double radius) {
-  const static auto N_SEGMENTS = 25;
+size_t PrimitiveKeyHash::operator()(const PrimitiveKey &key) const {
+  size_t h = std::hash<int>()(key.shape);
+  for (size_t v : {std::hash<float>()(key.a), std::hash<float>()(key.b),
+                   std::hash<int>()(key.n), std::hash<int>()(key.m)}) {
+    h ^= v + 0x9e3779b9 + (h << 6) + (h >> 2);
+  }
+  return h;
+}
+
+// floats per vertex: position [, normal] [, u v]
+static size_t floats(const Primitive &prim) {
+  return 3 + (prim.buffers.normals ? 3 : 0) + (prim.buffers.uv ? 2 : 0);
+}
 
-  glBegin(GL_TRIANGLE_FAN);
-  for (int i = 0; i < N_SEGMENTS; ++i) {
-    float theta = 2.0f * M_PI * float(i) / float(N_SEGMENTS); // current angle
+// Draws a cached primitive: it's tessellated and uploaded the first time,
+// afterwards it's a buffer bind and a single draw call.
+void Env::drawPrimitive(const PrimitiveKey &key,
+                        const std::function<void(Primitive &)> &tessellate) {
+  auto it = m_primitives.find(key);
+  if (it != m_primitives.end()) {
+    ++m_primitive_hits;
+  } else {
+    ++m_primitive_misses;
+    it = m_primitives.emplace(key, Primitive()).first;
+    Primitive &prim = it->second;
+    tessellate(prim);
+    prim.count = prim.indices.empty() ? prim.vertices.size() / floats(prim)
+                                      : prim.indices.size();
+    // the copy in main memory is only needed for the immediate mode
+    if (getMeshBuffers() &&
+        createBuffers(prim.buffers, prim.vertices, prim.indices)) {
+      prim.vertices = std::vector<float>();
+      prim.indices = std::vector<uint32_t>();
+    }
+  }
 
-    float x = radius * cosf(theta); // calculate the x component
-    float y = radius * sinf(theta); // calculate the y component
+  if (m_instances) {
+    renderInstances(it->second);
+  } else {
+    renderPrimitive(it->second);
+  }
+}
 
-    glVertex2f(x + cx, y + cy); // output vertex
+void Env::renderPrimitive(const Primitive &prim) {
+  if (prim.buffers.vbo) {
+    applyProgram();
+    bindBuffers(prim.buffers);
+    if (prim.buffers.ibo) {
+      glDrawElements(prim.mode, prim.count, GL_UNSIGNED_INT, nullptr);
+    } else {
+      glDrawArrays(prim.mode, 0, prim.count);
+    }
+    unbindBuffers(prim.buffers);
+    return;
+  }
+
+  // the shaders read the vertex buffers only: the immediate mode is drawn
+  // by the fixed function
+  useProgram(0);
+  const size_t n_floats = floats(prim);
+  const size_t uv = prim.buffers.normals ? 6 : 3;
+  glBegin(prim.mode);
+  for (GLsizei i = 0; i < prim.count; ++i) {
+    const float *v =
+        &prim.vertices[n_floats * (prim.indices.empty() ? i : prim.indices[i])];
+    if (prim.buffers.normals) {
+      glNormal3fv(v + 3);
+    }
+    if (prim.buffers.uv) {
+      glTexCoord2fv(v + uv);
+    }
+    glVertex3fv(v);
   }
   glEnd();
 }
 
-// draw a cube rasterizing quads
-void Env::drawCubeFill(const float S) {
+// generic attributes of the instances, next to those of the vertices
+static const GLuint INSTANCE_POSE = ATTRIB_INSTANCE_POSE,
+                    INSTANCE_COLOR = ATTRIB_INSTANCE_COLOR;
+
+// Instances drawn with the fixed function pipeline (the GLSL one has its
+// own, see shaders.cxx): per instance transformation, then the fixed
+// function lighting of the scene (LIGHT0, directional, colour material on
+// ambient and diffuse).
+static const char *INSTANCE_VERTEX_SHADER = R"(
+#version 120
+attribute vec4 instance_pose; // x, y, z, angle around Y in degrees
+attribute vec4 instance_color;
+uniform bool lighting;
+uniform bool use_instance_color;
+uniform mat4 eye_to_shadow;
+varying vec4 shadow_coord;
+
+void main() {
+  float a = radians(instance_pose.w);
+  mat3 rot = mat3(cos(a), 0.0, -sin(a), 0.0, 1.0, 0.0, sin(a), 0.0, cos(a));
+  vec4 pos = vec4(rot * gl_Vertex.xyz + instance_pose.xyz, 1.0);
+  gl_Position = gl_ModelViewProjectionMatrix * pos;
+  shadow_coord = eye_to_shadow * (gl_ModelViewMatrix * pos);
+
+  vec4 color = use_instance_color ? instance_color : gl_Color;
+  if (lighting) {
+    vec3 n = normalize(gl_NormalMatrix * (rot * gl_Normal));
+    vec3 l = normalize(gl_LightSource[0].position.xyz);
+    float diffuse = max(dot(n, l), 0.0);
+    vec4 lit = gl_FrontMaterial.emission +
+               (gl_LightModel.ambient + gl_LightSource[0].ambient +
+                diffuse * gl_LightSource[0].diffuse) * color;
+    if (diffuse > 0.0) {
+      vec3 h = normalize(gl_LightSource[0].halfVector.xyz);
+      lit += pow(max(dot(n, h), 0.0), gl_FrontMaterial.shininess) *
+             gl_FrontMaterial.specular * gl_LightSource[0].specular;
+    }
+    color = vec4(lit.rgb, color.a);
+  }
+  gl_FrontColor = color;
+  gl_BackColor = color;
+}
+)";
+
+// The colour, darkened where the shadow map says so (see shadow_map.cxx).
+static const char *INSTANCE_FRAGMENT_SHADER = R"(
+#version 120
+uniform bool use_shadow;
+uniform float shadow_darkness;
+uniform sampler2DShadow shadow_map;
+varying vec4 shadow_coord;
+
+void main() {
+  gl_FragColor = gl_Color;
+  if (use_shadow) {
+    float lit = shadow2DProj(shadow_map, shadow_coord).r;
+    gl_FragColor.rgb *= mix(shadow_darkness, 1.0, lit);
+  }
+}
+)";
 
-  glBegin(GL_QUADS);
-
-  glNormal3f(0, 0, +1);
-  glVertex3f(+S, +S, +S);
-  glVertex3f(-S, +S, +S);
-  glVertex3f(-S, -S, +S);
-  glVertex3f(+S, -S, +S);
-
-  glNormal3f(0, 0, -1);
-  glVertex3f(+S, -S, -S);
-  glVertex3f(-S, -S, -S);
-  glVertex3f(-S, +S, -S);
-  glVertex3f(+S, +S, -S);
-
-  glNormal3f(0, +1, 0);
-  glVertex3f(+S, +S, +S);
-  glVertex3f(-S, +S, +S);
-  glVertex3f(-S, +S, -S);
-  glVertex3f(+S, +S, -S);
-
-  glNormal3f(0, -1, 0);
-  glVertex3f(+S, -S, -S);
-  glVertex3f(-S, -S, -S);
-  glVertex3f(-S, -S, +S);
-  glVertex3f(+S, -S, +S);
-
-  glNormal3f(+1, 0, 0);
-  glVertex3f(+S, +S, +S);
-  glVertex3f(+S, -S, +S);
-  glVertex3f(+S, -S, -S);
-  glVertex3f(+S, +S, -S);
-
-  glNormal3f(-1, 0, 0);
-  glVertex3f(-S, +S, -S);
-  glVertex3f(-S, -S, -S);
-  glVertex3f(-S, -S, +S);
-  glVertex3f(-S, +S, +S);
+// Compiles the instancing shader the first time. false if the driver
+// can't draw instances: they are then drawn one by one.
+bool Env::instanceProgram() {
+  static const auto TAG = __func__;
 
-  glEnd();
+  if (m_instance_program != 0) {
+    return m_instance_program > 0;
+  }
+  m_instance_program = -1;
+  if (!GLEW_VERSION_3_3 || !buffersSupported()) {
+    lg::i(TAG, "Instanced drawing not supported, one draw per instance");
+    return false;
+  }
+
+  GLuint program = glCreateProgram();
+  GLint ok;
+  const std::pair<GLenum, const char *> stages[] = {
+      {GL_VERTEX_SHADER, INSTANCE_VERTEX_SHADER},
+      {GL_FRAGMENT_SHADER, INSTANCE_FRAGMENT_SHADER}};
+  for (const auto &stage : stages) {
+    GLuint shader = glCreateShader(stage.first);
+    glShaderSource(shader, 1, &stage.second, nullptr);
+    glCompileShader(shader);
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if (!ok) {
+      char log[1024];
+      glGetShaderInfoLog(shader, sizeof(log), nullptr, log);
+      lg::e(TAG, "Instancing shader: %s", log);
+      glDeleteShader(shader);
+      glDeleteProgram(program);
+      return false;
+    }
+    glAttachShader(program, shader);
+    glDeleteShader(shader); // freed with the program
+  }
+
+  glBindAttribLocation(program, INSTANCE_POSE, "instance_pose");
+  glBindAttribLocation(program, INSTANCE_COLOR, "instance_color");
+  glLinkProgram(program);
+  glGetProgramiv(program, GL_LINK_STATUS, &ok);
+  if (!ok) {
+    char log[1024];
+    glGetProgramInfoLog(program, sizeof(log), nullptr, log);
+    lg::e(TAG, "Instancing shader: %s", log);
+    glDeleteProgram(program);
+    return false;
+  }
+
+  m_instance_program = program;
+  m_lighting_loc = glGetUniformLocation(program, "lighting");
+  m_instance_color_loc = glGetUniformLocation(program, "use_instance_color");
+  m_instance_shadow_loc = glGetUniformLocation(program, "use_shadow");
+  m_instance_eye_to_shadow_loc =
+      glGetUniformLocation(program, "eye_to_shadow");
+  m_instance_darkness_loc = glGetUniformLocation(program, "shadow_darkness");
+  useProgram(program);
+  glUniform1i(glGetUniformLocation(program, "shadow_map"), 1);
+  return true;
+}
+
+void Env::renderInstances(const Primitive &prim) {
+  InstanceBuffer &instances = *m_instances;
+
+  // in the render queue the scene shaders draw them, with the spot and the
+  // shadow map; otherwise the instancing shader above
+  bool instanced = prim.buffers.vbo && applyProgram(true);
+  if (!instanced && prim.buffers.vbo && !m_shading && instanceProgram()) {
+    useProgram(m_instance_program);
+    glUniform1i(m_lighting_loc, isEnabled(GL_LIGHTING));
+    glUniform1i(m_instance_color_loc, instances.colored());
+    // receivers of the shadow map, see shadow_map.cxx
+    bool shadowed = m_shadow_receiver && m_shadow_frame;
+    glUniform1i(m_instance_shadow_loc, shadowed);
+    if (shadowed) {
+      glUniformMatrix4fv(m_instance_eye_to_shadow_loc, 1, GL_FALSE,
+                         m_lights.eye_to_shadow);
+      glUniform1f(m_instance_darkness_loc, m_lights.shadow_params[0]);
+    }
+    instanced = true;
+  }
+
+  if (instanced) {
+    GLuint vbo = instances.upload();
+    bindBuffers(prim.buffers);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glEnableVertexAttribArray(INSTANCE_POSE);
+    glVertexAttribPointer(INSTANCE_POSE, 4, GL_FLOAT, GL_FALSE,
+                          sizeof(Instance), nullptr);
+    glVertexAttribDivisor(INSTANCE_POSE, 1);
+    if (instances.colored()) {
+      glEnableVertexAttribArray(INSTANCE_COLOR);
+      glVertexAttribPointer(
+          INSTANCE_COLOR, 4, GL_FLOAT, GL_FALSE, sizeof(Instance),
+          reinterpret_cast<const void *>(offsetof(Instance, color)));
+      glVertexAttribDivisor(INSTANCE_COLOR, 1);
+    }
+
+    if (prim.buffers.ibo) {
+      glDrawElementsInstanced(prim.mode, prim.count, GL_UNSIGNED_INT, nullptr,
+                              m_instance_count);
+    } else {
+      glDrawArraysInstanced(prim.mode, 0, prim.count, m_instance_count);
+    }
+
+    // the vertex array object of the primitive is shared with plain draws
+    for (GLuint attrib : {INSTANCE_POSE, INSTANCE_COLOR}) {
+      glVertexAttribDivisor(attrib, 0);
+      glDisableVertexAttribArray(attrib);
+    }
+    unbindBuffers(prim.buffers);
+    return;
+  }
+
+  // one by one, as the objects would draw themselves
+  for (size_t i = 0; i < m_instance_count; ++i) {
+    const Instance &instance = instances.drawn(i);
+    pushMatrix();
+    translate(instance.x, instance.y, instance.z);
+    rotate(instance.angle, Vec3(0.0f, 1.0f, 0.0f));
+    if (instances.colored()) {
+      setColor(instance.color);
+    }
+    renderPrimitive(prim);
+    popMatrix();
+  }
 }
 
-// draw a wireframe cube
-void Env::drawCubeWire(const float side) {
-  lineWidth(12.0);
+void Env::instancedDrawing(InstanceBuffer &instances, size_t count,
+                           std::function<void()> callback) {
+  m_instances = &instances;
+  m_instance_count = std::min(count, instances.drawable());
+  if (m_instance_count > 0) {
+    callback();
+  }
+  m_instances = nullptr;
+}
 
-  glBegin(GL_LINE_LOOP); // face z=+side
-  glVertex3f(+side, +side, +side);
-  glVertex3f(-side, +side, +side);
-  glVertex3f(-side, -side, +side);
-  glVertex3f(+side, -side, +side);
-  glEnd();
+size_t Env::primitiveCacheBytes() const {
+  size_t bytes = 0;
+  for (const auto &entry : m_primitives) {
+    const Primitive &prim = entry.second;
+    bytes += prim.buffers.bytes + prim.vertices.size() * sizeof(float) +
+             prim.indices.size() * sizeof(uint32_t);
+  }
+  return bytes;
+}
 
-  glBegin(GL_LINE_LOOP); // face z=-side
-  glVertex3f(+side, -side, -side);
-  glVertex3f(-side, -side, -side);
-  glVertex3f(-side, +side, -side);
-  glVertex3f(+side, +side, -side);
-  glEnd();
+double Env::primitiveHitRate() const {
+  size_t lookups = m_primitive_hits + m_primitive_misses;
+  return lookups > 0 ? double(m_primitive_hits) / lookups : 0.0;
+}
 
-  glBegin(GL_LINES); // 4 segments from -z to +z
-  glVertex3f(-side, -side, -side);
-  glVertex3f(-side, -side, +side);
+void Env::releasePrimitives() {
+  static const auto TAG = __func__;
 
-  glVertex3f(+side, -side, -side);
-  glVertex3f(+side, -side, +side);
+  lg::i(TAG, "%zu primitives cached (%.1f KB), hit rate %.2f%%",
+        primitiveCacheSize(), primitiveCacheBytes() / 1024.0,
+        100.0 * primitiveHitRate());
+  for (auto &entry : m_primitives) {
+    deleteBuffers(entry.second.buffers);
+  }
+  m_primitives.clear();
 
-  glVertex3f(+side, +side, -side);
-  glVertex3f(+side, +side, +side);
+  if (m_instance_program > 0 && hasGLContext()) {
+    glDeleteProgram(m_instance_program);
+  }
+  m_instance_program = 0;
+  releaseShaders();
+  releaseShadowMap();
+  releaseFrameFences();
+  releaseTimers();
+}
 
-  glVertex3f(-side, +side, -side);
-  glVertex3f(-side, +side, +side);
-  glEnd();
+// draw a circle
+void Env::drawCircle(double cx, double cy, double radius) {
+  const static auto N_SEGMENTS = 25;
+
+  // the same circle is drawn at different centers
+  pushMatrix();
+  translate(cx, cy, 0.0f);
+  drawPrimitive({PrimitiveKey::CIRCLE, float(radius), 0.0f, N_SEGMENTS, 0},
+                [&](Primitive &prim) {
+                  prim.mode = GL_TRIANGLE_FAN;
+                  prim.buffers.normals = false;
+                  for (int i = 0; i < N_SEGMENTS; ++i) {
+                    // current angle
+                    float theta = 2.0f * M_PI * float(i) / float(N_SEGMENTS);
+                    prim.vertices.insert(prim.vertices.end(),
+                                         {float(radius * cosf(theta)),
+                                          float(radius * sinf(theta)), 0.0f});
+                  }
+                });
+  popMatrix();
+}
+
+// draw a cube made of 6 quads, as 12 triangles
+void Env::drawCubeFill(const float S) {
+  drawPrimitive({PrimitiveKey::CUBE_FILL, S, 0.0f, 0, 0}, [&](Primitive &prim) {
+    // normal and 4 corners of each face
+    const float faces[6][5][3] = {
+        {{0, 0, +1}, {+S, +S, +S}, {-S, +S, +S}, {-S, -S, +S}, {+S, -S, +S}},
+        {{0, 0, -1}, {+S, -S, -S}, {-S, -S, -S}, {-S, +S, -S}, {+S, +S, -S}},
+        {{0, +1, 0}, {+S, +S, +S}, {-S, +S, +S}, {-S, +S, -S}, {+S, +S, -S}},
+        {{0, -1, 0}, {+S, -S, -S}, {-S, -S, -S}, {-S, -S, +S}, {+S, -S, +S}},
+        {{+1, 0, 0}, {+S, +S, +S}, {+S, -S, +S}, {+S, -S, -S}, {+S, +S, -S}},
+        {{-1, 0, 0}, {-S, +S, -S}, {-S, -S, -S}, {-S, -S, +S}, {-S, +S, +S}}};
+
+    for (const auto &face : faces) {
+      uint32_t base = prim.vertices.size() / 6;
+      for (size_t k = 1; k <= 4; ++k) {
+        prim.vertices.insert(prim.vertices.end(), face[k], face[k] + 3);
+        prim.vertices.insert(prim.vertices.end(), face[0], face[0] + 3);
+      }
+      prim.indices.insert(prim.indices.end(), {base, base + 1, base + 2, base,
+                                               base + 2, base + 3});
+    }
+  });
+}
+
+// draw a wireframe cube
+void Env::drawCubeWire(const float side) {
+  lineWidth(12.0);
+
+  drawPrimitive({PrimitiveKey::CUBE_WIRE, side, 0.0f, 0, 0},
+                [&](Primitive &prim) {
+                  prim.mode = GL_LINES;
+                  prim.buffers.normals = false;
+                  // corner k has the signs of bits 0, 1, 2 (x, y, z)
+                  for (int k = 0; k < 8; ++k) {
+                    prim.vertices.insert(prim.vertices.end(),
+                                         {k & 1 ? +side : -side,
+                                          k & 2 ? +side : -side,
+                                          k & 4 ? +side : -side});
+                  }
+                  // faces z=-side and z=+side, then the 4 segments between
+                  prim.indices = {0, 1, 1, 3, 3, 2, 2, 0, 4, 5, 5, 7,
+                                  7, 6, 6, 4, 0, 4, 1, 5, 2, 6, 3, 7};
+                });
 }
 
 void Env::drawCube(const float side) {
@@ -256,47 +561,62 @@ void Env::drawCube(const float side) {
   drawCubeWire(side);
 }
 
-// size 'sz' should be ~100.0f
-void Env::drawPlane(float sz, float height, size_t num_quads) {
-  glNormal3f(0, 1, 0); // normale verticale uguale x tutti
-  auto ratio = (double)sz / num_quads;
-  glBegin(GL_QUADS);
-  {
-    for (size_t x = 0; x < num_quads; ++x) {
-      for (size_t z = 0; z < num_quads; ++z) {
-        float x0 = -sz + 2 * (x + 0) * ratio;
-        float x1 = -sz + 2 * (x + 1) * ratio;
-        float z0 = -sz + 2 * (z + 0) * ratio;
-        float z1 = -sz + 2 * (z + 1) * ratio;
-
-        if (!m_wireframe) {
-          // bottom left
-          glTexCoord2f(0.0f, 1.0f);
-          glVertex3d(x0, height, z1);
-
-          // top left
-          glTexCoord2f(0.0f, 0.0f);
-          glVertex3d(x0, height, z0);
-
-          // top right
-          glTexCoord2f(1.0f, 0.0f);
-          glVertex3d(x1, height, z0);
-
-          // bottom right
-          glTexCoord2f(1.0f, 1.0f);
-          glVertex3d(x1, height, z1);
-        } else {
-          glVertex3d(x0, height, z1);
-          glVertex3d(x0, height, z0);
-          glVertex3d(x1, height, z0);
-          glVertex3d(x1, height, z1);
-        }
-      }
+void Env::drawBoundingBox(const Point3 &min, const Point3 &max) {
+  const float x[2] = {min.x, max.x}, y[2] = {min.y, max.y},
+              z[2] = {min.z, max.z};
+
+  // immediate mode: fixed function, see renderPrimitive
+  useProgram(0);
+
+  glBegin(GL_LINES);
+  for (size_t i = 0; i < 2; ++i) {
+    for (size_t j = 0; j < 2; ++j) {
+      // the 4 edges along x, along y and along z
+      glVertex3f(x[0], y[i], z[j]);
+      glVertex3f(x[1], y[i], z[j]);
+      glVertex3f(x[i], y[0], z[j]);
+      glVertex3f(x[i], y[1], z[j]);
+      glVertex3f(x[i], y[j], z[0]);
+      glVertex3f(x[i], y[j], z[1]);
     }
   }
   glEnd();
 }
 
+// size 'sz' should be ~100.0f
+// The grid is uploaded once and drawn with a single call. It's still made
+// of num_quads^2 quads (and not of one big quad) so that the per vertex
+// lighting varies across the floor as before. One texture tile per quad:
+// the texture coordinates rely on GL_REPEAT.
+void Env::drawPlane(float sz, float height, size_t num_quads) {
+  drawPrimitive(
+      {PrimitiveKey::PLANE, sz, height, int(num_quads), 0},
+      [&](Primitive &prim) {
+        prim.buffers.uv = true;
+
+        auto ratio = (double)sz / num_quads;
+        const uint32_t row = num_quads + 1;
+        for (size_t x = 0; x <= num_quads; ++x) {
+          for (size_t z = 0; z <= num_quads; ++z) {
+            // normale verticale uguale x tutti
+            prim.vertices.insert(prim.vertices.end(),
+                                 {float(-sz + 2 * x * ratio), height,
+                                  float(-sz + 2 * z * ratio), 0.0f, 1.0f, 0.0f,
+                                  float(x), float(z)});
+          }
+        }
+
+        // bottom left, top left, top right, bottom right
+        for (uint32_t x = 0; x < num_quads; ++x) {
+          for (uint32_t z = 0; z < num_quads; ++z) {
+            uint32_t v = x * row + z;
+            prim.indices.insert(prim.indices.end(), {v + 1, v, v + row, v + 1,
+                                                     v + row, v + row + 1});
+          }
+        }
+      });
+}
+
 void Env::drawFloor(TexID texbind, float sz, float height, size_t num_quads) {
 
   textureDrawing(texbind,
@@ -304,17 +624,17 @@ void Env::drawFloor(TexID texbind, float sz, float height, size_t num_quads) {
                    // draw num_quads^2 number of quads
 
                    if (m_wireframe) {
-                     glDisable(GL_TEXTURE_2D);
-                     glColor3f(SHADOW.r, SHADOW.g, SHADOW.b);
+                     disable(GL_TEXTURE_2D);
+                     setColor(SHADOW);
 
-                     glDisable(GL_LIGHTING);
+                     disable(GL_LIGHTING);
                      // glPolygonMode(GL_FRONT_AND_BACK, GL_LINE); // LINES
                      glPolygonMode(GL_FRONT_AND_BACK, GL_FILL); // Whole floor
                      drawPlane(sz, height, num_quads);
 
                      glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-                     glColor3f(WHITE.r, WHITE.g, WHITE.b);
-                     glEnable(GL_LIGHTING);
+                     setColor(WHITE);
+                     enable(GL_LIGHTING);
                    } else {
                      // glColor3f(0.6, 0.6, 0.6); // colore uguale x tutti i
                      // quads
@@ -341,23 +661,23 @@ void Env::drawSky(TexID texbind, double radius, int lats, int longs) {
                  [&] {
 
                    if (m_wireframe) {
-                     glDisable(GL_TEXTURE_2D);
-                     glColor3f(BLACK.r, BLACK.g, BLACK.b);
-                     glDisable(GL_LIGHTING);
+                     disable(GL_TEXTURE_2D);
+                     setColor(BLACK);
+                     disable(GL_LIGHTING);
                      glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 
                      drawSphere(radius, lats, longs);
 
                      glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-                     glColor3f(WHITE.r, WHITE.g, WHITE.b);
-                     glEnable(GL_LIGHTING);
+                     setColor(WHITE);
+                     enable(GL_LIGHTING);
                    } else {
-                     glColor3f(WHITE.r, WHITE.g, WHITE.b);
-                     glDisable(GL_LIGHTING);
+                     setColor(WHITE);
+                     disable(GL_LIGHTING);
 
                      drawSphere(radius, lats, longs);
 
-                     glEnable(GL_LIGHTING);
+                     enable(GL_LIGHTING);
                    }
 
                  },
@@ -365,42 +685,50 @@ void Env::drawSky(TexID texbind, double radius, int lats, int longs) {
 }
 
 void Env::drawSphere(double radius, int lats, int longs) {
-  int i, j;
-  for (i = 0; i <= lats; i++) {
-    double lat0 = M_PI * (-0.5 + (double)(i - 1) / lats);
-    double z0 = sin(lat0);
-    double zr0 = cos(lat0);
-
-    double lat1 = M_PI * (-0.5 + (double)i / lats);
-    double z1 = sin(lat1);
-    double zr1 = cos(lat1);
-
-    glBegin(GL_QUAD_STRIP);
-    for (j = 0; j <= longs; j++) {
-      double lng = 2 * M_PI * (double)(j - 1) / longs;
-      double x = cos(lng);
-      double y = sin(lng);
-
-      // Normal are needed for the EnvMap
-      glNormal3f(x * zr0, y * zr0, z0);
-      glVertex3f(radius * x * zr0, radius * y * zr0, radius * z0);
-      glNormal3f(x * zr1, y * zr1, z1);
-      glVertex3f(radius * x * zr1, radius * y * zr1, radius * z1);
-    }
-    glEnd();
-  }
+  drawPrimitive(
+      {PrimitiveKey::SPHERE, float(radius), 0.0f, lats, longs},
+      [&](Primitive &prim) {
+        // rows of latitude from -1 to lats, each strip between two of them
+        for (int i = -1; i <= lats; i++) {
+          double lat = M_PI * (-0.5 + (double)i / lats);
+          double z = sin(lat);
+          double zr = cos(lat);
+
+          for (int j = 0; j <= longs; j++) {
+            double lng = 2 * M_PI * (double)(j - 1) / longs;
+            double x = cos(lng);
+            double y = sin(lng);
+
+            // Normal are needed for the EnvMap
+            prim.vertices.insert(
+                prim.vertices.end(),
+                {float(radius * x * zr), float(radius * y * zr),
+                 float(radius * z), float(x * zr), float(y * zr), float(z)});
+          }
+        }
+
+        const uint32_t row = longs + 1;
+        for (uint32_t i = 0; i <= uint32_t(lats); i++) {
+          for (uint32_t j = 0; j < uint32_t(longs); j++) {
+            uint32_t a = i * row + j, b = a + row;
+            prim.indices.insert(prim.indices.end(),
+                                {a, b, b + 1, a, b + 1, a + 1});
+          }
+        }
+      });
 }
 
 void Env::drawSquare(const float side) {
   lineWidth(10.0);
 
   // line loop between the 4 vertex
-  glBegin(GL_LINE_LOOP);
-  glVertex3f(+side, +side, +side);
-  glVertex3f(-side, +side, +side);
-  glVertex3f(-side, -side, +side);
-  glVertex3f(+side, -side, +side);
-  glEnd();
+  drawPrimitive({PrimitiveKey::SQUARE, side, 0.0f, 0, 0},
+                [&](Primitive &prim) {
+                  prim.mode = GL_LINE_LOOP;
+                  prim.buffers.normals = false;
+                  prim.vertices = {+side, +side, +side, -side, +side, +side,
+                                   -side, -side, +side, +side, -side, +side};
+                });
 }
 
 // Draws a torus of inner radius r and outer radius R.
@@ -410,46 +738,71 @@ void Env::drawTorus(double r, double R) {
   const static int NUM_VERTEX_APPROX = 35;
   // length of the perimeter of the ring
   const static double RING_PERIMETER = 2.0 * M_PI;
-  double s, t, x, y, z;
-  double cos_phi, sin_phi, cos_teta, sin_teta;
 
-  for (size_t i = 0; i < NUM_C; ++i) {
-    glBegin(GL_QUAD_STRIP);
-
-    for (size_t j = 0; j <= NUM_VERTEX_APPROX; ++j) {
-      for (int k = 1; k >= 0; --k) {
-        s = (i + k) % NUM_C + 0.5;
-        t = j % NUM_VERTEX_APPROX;
-
-        cos_phi = cos(s * RING_PERIMETER / NUM_C);
-        sin_phi = sin(s * RING_PERIMETER / NUM_C);
-
-        cos_teta = cos(t * RING_PERIMETER / NUM_VERTEX_APPROX);
-        sin_teta = sin(t * RING_PERIMETER / NUM_VERTEX_APPROX);
-
-        x = (R + r * cos_phi) * cos_teta;
-        y = (R + r * cos_phi) * sin_teta;
-        z = r * sin_phi;
+  drawPrimitive(
+      {PrimitiveKey::TORUS, float(r), float(R), NUM_C, NUM_VERTEX_APPROX},
+      [&](Primitive &prim) {
+        // NUM_C circles of NUM_VERTEX_APPROX vertices each
+        for (int i = 0; i < NUM_C; ++i) {
+          double s = i + 0.5;
+          double cos_phi = cos(s * RING_PERIMETER / NUM_C);
+          double sin_phi = sin(s * RING_PERIMETER / NUM_C);
+
+          for (int t = 0; t < NUM_VERTEX_APPROX; ++t) {
+            double cos_teta = cos(t * RING_PERIMETER / NUM_VERTEX_APPROX);
+            double sin_teta = sin(t * RING_PERIMETER / NUM_VERTEX_APPROX);
+
+            double x = (R + r * cos_phi) * cos_teta;
+            double y = (R + r * cos_phi) * sin_teta;
+            double z = r * sin_phi;
+
+            prim.vertices.insert(prim.vertices.end(),
+                                 {float(2 * x), float(2 * y), float(2 * z),
+                                  float(x), float(y), float(z)});
+          }
+        }
 
-        /*
-        double
-          n_x = cos_psi * cos_phi,
-          n_y = sin_psi * cos_phi,
-          n_z = sin_phi;
+        // quads between circle i + 1 and circle i, wrapping around
+        for (uint32_t i = 0; i < NUM_C; ++i) {
+          for (uint32_t j = 0; j < NUM_VERTEX_APPROX; ++j) {
+            uint32_t a = ((i + 1) % NUM_C) * NUM_VERTEX_APPROX + j;
+            uint32_t b = i * NUM_VERTEX_APPROX + j;
+            uint32_t a1 = ((i + 1) % NUM_C) * NUM_VERTEX_APPROX +
+                          (j + 1) % NUM_VERTEX_APPROX;
+            uint32_t b1 = i * NUM_VERTEX_APPROX + (j + 1) % NUM_VERTEX_APPROX;
+            prim.indices.insert(prim.indices.end(), {a, b, b1, a, b1, a1});
+          }
+        }
+      });
+}
 
-        glNormal3d(n_x, n_y, n_z);*/
+void Env::lineWidth(float width) { glLineWidth(width); }
 
-        glNormal3d(x, y, z);
-        glVertex3d(2 * x, 2 * y, 2 * z);
-      }
-    }
+// projected diameter of a sphere given in the current model coordinates:
+// the center goes to eye space through the modelview, the radius is scaled
+// by the biggest scaling factor of the modelview
+float Env::projectedSize(const Point3 &center, float radius) {
+  const Matrix4 &mv = modelview();
+  const Matrix4 &proj = projection();
+
+  float eye_z =
+      mv[2] * center.x + mv[6] * center.y + mv[10] * center.z + mv[14];
+  float scale = 0.0f;
+  for (size_t col = 0; col < 3; ++col) {
+    const float *c = mv.data() + 4 * col;
+    scale = std::max(scale, c[0] * c[0] + c[1] * c[1] + c[2] * c[2]);
   }
+  radius *= std::sqrt(scale);
 
-  glEnd();
+  // the camera is inside the sphere
+  if (-eye_z <= radius) {
+    return INFINITY;
+  }
+  // proj[5] = cot(fovy / 2): the diameter in normalized device coords is
+  // 2 * radius * proj[5] / distance, the screen is 2 units high
+  return radius * proj[5] / -eye_z * m_screenH;
 }
 
-void Env::lineWidth(float width) { glLineWidth(width); }
-
 // Load texture from image file.
 // repeat == true --> GL_REPEAT for s and t coordinates
 // nearest == true --> apply neareast neighbour interpolation
@@ -467,13 +820,13 @@ TexID Env::loadTexture(const char *filename, bool repeat, bool nearest) {
   SDL_Surface *s = IMG_Load(filename);
   if (!s) {
     lg::e(__func__, "Error while loading texture from file %s", filename);
-    return EXIT_FAILURE;
+    return 0; // never a texture name: the default texture
   }
 
   TexID texbind;
   // generate a name for the texture (i.e. an unsigned int)
   glGenTextures(1, &texbind);
-  glBindTexture(GL_TEXTURE_2D, texbind);
+  bindTexture(texbind);
   gluBuild2DMipmaps(GL_TEXTURE_2D, GL_RGB, s->w, s->h, GL_RGB, GL_UNSIGNED_BYTE,
                     s->pixels);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER,
@@ -512,62 +865,46 @@ void Env::render() {
   } else {
     m_fps_now++;
   }
+  newStateFrame();
+  newTimerFrame();
 
   // finally, the rendering we were all waiting for!
   m_render_handler();
+
+  ++m_frames;
+  if (m_frames == m_frame_limit) {
+    quitLoop();
+  }
 }
 
 // set environment variables to initial values
 void Env::reset() {
-  m_wireframe = m_headlight = m_shadow = false;
+  m_wireframe = m_headlight = m_shadow = m_lod_debug = false;
   m_envmap = m_blending = true;
 }
 
-void Env::rotate(float angle, const Vec3 &axis) {
-  glRotatef(angle, axis.x, axis.y, axis.z);
+// the shaders get it as a uniform, see applyProgram
+void Env::setColor(const Color &c) {
+  glColor4f(c.r, c.g, c.b, c.a);
+  m_color = c;
 }
 
-void Env::scale(float x, float y, float z) { glScalef(x, y, z); }
-
-void Env::setCamera(double eye_x, double eye_y, double eye_z, double aim_x,
-                    double aim_y, double aim_z, double upX, double upY,
-                    double upZ) {
-  // up vector looking at the sky (0,+y,0)
-  gluLookAt(eye_x, eye_y, eye_z, aim_x, aim_y, aim_z, upX, upY, upZ);
-}
-
-void Env::setColor(const Color &c) { glColor4f(c.r, c.g, c.b, c.a); }
-
 // setta le matrici di trasformazione in modo
 // che le coordinate in spazio oggetto siano le coord
 // del pixel sullo schemo
 void Env::setCoordToPixel() {
-  glMatrixMode(GL_PROJECTION);
-  glLoadIdentity();
-  glMatrixMode(GL_MODELVIEW);
-  glLoadIdentity();
-  glTranslatef(-1, -1, 0);
-  glScalef(2.0 / m_screenW, 2.0 / m_screenH, 1);
-}
-
-void Env::setupLightPosition() {
-  float light_position[4] = {0, 1, 2, 0}; // last component = 0 ==> directional light
-  glLightfv(GL_LIGHT0, GL_POSITION, light_position);
-}
-
-void Env::setupModelLights() {
-  // setup lights for the model
-  static float params[4] = {1, 1, 1, 1};
-  glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, params);
-  glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 127);
-
-  glEnable(GL_LIGHTING);
+  matrixMode(GL_PROJECTION);
+  loadIdentity();
+  matrixMode(GL_MODELVIEW);
+  loadIdentity();
+  translate(-1, -1, 0);
+  scale(2.0 / m_screenW, 2.0 / m_screenH, 1);
 }
 
 // Switches mode into GL_MODELVIEW, and then loads an identity matrix.
 void Env::setupModel() {
-  glMatrixMode(GL_MODELVIEW);
-  glLoadIdentity();
+  matrixMode(GL_MODELVIEW);
+  loadIdentity();
 }
 
 // Switches mode into GL_PERSPECTIVE, and then loads an identity matrix.
@@ -576,9 +913,9 @@ void Env::setupPersp() {
   double fovy = 70.0; // field of view angle, in deegres, along y direction
   double zNear = .2, zFar = 1000; // clipping plane distance
 
-  glMatrixMode(GL_PROJECTION);
-  glLoadIdentity();
-  gluPerspective(fovy, m_screenW / m_screenH, zNear, zFar);
+  matrixMode(GL_PROJECTION);
+  loadIdentity();
+  perspective(fovy, m_screenW / m_screenH, zNear, zFar);
 }
 
 // Helper function to draw textured objects
@@ -587,19 +924,19 @@ void Env::setupPersp() {
 void Env::textureDrawing(TexID texbind, std::function<void()> callback,
                          bool gen_coordinates) {
 
-  glBindTexture(GL_TEXTURE_2D, texbind);
-  glEnable(GL_TEXTURE_2D);
+  bindTexture(texbind);
+  enable(GL_TEXTURE_2D);
 
   // if the surface is complex, let OpenGL generate the coords for you
   if (gen_coordinates) {
-    glEnable(GL_TEXTURE_GEN_S);
-    glEnable(GL_TEXTURE_GEN_T);
-  }
+    enable(GL_TEXTURE_GEN_S);
+    enable(GL_TEXTURE_GEN_T);
 
-  glTexGeni(GL_S, GL_TEXTURE_GEN_MODE,
-            m_envmap ? GL_SPHERE_MAP : GL_OBJECT_LINEAR); // EnvMap
-  glTexGeni(GL_T, GL_TEXTURE_GEN_MODE,
-            m_envmap ? GL_SPHERE_MAP : GL_OBJECT_LINEAR);
+    glTexGeni(GL_S, GL_TEXTURE_GEN_MODE,
+              m_envmap ? GL_SPHERE_MAP : GL_OBJECT_LINEAR); // EnvMap
+    glTexGeni(GL_T, GL_TEXTURE_GEN_MODE,
+              m_envmap ? GL_SPHERE_MAP : GL_OBJECT_LINEAR);
+  }
 
   setColor(WHITE); // avoid other colors to mess up the texture original color
 
@@ -607,14 +944,27 @@ void Env::textureDrawing(TexID texbind, std::function<void()> callback,
   callback();
 
   if (gen_coordinates) {
-    glDisable(GL_TEXTURE_GEN_T);
-    glDisable(GL_TEXTURE_GEN_S);
+    disable(GL_TEXTURE_GEN_T);
+    disable(GL_TEXTURE_GEN_S);
   }
 
   // disable texturing
-  glDisable(GL_TEXTURE_2D);
+  disable(GL_TEXTURE_2D);
 }
 
-void Env::translate(float x, float y, float z) { glTranslatef(x, y, z); }
+// Helper function to draw a mesh level of detail: textured as usual, or
+// flat colored with the color of the level when LOD debugging is on.
+void Env::lodDrawing(TexID texbind, size_t level,
+                     std::function<void()> callback, bool gen_coordinates) {
+  if (!m_lod_debug) {
+    textureDrawing(texbind, callback, gen_coordinates);
+    return;
+  }
+
+  const size_t n_colors = sizeof(LOD_COLORS) / sizeof(LOD_COLORS[0]);
+  setColor(LOD_COLORS[std::min(level, n_colors - 1)]);
+  callback();
+  setColor(WHITE);
+}
 
 } // namespace agl
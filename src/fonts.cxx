@@ -64,7 +64,7 @@ void AGLTextRenderer::loadTextureVector() {
     // generate texture ID
     glGenTextures(1, &texbind);
 
-    glBindTexture(GL_TEXTURE_2D, texbind);
+    m_env.bindTexture(texbind);
     // create Texture
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, surface->w, surface->h, 0, GL_RGBA,
                  GL_UNSIGNED_BYTE, surface->pixels);
@@ -84,6 +84,23 @@ void AGLTextRenderer::loadTextureVector() {
 
 // Reminder: x_o, y_o is the top-left origin
 int AGLTextRenderer::render(int x_o, int y_o, const char *str) {
+  // the state for the text is set once for the whole string, and put back
+  // as it was: on the screen overlay, depth test and lighting are already
+  // off and stay so
+  bool depth = m_env.isEnabled(GL_DEPTH_TEST);
+  bool lighting = m_env.isEnabled(GL_LIGHTING);
+
+  // We want to draw text over our scene, so no need of Depth Testing
+  m_env.disable(GL_DEPTH_TEST);
+  m_env.disable(GL_LIGHTING);
+
+  // Blending
+  m_env.enable(GL_BLEND);
+  m_env.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+  // Texture
+  m_env.enable(GL_TEXTURE_2D);
+
   // for (; *str; ++str)
   for (const char *c = str; (*c) != '\0'; ++c) {
     renderChar(x_o, y_o, *c);
@@ -91,6 +108,12 @@ int AGLTextRenderer::render(int x_o, int y_o, const char *str) {
     x_o += get_glyph_at(*c).get_advance();
   }
 
+  m_env.disable(GL_TEXTURE_2D);
+  m_env.disable(GL_BLEND);
+  // Renable Z-buffer and Lighting
+  m_env.setEnabled(GL_DEPTH_TEST, depth);
+  m_env.setEnabled(GL_LIGHTING, lighting);
+
   // return end of the string
   return x_o;
 }
@@ -126,17 +149,8 @@ void AGLTextRenderer::renderChar(int x_o, int y_o, char letter) {
 
   Glyph glyph = get_glyph_at(letter);
 
-  // We want to draw text over our scene, so no need of Depth Testing
-  glDisable(GL_DEPTH_TEST);
-  glDisable(GL_LIGHTING);
-
-  // Blending
-  glEnable(GL_BLEND);
-  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
-  // Texture
-  glEnable(GL_TEXTURE_2D);
-  glBindTexture(GL_TEXTURE_2D, glyph.get_textureID());
+  // the rest of the state is set by render()
+  m_env.bindTexture(glyph.get_textureID());
 
   // Draw texture with quads
   glBegin(GL_QUADS);
@@ -161,12 +175,6 @@ void AGLTextRenderer::renderChar(int x_o, int y_o, char letter) {
   }
 
   glEnd();
-
-  glDisable(GL_TEXTURE_2D);
-  glDisable(GL_BLEND);
-  // Renable Z-buffer and Lighting
-  glEnable(GL_DEPTH_TEST);
-  glEnable(GL_LIGHTING);
 }
 
 int AGLTextRenderer::get_width(const char *str) {
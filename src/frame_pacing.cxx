@@ -0,0 +1,77 @@
+#include "agl.h"
+
+#include <algorithm>
+#include <chrono>
+
+namespace agl {
+
+/*
+ * Frame Pacing:
+ * -------------
+ * Waiting for the GPU at the end of every frame (glFinish) serializes the
+ * CPU and the GPU: one of them is always idle. Instead, a fence is inserted
+ * after each swap and the CPU only waits for the frame that is
+ * framesInFlight() frames old. With 2 the CPU prepares frame N + 1 while
+ * the GPU finishes frame N, and the latency is still bounded: the CPU can
+ * never run ahead by more than that.
+ *
+ * The time spent waiting is measured: a wait close to the frame time means
+ * the GPU is the bottleneck, a wait close to zero that the CPU is.
+ * Without sync objects every frame is finished, as before.
+ */
+
+namespace {
+
+const size_t MAX_FRAMES_IN_FLIGHT = 3;
+// a single wait, retried while the frame is not done
+const GLuint64 WAIT_TIMEOUT_NS = 100000000; // 100 ms
+// weight of the last frame in the average wait
+const double WAIT_SMOOTHING = 0.1;
+
+} // namespace
+
+void Env::setFramesInFlight(size_t n) {
+  m_frames_in_flight = std::min(std::max<size_t>(n, 1), MAX_FRAMES_IN_FLIGHT);
+}
+
+void Env::paceFrame() {
+  static const auto TAG = __func__;
+
+  auto start = std::chrono::steady_clock::now();
+  if (!GLEW_VERSION_3_2 && !GLEW_ARB_sync) {
+    glFinish();
+  } else {
+    m_frame_fences.push_back(glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0));
+    while (m_frame_fences.size() >= m_frames_in_flight) {
+      // the flush makes sure that the fence reaches the GPU
+      GLenum status = glClientWaitSync(m_frame_fences.front(),
+                                       GL_SYNC_FLUSH_COMMANDS_BIT,
+                                       WAIT_TIMEOUT_NS);
+      if (status == GL_TIMEOUT_EXPIRED) {
+        continue;
+      }
+      if (status == GL_WAIT_FAILED) {
+        lg::e(TAG, "Waiting for a frame failed (0x%x)", glGetError());
+      }
+      glDeleteSync(m_frame_fences.front());
+      m_frame_fences.pop_front();
+    }
+  }
+
+  m_frame_wait_ms = std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+  m_frame_wait_avg_ms +=
+      WAIT_SMOOTHING * (m_frame_wait_ms - m_frame_wait_avg_ms);
+}
+
+void Env::releaseFrameFences() {
+  if (hasGLContext()) {
+    for (auto fence : m_frame_fences) {
+      glDeleteSync(fence);
+    }
+  }
+  m_frame_fences.clear();
+}
+
+} // namespace agl
@@ -1,15 +1,19 @@
 #include "game.h"
+#include "bvh.h"
+
+#include <chrono>
 #include "random"
 
 namespace game {
 
-Game::Game(std::string gameID, size_t num_rings)
+Game::Game(std::string gameID, size_t num_rings, size_t num_cubes)
     : m_gameID(gameID), m_state(State::SPLASH), 
       m_eye_dist(5.0), m_view_alpha(20.0), m_view_beta(40.0), m_victory(false),
+      m_final_stage(false),
       m_flappy3D(false), m_isFlappyOn(false), m_game_started(false), m_restart_game(false),
       m_deadline_time(0.0), m_last_time(.0),
       m_penalty_time(0.0), m_num_rings(num_rings), m_env(agl::get_env()),
-      m_num_cubes(10), m_main_win(nullptr), m_floor(nullptr), m_sky(nullptr),
+      m_num_cubes(num_cubes), m_main_win(nullptr), m_floor(nullptr), m_sky(nullptr),
       m_final_door(nullptr), m_ssh(nullptr) {}
 
 /*
@@ -25,17 +29,17 @@ void Game::init() {
   m_main_win->show();
   m_env.enableVSync();
 
-  m_text_renderer = agl::getTextRenderer("fontes/neuropol.ttf", 30);
-  m_text_big = agl::getTextRenderer("fontes/neuropol.ttf", 72);
+  m_text_renderer = agl::get_assets().font("fontes/neuropol.ttf", 30);
+  m_text_big = agl::get_assets().font("fontes/neuropol.ttf", 72);
 
   m_floor = elements::get_floor("texturas/sea.jpg");
   m_sky = elements::get_sky("texturas/space1.jpg");
   m_ssh = elements::get_spaceship("texturas/tex5.jpg", "objetos/Envos.obj",m_flappy3D);
   
-  m_splash_tex = m_env.loadTexture("texturas/space.jpg");
+  m_splash_tex = agl::get_assets().texture("texturas/space.jpg");
   
 
-  m_menu_tex = m_env.loadTexture("texturas/menu.jpg");
+  m_menu_tex = agl::get_assets().texture("texturas/menu.jpg");
   init_rings();
   init_cubes();
  
@@ -124,11 +128,16 @@ void Game::checkRings() {
     ring_crossed = current_ring.isTriggered();
 
     if (ring_crossed) {
+      // the ring changes color
+      m_ring_instances.set(m_cur_ring_index, current_ring.instance());
       auto bonus = m_flappy3D ? game::FLAPPY_RING_TIME : game::RING_TIME;
       m_deadline_time += bonus;
       m_cur_ring_index++;
       if (m_cur_ring_index >= m_num_rings) {
-          goToVictory();
+        // last ring: the final door shows up, it has to be crossed to win
+        m_final_stage = true;
+        m_final_door = elements::get_door("objetos/door.obj",
+                                          "texturas/BRUSHED.jpg");
       }
     }
 }
@@ -154,7 +163,10 @@ void Game::gameAction() {
   // - if ring is last one: final gate
   // - if crosses final gate: WIN!
 
+  // the ship motion in this step, for the collision against the door
+  agl::Point3 ship_from(m_ssh->x(), m_ssh->y(), m_ssh->z());
   m_ssh->execute();
+  agl::Point3 ship_to(m_ssh->x(), m_ssh->y(), m_ssh->z());
 
   // only if game has started, i.e. a key has been pressed
   if (m_game_started) {
@@ -162,9 +174,16 @@ void Game::gameAction() {
   }
 
   // if we are in final stage, only the final door is taken into account
-  if (m_final_stage) {
+  if (m_final_stage && m_final_door) {
+    agl::Obb ship_box;
     if (m_final_door->checkCrossing(m_ssh->x(), m_ssh->z())) {
       goToVictory();
+    } else if (m_final_door->collides(ship_from, ship_to) ||
+               (m_ssh->boundingBox(ship_box) &&
+                m_final_door->collides(ship_box))) {
+      // hit the frame instead of going through the door
+      lg::i(__func__, "Penalty!");
+      m_penalty_time = 6000U;
     }
   }
 
@@ -186,6 +205,11 @@ void Game::init_rings() {
     auto coords = coordinateGenerator::randomCoord3D();
     m_rings.emplace_back(coords.x, coords.y, coords.z, m_flappy3D);
   }
+
+  m_ring_instances.clear();
+  for (const auto &ring : m_rings) {
+    m_ring_instances.add(ring.instance());
+  }
 }
 
 void Game::init_cubes() {
@@ -195,6 +219,11 @@ void Game::init_cubes() {
     auto coords = coordinateGenerator::randomCoord3D();
     m_cubes.emplace_back(coords.x, coords.y, coords.z, m_flappy3D);
   }
+
+  m_cube_instances.clear();
+  for (const auto &cube : m_cubes) {
+    m_cube_instances.add(cube.instance());
+  }
 }
 
 
@@ -224,6 +253,28 @@ void Game::gameOnKey(Key key, bool pressed) {
     mt = spaceship::Motion::STEER_R;
     trig_motion = true;
     break;
+
+  case Key::F5:
+    // debug: color the meshes according to their level of detail
+    if (pressed) {
+      m_env.toggle_lod_debug();
+    }
+    break;
+
+  case Key::F6:
+    // debug: frustum culling on/off, to compare
+    if (pressed) {
+      m_env.setCulling(!m_env.isCulling());
+    }
+    break;
+
+  case Key::F7:
+    // shadow of the ship on/off
+    if (pressed) {
+      m_env.toggle_shadow();
+    }
+    break;
+
   default:
     break;
   }
@@ -259,40 +310,34 @@ void Game::gameRender() {
   // update camera
   setupShipCamera();
 
-  // Render all elements
-  m_floor->render();
-  m_sky->render();
+  // Render all elements: they are queued, sorted and drawn by flushQueue
+  m_env.beginQueue();
+  m_floor->submit();
+  m_sky->submit();
 
   // ---FLICKERING PENALTY---
   // if the spaceship hits a cube it will be rendered in a flickered way
   // switching from gouraud to wireframe rendering every 200ms
-  if (m_penalty_time && ((m_penalty_time / 200) % 2 == 1)) {
-    m_ssh->render(true);
-  } else {
-    m_ssh->render();
-  }
+  m_ssh->submit(m_penalty_time && ((m_penalty_time / 200) % 2 == 1));
 
-  // rings: render till the first ring that's not triggered yet
-  for (size_t i = 0; i < m_num_rings; ++i) {
-    auto &ring = m_rings.at(i);
-    ring.render();
-
-    if (!ring.isTriggered()) {
-      break;
-    }
-  }
+  // rings: render till the first ring that's not triggered yet (they are
+  // crossed in order)
+  elements::Ring::submit(m_ring_instances, m_cur_ring_index + 1);
 
   // render all BadCubes. They'll be an obstacle from the beginning
-  for (auto &cube : m_cubes) {
-    cube.render();
+  elements::BadCube::submit(m_cube_instances, m_cubes.size());
+  // the final door, once spawned
+  if (m_final_door) {
+    m_final_door->submit();
   }
   // apply shadow
   if (m_env.isShadow()) {
-    m_ssh->shadow();
+    m_ssh->submitShadow();
   }
+  m_env.flushQueue();
 
   // HeadUp Display
-  drawHUD();
+  m_env.timedScope("hud", [this] { drawHUD(); });
 
   m_env.enableLighting();
 
@@ -323,10 +368,13 @@ void Game::restartGame() {
   static const auto TAG = __func__;
 
   lg::i(TAG, "Starting NEW game...");
+  auto start = std::chrono::steady_clock::now();
   // game vars
   m_restart_game = m_game_started = false;
   m_player_time = m_deadline_time = 0.0;
   m_penalty_time = m_last_time = 0;
+  m_final_stage = false;
+  m_final_door.reset();
 
   m_env.reset();
 
@@ -339,7 +387,17 @@ void Game::restartGame() {
 
   init_rings();
   init_cubes();
-  
+
+  // texture and mesh of the ship are still resident: nothing is reloaded
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  auto &assets = agl::get_assets();
+  lg::i(TAG, "Game reset in %.3f ms (assets: %zu hits, %zu misses, %zu "
+        "resident)",
+        elapsed.count(), assets.hits(), assets.misses(), assets.resident());
+  lg::i(TAG, "Primitives: %zu cached, %.2f%% hit rate",
+        m_env.primitiveCacheSize(), 100.0 * m_env.primitiveHitRate());
+
   playGame();
 }
 
@@ -348,9 +406,18 @@ void Game::restartGame() {
  * 1. Init; 2. Splash screen; 3. Main event loop
  */
 void Game::run() {
+  static const auto TAG = __func__;
+  auto start = m_env.getTicks();
+
   init();
 
   splash();
+  // meshes keep loading in background, the splash must not wait for them
+  lg::i(TAG, "Splash screen shown in %u ms", m_env.getTicks() - start);
+  if (agl::getHeadless()) {
+    // nobody to press Enter: straight to the game and gameRender
+    changeState(State::GAME);
+  }
 
   m_env.renderLoop();
 }
@@ -38,23 +38,26 @@ private:
   // environment
   agl::Env &m_env;
   std::unique_ptr<agl::SmartWindow> m_main_win;
-  std::unique_ptr<agl::AGLTextRenderer> m_text_renderer;
-  std::unique_ptr<agl::AGLTextRenderer> m_text_big;
+  std::shared_ptr<agl::AGLTextRenderer> m_text_renderer;
+  std::shared_ptr<agl::AGLTextRenderer> m_text_big;
 
   // various elements
   std::unique_ptr<elements::Spaceship> m_ssh;
   elements::Floor *m_floor;
   elements::Sky *m_sky;
-  agl::TexID m_splash_tex, m_menu_tex, m_win_tex, m_lost_tex;
+  agl::TexRef m_splash_tex, m_menu_tex;
+  agl::TexID m_win_tex, m_lost_tex;
   std::vector<Setting> m_settings;
 
   // Ring stuff
   std::vector<elements::Ring> m_rings;
+  agl::InstanceBuffer m_ring_instances; // drawn all at once
   size_t m_num_rings;
   size_t m_cur_ring_index;
 
   // Cube stuff
   std::vector<elements::BadCube> m_cubes;
+  agl::InstanceBuffer m_cube_instances{false}; // same color for all
   size_t m_num_cubes;
 
   // Final Door
@@ -110,7 +113,8 @@ private:
 public:
   std::string m_gameID;
 
-  Game(std::string gameID, size_t num_rings); // constructor
+  // constructor
+  Game(std::string gameID, size_t num_rings, size_t num_cubes = 10);
   void run();
 };
 
@@ -0,0 +1,98 @@
+#include "agl.h"
+
+namespace agl {
+
+/*
+ * GL state cache:
+ * ---------------
+ * Env keeps a copy of the capabilities, the bound texture and program and
+ * the blend function it has set, so that setting them again to the same value costs
+ * a lookup instead of a call into the driver. All the state changes of the
+ * game go through these functions, a direct gl call would leave the copy
+ * out of date (invalidateState() forgets it).
+ */
+
+void Env::setEnabled(GLenum cap, bool enabled) {
+  auto it = m_caps.find(cap);
+  if (m_state_cache && it != m_caps.end() && it->second == enabled) {
+    ++m_state_filtered;
+    return;
+  }
+
+  enabled ? glEnable(cap) : glDisable(cap);
+  m_caps[cap] = enabled;
+  ++m_state_issued;
+}
+
+bool Env::isEnabled(GLenum cap) {
+  auto it = m_caps.find(cap);
+  if (it == m_caps.end()) {
+    it = m_caps.emplace(cap, glIsEnabled(cap) == GL_TRUE).first;
+  }
+  return it->second;
+}
+
+void Env::bindTexture(TexID texbind) {
+  if (m_state_cache && m_texture_known && m_texture == texbind) {
+    ++m_state_filtered;
+    return;
+  }
+
+  glBindTexture(GL_TEXTURE_2D, texbind);
+  m_texture = texbind;
+  m_texture_known = true;
+  ++m_state_issued;
+}
+
+void Env::deleteTexture(TexID texbind) {
+  glDeleteTextures(1, &texbind);
+  // GL goes back to texture 0, and the name can be given out again
+  if (m_texture_known && m_texture == texbind) {
+    m_texture = 0;
+  }
+}
+
+void Env::blendFunc(GLenum src, GLenum dst) {
+  if (m_state_cache && m_blend_known && m_blend_src == src &&
+      m_blend_dst == dst) {
+    ++m_state_filtered;
+    return;
+  }
+
+  glBlendFunc(src, dst);
+  m_blend_src = src;
+  m_blend_dst = dst;
+  m_blend_known = true;
+  ++m_state_issued;
+}
+
+void Env::useProgram(GLuint program) {
+  if (m_state_cache && m_program_known && m_program == program) {
+    ++m_state_filtered;
+    return;
+  }
+
+  glUseProgram(program);
+  m_program = program;
+  m_program_known = true;
+  ++m_state_issued;
+}
+
+void Env::invalidateState() {
+  m_caps.clear();
+  m_texture_known = m_blend_known = m_program_known = false;
+}
+
+void Env::setStateCache(bool enabled) {
+  m_state_cache = enabled;
+  invalidateState();
+}
+
+// per frame counters: the last complete frame is kept
+void Env::newStateFrame() {
+  m_last_issued = m_state_issued;
+  m_last_filtered = m_state_filtered;
+  m_state_issued = m_state_filtered = 0;
+}
+
+} // namespace agl
@@ -0,0 +1,187 @@
+#include "agl.h"
+
+#include <algorithm>
+#include <chrono>
+
+namespace agl {
+
+/*
+ * GPU Timers:
+ * -----------
+ * timedScope("floor", ...) measures the GPU time of the draws in the
+ * callback with a GL_TIME_ELAPSED query. The results are read back
+ * TIMER_LATENCY frames later, from a ring of per frame query lists, when the
+ * GPU is long done with them: reading never stalls the pipeline (a result
+ * still missing by then is dropped). Queries are recycled through a pool.
+ *
+ * Each scope keeps the time per frame of its last TIMER_SAMPLES frames, for
+ * the averages and percentiles of timerStats(). They are logged every
+ * TIMER_LOG_INTERVAL seconds and shown in the debug HUD.
+ * Without timer queries the scopes measure the CPU time of the callback
+ * instead, which is what the driver spends queueing the draws.
+ */
+
+namespace {
+
+const size_t TIMER_SAMPLES = 120;     // frames in the statistics
+const double TIMER_LOG_INTERVAL = 5.0; // seconds
+
+double now() {
+  return std::chrono::duration<double>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void record(FrameTimer &timer, double ms) {
+  if (timer.samples.size() < TIMER_SAMPLES) {
+    timer.samples.push_back(ms);
+  } else {
+    timer.samples[timer.next] = ms;
+  }
+  timer.next = (timer.next + 1) % TIMER_SAMPLES;
+}
+
+} // namespace
+
+FrameTimer &Env::frameTimer(const char *name) {
+  for (auto &timer : m_timers) {
+    if (timer.name == name) {
+      return timer;
+    }
+  }
+  m_timers.push_back(FrameTimer());
+  m_timers.back().name = name;
+  return m_timers.back();
+}
+
+void Env::timedScope(const char *name, std::function<void()> callback) {
+  static const auto TAG = __func__;
+
+  // queries of the same kind can't nest: the inner scope is counted in the
+  // outer one
+  if (m_timer_active) {
+    callback();
+    return;
+  }
+  if (!m_timing_known) {
+    m_gpu_timing = GLEW_VERSION_3_3 || GLEW_ARB_timer_query;
+    m_timing_known = true;
+    lg::i(TAG, "Frame timers on the %s", m_gpu_timing ? "GPU" : "CPU");
+  }
+
+  size_t index = &frameTimer(name) - m_timers.data();
+  m_timer_active = true;
+  if (m_gpu_timing) {
+    GLuint query;
+    if (m_free_queries.empty()) {
+      glGenQueries(1, &query);
+    } else {
+      query = m_free_queries.back();
+      m_free_queries.pop_back();
+    }
+    glBeginQuery(GL_TIME_ELAPSED, query);
+    callback();
+    glEndQuery(GL_TIME_ELAPSED);
+    m_timer_queries[m_timer_frame].push_back({index, query});
+  } else {
+    double start = now();
+    callback();
+    m_timers[index].frame_ms += (now() - start) * 1000.0;
+    m_timers[index].used = true;
+  }
+  m_timer_active = false;
+}
+
+void Env::newTimerFrame() {
+  static const auto TAG = __func__;
+
+  // on the GPU: the oldest frame of the ring, whose queries are done by
+  // now. On the CPU: the frame that just ended
+  m_timer_frame = (m_timer_frame + 1) % TIMER_LATENCY;
+  auto &queries = m_timer_queries[m_timer_frame];
+  for (const auto &entry : queries) {
+    GLint available;
+    glGetQueryObjectiv(entry.second, GL_QUERY_RESULT_AVAILABLE, &available);
+    if (available) {
+      GLuint64 ns;
+      glGetQueryObjectui64v(entry.second, GL_QUERY_RESULT, &ns);
+      m_timers[entry.first].frame_ms += ns / 1e6;
+      m_timers[entry.first].used = true;
+    }
+    m_free_queries.push_back(entry.second);
+  }
+  queries.clear();
+  for (auto &timer : m_timers) {
+    if (timer.used) {
+      record(timer, timer.frame_ms);
+    }
+    timer.frame_ms = 0.0;
+    timer.used = false;
+  }
+
+  double t = now();
+  if (m_last_timer_log == 0.0) {
+    m_last_timer_log = t;
+  } else if (t - m_last_timer_log >= TIMER_LOG_INTERVAL) {
+    m_last_timer_log = t;
+    logTimers(TAG);
+  }
+}
+
+void Env::logTimers(const char *tag) const {
+  for (const auto &timer : m_timers) {
+    TimerStats stats = timerStats(timer.name);
+    lg::i(tag, "%-8s %6.2f ms avg, %6.2f p50, %6.2f p95, %6.2f max (%s)",
+          timer.name.c_str(), stats.average_ms, stats.p50_ms, stats.p95_ms,
+          stats.max_ms, m_gpu_timing ? "gpu" : "cpu");
+  }
+}
+
+TimerStats Env::timerStats(const std::string &name) const {
+  TimerStats stats;
+  auto it = std::find_if(m_timers.begin(), m_timers.end(),
+                         [&](const FrameTimer &t) { return t.name == name; });
+  if (it == m_timers.end() || it->samples.empty()) {
+    return stats;
+  }
+
+  std::vector<float> sorted(it->samples);
+  std::sort(sorted.begin(), sorted.end());
+  stats.samples = sorted.size();
+  for (float ms : sorted) {
+    stats.average_ms += ms;
+  }
+  stats.average_ms /= sorted.size();
+  stats.p50_ms = sorted[(sorted.size() - 1) / 2];
+  stats.p95_ms = sorted[(sorted.size() - 1) * 95 / 100];
+  stats.max_ms = sorted.back();
+  return stats;
+}
+
+std::vector<std::string> Env::timerNames() const {
+  std::vector<std::string> names;
+  for (const auto &timer : m_timers) {
+    names.push_back(timer.name);
+  }
+  return names;
+}
+
+void Env::releaseTimers() {
+  if (hasGLContext()) {
+    for (auto &queries : m_timer_queries) {
+      for (const auto &entry : queries) {
+        glDeleteQueries(1, &entry.second);
+      }
+    }
+    if (!m_free_queries.empty()) {
+      glDeleteQueries(m_free_queries.size(), m_free_queries.data());
+    }
+  }
+  for (auto &queries : m_timer_queries) {
+    queries.clear();
+  }
+  m_free_queries.clear();
+  m_timing_known = false;
+}
+
+} // namespace agl
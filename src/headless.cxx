@@ -0,0 +1,224 @@
+#include "agl.h"
+
+// EGL without the X11 types of eglplatform.h
+#define EGL_NO_X11
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace agl {
+
+/*
+ * Headless:
+ * ---------
+ * With setHeadless(true) a SmartWindow opens no window and needs no display:
+ * the GL context comes from EGL, on Mesa's surfaceless platform when it is
+ * there (llvmpipe renders on any box), otherwise on the default display with
+ * a 1x1 pbuffer just to make it current. Either way the frames are drawn in
+ * a framebuffer object of the window size, so the game and the benchmarks
+ * run unchanged in automated jobs.
+ *
+ * refresh() flushes the frame instead of swapping it and, with setFrameDump,
+ * writes it to disk as a PPM image. SDL still runs, with the dummy video
+ * driver, for the events, the timers and the fonts.
+ */
+
+namespace {
+
+bool s_headless = false;
+std::string s_dump_dir;
+size_t s_dump_every = 0;
+
+bool hasExtension(const char *extensions, const char *name) {
+  return extensions && std::strstr(extensions, name);
+}
+
+} // namespace
+
+void setHeadless(bool enabled) {
+  s_headless = enabled;
+  if (enabled) {
+    // read by SDL_Init (in the Env constructor)
+    SDL_SetHint(SDL_HINT_VIDEODRIVER, "dummy");
+  }
+}
+
+bool getHeadless() { return s_headless; }
+
+void setFrameDump(const std::string &dir, size_t every) {
+  s_dump_dir = dir;
+  s_dump_every = every;
+}
+
+bool hasGLContext() {
+  return SDL_GL_GetCurrentContext() ||
+         (s_headless && eglGetCurrentContext() != EGL_NO_CONTEXT);
+}
+
+void SmartWindow::createHeadlessContext() {
+  static const auto TAG = __func__;
+
+  EGLDisplay display = EGL_NO_DISPLAY;
+  auto getPlatformDisplay = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(
+      eglGetProcAddress("eglGetPlatformDisplayEXT"));
+  if (getPlatformDisplay &&
+      hasExtension(eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS),
+                   "EGL_MESA_platform_surfaceless")) {
+    display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+                                 EGL_DEFAULT_DISPLAY, nullptr);
+  }
+  if (display == EGL_NO_DISPLAY) {
+    display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  }
+  EGLint major, minor;
+  if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor)) {
+    lg::e(TAG, "EGL error: no display (0x%x)", eglGetError());
+    exit(EXIT_FAILURE);
+  }
+  m_egl_display = display;
+
+  // the legacy GL of the fixed-function pipeline, not GLES
+  if (!eglBindAPI(EGL_OPENGL_API)) {
+    lg::e(TAG, "EGL error: no OpenGL API (0x%x)", eglGetError());
+    exit(EXIT_FAILURE);
+  }
+
+  // the frames go to the framebuffer object: a context without a surface
+  // is enough, or one with a tiny pbuffer
+  const char *extensions = eglQueryString(display, EGL_EXTENSIONS);
+  bool surfaceless = hasExtension(extensions, "EGL_KHR_surfaceless_context");
+  const EGLint config_attribs[] = {EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+                                   EGL_SURFACE_TYPE,
+                                   surfaceless ? 0 : EGL_PBUFFER_BIT,
+                                   EGL_NONE};
+  EGLConfig config;
+  EGLint n_configs = 0;
+  eglChooseConfig(display, config_attribs, &config, 1, &n_configs);
+  if (n_configs == 0) {
+    if (!surfaceless ||
+        !hasExtension(extensions, "EGL_KHR_no_config_context")) {
+      lg::e(TAG, "EGL error: no OpenGL config (0x%x)", eglGetError());
+      exit(EXIT_FAILURE);
+    }
+    config = EGL_NO_CONFIG_KHR;
+  }
+
+  EGLContext context =
+      eglCreateContext(display, config, EGL_NO_CONTEXT, nullptr);
+  if (context == EGL_NO_CONTEXT) {
+    lg::e(TAG, "EGL error: cannot create context (0x%x)", eglGetError());
+    exit(EXIT_FAILURE);
+  }
+  m_egl_context = context;
+
+  EGLSurface surface = EGL_NO_SURFACE;
+  if (!surfaceless) {
+    const EGLint pbuffer_attribs[] = {EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE};
+    surface = eglCreatePbufferSurface(display, config, pbuffer_attribs);
+    if (surface == EGL_NO_SURFACE) {
+      lg::e(TAG, "EGL error: cannot create pbuffer (0x%x)", eglGetError());
+      exit(EXIT_FAILURE);
+    }
+  }
+  m_egl_surface = surface;
+
+  if (!eglMakeCurrent(display, surface, surface, context)) {
+    lg::e(TAG, "EGL error: cannot make context current (0x%x)",
+          eglGetError());
+    exit(EXIT_FAILURE);
+  }
+
+  lg::i(TAG, "EGL %d.%d %s context, no window", major, minor,
+        surfaceless ? "surfaceless" : "pbuffer");
+}
+
+// needs the GL entry points: after glewInit
+void SmartWindow::createHeadlessFramebuffer() {
+  static const auto TAG = __func__;
+
+  if (!GLEW_VERSION_3_0 && !GLEW_ARB_framebuffer_object) {
+    lg::e(TAG, "Framebuffer objects not supported, cannot run headless");
+    exit(EXIT_FAILURE);
+  }
+
+  glGenRenderbuffers(2, m_fbo_buffers);
+  glBindRenderbuffer(GL_RENDERBUFFER, m_fbo_buffers[0]);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, m_width, m_height);
+  glBindRenderbuffer(GL_RENDERBUFFER, m_fbo_buffers[1]);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, m_width,
+                        m_height);
+  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+  // bound for good: it is the default framebuffer of this window
+  glGenFramebuffers(1, &m_fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                            GL_RENDERBUFFER, m_fbo_buffers[0]);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                            GL_RENDERBUFFER, m_fbo_buffers[1]);
+  GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+  if (status != GL_FRAMEBUFFER_COMPLETE) {
+    lg::e(TAG, "Headless framebuffer incomplete (0x%x)", status);
+    exit(EXIT_FAILURE);
+  }
+
+  glViewport(0, 0, m_width, m_height);
+  lg::i(TAG, "Rendering offscreen, %zux%zu, on %s", m_width, m_height,
+        glGetString(GL_RENDERER));
+}
+
+void SmartWindow::releaseHeadlessContext() {
+  if (m_fbo) {
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &m_fbo);
+    glDeleteRenderbuffers(2, m_fbo_buffers);
+  }
+  eglMakeCurrent(m_egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                 EGL_NO_CONTEXT);
+  if (m_egl_surface != EGL_NO_SURFACE) {
+    eglDestroySurface(m_egl_display, m_egl_surface);
+  }
+  eglDestroyContext(m_egl_display, m_egl_context);
+  eglTerminate(m_egl_display);
+  m_fbo = 0;
+  m_egl_context = m_egl_surface = nullptr;
+}
+
+// the frame just drawn, in dir/frame_NNNNN.ppm if it is one to dump
+void SmartWindow::dumpFrame() {
+  static const auto TAG = __func__;
+
+  size_t frame = m_frame++;
+  if (s_dump_every == 0 || frame % s_dump_every != 0) {
+    return;
+  }
+
+  std::vector<GLubyte> pixels(m_width * m_height * 3);
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glReadPixels(0, 0, m_width, m_height, GL_RGB, GL_UNSIGNED_BYTE,
+               pixels.data());
+
+  char filename[32];
+  std::snprintf(filename, sizeof(filename), "/frame_%05zu.ppm", frame);
+  std::string path = s_dump_dir + filename;
+  FILE *file = std::fopen(path.c_str(), "wb");
+  if (!file) {
+    lg::e(TAG, "Cannot write frame %s", path.c_str());
+    return;
+  }
+  std::fprintf(file, "P6\n%zu %zu\n255\n", m_width, m_height);
+  // GL rows go bottom up
+  size_t row_size = m_width * 3;
+  bool ok = true;
+  for (size_t row = m_height; row-- > 0 && ok;) {
+    ok = std::fwrite(&pixels[row * row_size], 1, row_size, file) == row_size;
+  }
+  if (std::fclose(file) != 0 || !ok) {
+    lg::e(TAG, "Cannot write frame %s", path.c_str());
+  }
+}
+
+} // namespace agl
@@ -1,6 +1,8 @@
 #include <cmath>
+#include <cstdlib>
 
 #include "agl.h"
+#include "bench.h"
 #include "elements.h"
 #include "game.h"
 #include "types.h"
@@ -12,15 +14,77 @@
 
 int main(int argc, char **argv) {
 
-  if (argc != 2) {
-    lg::e(__func__, "Usage: ./game <player_name>");
+  // --headless, anywhere (also with --bench): no window nor display. Taken
+  // out of the arguments before anything starts SDL
+  int n_args = 0;
+  for (int i = 0; i < argc; ++i) {
+    if (std::string(argv[i]) == "--headless") {
+      agl::setHeadless(true);
+    } else {
+      argv[n_args++] = argv[i];
+    }
+  }
+  argc = n_args;
+
+  // ./game --bench <name> [args...] runs a benchmark instead of the game
+  if (argc >= 2 && std::string(argv[1]) == "--bench") {
+    return bench::run(argc - 2, argv + 2);
+  }
+
+  // options follow the player name
+  bool usage_error = argc < 2;
+  size_t num_cubes = 10;
+  std::string dump_dir;
+  size_t dump_every = 1;
+  for (int i = 2; i < argc; ++i) {
+    std::string option(argv[i]);
+    if (option == "--quantize") {
+      agl::setMeshQuantization(true);
+    } else if (option == "--immediate") {
+      agl::setMeshBuffers(false);
+    } else if (option == "--fixed-function") {
+      // the old pipeline, for comparison (see shaders.cxx)
+      agl::get_env().setPipeline(agl::Pipeline::FIXED_FUNCTION);
+    } else if (option == "--blob-shadow") {
+      // cheap shadow of the ship, without the shadow map (F7 shows it)
+      agl::get_env().setShadowQuality(agl::ShadowQuality::BLOB);
+    } else if (option == "--shadow-map-size" && i + 1 < argc) {
+      agl::get_env().setShadowMapSize(std::strtoul(argv[++i], nullptr, 10));
+    } else if (option == "--frames-in-flight" && i + 1 < argc) {
+      // 1 to 3, see frame_pacing.cxx
+      agl::get_env().setFramesInFlight(std::strtoul(argv[++i], nullptr, 10));
+    } else if (option == "--frames" && i + 1 < argc) {
+      // quits after N frames, for automated runs (see also --headless)
+      agl::get_env().setFrameLimit(std::strtoul(argv[++i], nullptr, 10));
+    } else if (option == "--dump-frames" && i + 1 < argc) {
+      // headless frames, as dir/frame_NNNNN.ppm
+      dump_dir = argv[++i];
+    } else if (option == "--dump-every" && i + 1 < argc) {
+      dump_every = std::strtoul(argv[++i], nullptr, 10);
+    } else if (option == "--obstacles" && i + 1 < argc) {
+      // stress scene: many more bad cubes (see also --bench cull-stress)
+      num_cubes = std::strtoul(argv[++i], nullptr, 10);
+    } else {
+      usage_error = true;
+    }
+  }
+
+  if (usage_error) {
+    lg::e(__func__, "Usage: ./game <player_name> [--quantize] [--immediate] "
+                    "[--fixed-function] [--blob-shadow] "
+                    "[--shadow-map-size N] [--frames-in-flight N] "
+                    "[--obstacles N] [--headless] [--frames N] "
+                    "[--dump-frames DIR] [--dump-every N]");
     return EXIT_FAILURE;
   }
+  if (!dump_dir.empty()) {
+    agl::setFrameDump(dump_dir, dump_every);
+  }
   lg::set_level(lg::Level::INFO);
 
   std::string name(argv[1]);
   size_t num_rings = 4;
-  game::Game game(name, num_rings);
+  game::Game game(name, num_rings, num_cubes);
   game.run();
 
   return EXIT_SUCCESS;
@@ -0,0 +1,180 @@
+#include "agl.h"
+
+#include <cmath>
+
+namespace agl {
+
+/*
+ * Matrices:
+ * ---------
+ * Env keeps the model view and projection stacks itself: the shaders, the
+ * render queue and the level of detail read the matrices from here instead
+ * of asking the driver with glGetFloatv. The functions follow the GL ones
+ * (glMatrixMode, glRotatef, gluLookAt...), and each change is also loaded
+ * into the GL matrix of the same mode for what still draws with the fixed
+ * function pipeline (HUD, immediate mode, the instancing shader). All the
+ * transformations of the game go through these functions: a direct
+ * glTranslatef would not be seen by the shaders.
+ */
+
+namespace {
+
+// a * b, column major: out[4 * col + row]
+Matrix4 multiply(const Matrix4 &a, const Matrix4 &b) {
+  Matrix4 out;
+  for (size_t col = 0; col < 4; ++col) {
+    for (size_t row = 0; row < 4; ++row) {
+      GLfloat sum = 0.0f;
+      for (size_t k = 0; k < 4; ++k) {
+        sum += a[4 * k + row] * b[4 * col + k];
+      }
+      out[4 * col + row] = sum;
+    }
+  }
+  return out;
+}
+
+} // namespace
+
+Matrix4 identityMatrix() {
+  Matrix4 m{};
+  m[0] = m[5] = m[10] = m[15] = 1.0f;
+  return m;
+}
+
+std::vector<Matrix4> &Env::matrixStack() {
+  return m_matrix_mode == GL_PROJECTION ? m_projection : m_modelview;
+}
+
+void Env::loadMatrix() { glLoadMatrixf(matrixStack().back().data()); }
+
+void Env::multMatrix(const Matrix4 &m) {
+  Matrix4 &top = matrixStack().back();
+  top = multiply(top, m);
+  loadMatrix();
+}
+
+// GL_MODELVIEW or GL_PROJECTION
+void Env::matrixMode(GLenum mode) {
+  m_matrix_mode = mode;
+  glMatrixMode(mode);
+}
+
+void Env::loadIdentity() {
+  matrixStack().back() = identityMatrix();
+  loadMatrix();
+}
+
+void Env::pushMatrix() {
+  std::vector<Matrix4> &stack = matrixStack();
+  Matrix4 top = stack.back();
+  stack.push_back(top);
+}
+
+void Env::popMatrix() {
+  static const auto TAG = __func__;
+
+  std::vector<Matrix4> &stack = matrixStack();
+  if (stack.size() == 1) {
+    lg::e(TAG, "Matrix stack underflow");
+    return;
+  }
+  stack.pop_back();
+  loadMatrix();
+}
+
+void Env::translate(float x, float y, float z) {
+  Matrix4 m = identityMatrix();
+  m[12] = x;
+  m[13] = y;
+  m[14] = z;
+  multMatrix(m);
+}
+
+// angle in degrees, around axis (as glRotatef)
+void Env::rotate(float angle, const Vec3 &axis) {
+  double len =
+      std::sqrt(axis.x * axis.x + axis.y * axis.y + axis.z * axis.z);
+  if (len == 0.0) {
+    return;
+  }
+  double x = axis.x / len, y = axis.y / len, z = axis.z / len;
+  double rad = angle * M_PI / 180.0;
+  double c = std::cos(rad), s = std::sin(rad), t = 1.0 - c;
+
+  Matrix4 m = identityMatrix();
+  m[0] = t * x * x + c;
+  m[1] = t * x * y + s * z;
+  m[2] = t * x * z - s * y;
+  m[4] = t * x * y - s * z;
+  m[5] = t * y * y + c;
+  m[6] = t * y * z + s * x;
+  m[8] = t * x * z + s * y;
+  m[9] = t * y * z - s * x;
+  m[10] = t * z * z + c;
+  multMatrix(m);
+}
+
+void Env::scale(float x, float y, float z) {
+  Matrix4 m = identityMatrix();
+  m[0] = x;
+  m[5] = y;
+  m[10] = z;
+  multMatrix(m);
+}
+
+// as gluPerspective, fovy in degrees
+void Env::perspective(double fovy, double aspect, double z_near,
+                      double z_far) {
+  double f = 1.0 / std::tan(fovy * M_PI / 360.0);
+  Matrix4 m{};
+  m[0] = f / aspect;
+  m[5] = f;
+  m[10] = (z_far + z_near) / (z_near - z_far);
+  m[11] = -1.0f;
+  m[14] = 2.0 * z_far * z_near / (z_near - z_far);
+  multMatrix(m);
+}
+
+void Env::ortho(double left, double right, double bottom, double top,
+                double z_near, double z_far) {
+  Matrix4 m = identityMatrix();
+  m[0] = 2.0 / (right - left);
+  m[5] = 2.0 / (top - bottom);
+  m[10] = -2.0 / (z_far - z_near);
+  m[12] = -(right + left) / (right - left);
+  m[13] = -(top + bottom) / (top - bottom);
+  m[14] = -(z_far + z_near) / (z_far - z_near);
+  multMatrix(m);
+}
+
+// as gluLookAt
+void Env::setCamera(double eye_x, double eye_y, double eye_z, double aim_x,
+                    double aim_y, double aim_z, double upX, double upY,
+                    double upZ) {
+  Point3 f = Point3(aim_x - eye_x, aim_y - eye_y, aim_z - eye_z).normalize();
+  Point3 up = Point3(upX, upY, upZ).normalize();
+  // side = f x up, then the up of the camera = side x f
+  Point3 s = Point3(f.y * up.z - f.z * up.y, f.z * up.x - f.x * up.z,
+                    f.x * up.y - f.y * up.x)
+                 .normalize();
+  Point3 u(s.y * f.z - s.z * f.y, s.z * f.x - s.x * f.z,
+           s.x * f.y - s.y * f.x);
+
+  Matrix4 m = identityMatrix();
+  m[0] = s.x;
+  m[4] = s.y;
+  m[8] = s.z;
+  m[1] = u.x;
+  m[5] = u.y;
+  m[9] = u.z;
+  m[2] = -f.x;
+  m[6] = -f.y;
+  m[10] = -f.z;
+  m[12] = -(s.x * eye_x + s.y * eye_y + s.z * eye_z);
+  m[13] = -(u.x * eye_x + u.y * eye_y + u.z * eye_z);
+  m[14] = f.x * eye_x + f.y * eye_y + f.z * eye_z;
+  multMatrix(m);
+}
+
+} // namespace agl
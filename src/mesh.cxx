@@ -1,79 +1,325 @@
 #include "agl.h"
+#include "bvh.h"
+#include "mesh_io.h"
+#include "mesh_kernels.h"
+#include "mesh_opt.h"
+#include "mesh_quant.h"
 
 #include <algorithm>
-#include <fstream>
-#include <sstream>
+#include <chrono>
+#include <cmath>
 #include <string>
 
-#include <cstdio>
+#include <cstdint>
 #include <cstring>
+#include <future>
+#include <unordered_map>
+#include <unordered_set>
 
 /*
  * Class implementing a Mesh. See agl.h
  */
 
 namespace agl {
-// Face constructor, compute the normal of the face too
-Face::Face(Vertex *v1, Vertex *v2, Vertex *v3) : verts{v1, v2, v3} {
-  computeNormal();
+
+Mesh::Mesh() : m_authored_normals(false), m_quantized(false) {}
+
+Mesh::~Mesh() {
+  deleteBuffers(m_gpu);
+  deleteBuffers(m_gpu_flat);
 }
 
-Mesh::Mesh() {}
+// normale per faccia, una per ogni tripla di indici
+void Mesh::computeFaceNormals() {
+  m_face_normals.resize(m_indices.size() / 3);
+  kernels::faceNormals(m_pos, m_indices.data(), m_face_normals.size(),
+                       m_face_normals);
+}
 
 // Computo normali per vertice
 // (come media rinormalizzata delle normali delle facce adjacenti)
 void Mesh::computeNormalsPerVertex() {
   // uso solo le strutture di navigazione FV (da Faccia a Vertice)!
+  m_norm.resize(m_pos.size());
 
-  // fase uno: ciclo sui vertici, azzero tutte le normali
-  for (auto &vertex : m_verts) {
-    vertex.normal = Normal3();
+  // fase uno e due: azzero tutte le normali, poi ciclo sulle facce
+  // accumulando le normali di F nei 3 V corrispondenti
+  kernels::accumulateNormals(m_face_normals, m_indices.data(), numFaces(),
+                             m_norm);
+
+  // fase tre: ciclo sui vertici e rinormalizzo:
+  // la normale media rinormalizzata e' uguale alla somma delle normnali,
+  // calcolata nel ciclo precedente, ma rinormalizzata
+  kernels::normalize(m_norm);
+}
+
+// Lista degli edge senza ripetizioni: ogni edge condiviso da due facce
+// compare una volta sola (chiave: coppia di indici ordinata)
+void Mesh::computeEdges() {
+  std::unordered_set<uint64_t> seen;
+  seen.reserve(m_indices.size());
+  m_edges.clear();
+  m_edges.reserve(m_indices.size() / 2);
+
+  for (size_t f = 0; f < numFaces(); ++f) {
+    for (size_t k = 0; k < 3; ++k) {
+      uint32_t a = m_indices[3 * f + k];
+      uint32_t b = m_indices[3 * f + (k + 1) % 3];
+      if (a == b) {
+        continue;
+      }
+      uint64_t key = a < b ? (uint64_t(a) << 32) | b : (uint64_t(b) << 32) | a;
+      if (seen.insert(key).second) {
+        m_edges.push_back(Edge{{a, b}});
+      }
+    }
   }
+}
 
-  // fase due: ciclo sulle facce: accumulo le normali di F nei 3 V
-  // corrispondenti
-  for (auto &face : m_faces) {
-    for (auto vertex : face.verts) {
-      vertex->normal += face.normal;
+// Vertex welding: OBJ exporters often duplicate the same position (e.g. on
+// texture seams). Vertices sharing the exact same position are merged, so
+// that normals get smoothed across the seam and the buffers shrink.
+// With texture coordinates or authored normals, those must match as well:
+// the seams made by splitVertices are kept.
+void Mesh::weldVertices() {
+  // -0.0f and 0.0f are the same position
+  auto bits = [](float f) {
+    f += 0.0f;
+    uint32_t u;
+    std::memcpy(&u, &f, sizeof(u));
+    return u;
+  };
+  struct Key {
+    uint32_t c[8]; // x y z, u v, nx ny nz
+    bool operator==(const Key &o) const {
+      return std::equal(c, c + 8, o.c);
+    }
+  };
+  struct KeyHash {
+    size_t operator()(const Key &k) const {
+      size_t h = 0;
+      for (auto c : k.c) {
+        h = h * 73856093 ^ c;
+      }
+      return h;
+    }
+  };
+
+  bool has_uv = !m_uv.empty(), has_norm = m_norm.size() > 0;
+  std::unordered_map<Key, uint32_t, KeyHash> unique;
+  unique.reserve(m_pos.size());
+  std::vector<uint32_t> remap(m_pos.size());
+
+  size_t n_unique = 0;
+  for (size_t i = 0; i < m_pos.size(); ++i) {
+    Key key{{bits(m_pos.x[i]), bits(m_pos.y[i]), bits(m_pos.z[i])}};
+    if (has_uv) {
+      key.c[3] = bits(m_uv[2 * i]);
+      key.c[4] = bits(m_uv[2 * i + 1]);
+    }
+    if (has_norm) {
+      key.c[5] = bits(m_norm.x[i]);
+      key.c[6] = bits(m_norm.y[i]);
+      key.c[7] = bits(m_norm.z[i]);
     }
-    /*
-    f[i].v[0]->n = f[i].v[0]->n + f[i].n;
-    f[i].v[1]->n = f[i].v[1]->n + f[i].n;
-    f[i].v[2]->n = f[i].v[2]->n + f[i].n;
-    */
+
+    auto res = unique.emplace(key, n_unique);
+    if (res.second) {
+      m_pos.set(n_unique, m_pos.at(i));
+      if (has_uv) {
+        m_uv[2 * n_unique] = m_uv[2 * i];
+        m_uv[2 * n_unique + 1] = m_uv[2 * i + 1];
+      }
+      if (has_norm) {
+        m_norm.set(n_unique, m_norm.at(i));
+      }
+      ++n_unique;
+    }
+    remap[i] = res.first->second;
   }
 
-  // fase tre: ciclo sui vertici e rinormalizzo:
-  // la normale media rinormalizzata e' uguale alla somma delle normnali,
-  // calcolata nel ciclo precedente, ma rinormalizzata
-  for (auto &vertex : m_verts) {
-    vertex.normal = vertex.normal.normalize();
+  m_pos.resize(n_unique);
+  if (has_uv) {
+    m_uv.resize(2 * n_unique);
+  }
+  if (has_norm) {
+    m_norm.resize(n_unique);
   }
+  for (auto &index : m_indices) {
+    index = remap[index];
+  }
+}
+
+// Gli attributi dell'OBJ hanno indici separati (v/t/n): ogni combinazione
+// distinta diventa un vertice. Sulle cuciture della texture e sugli spigoli
+// vivi la stessa posizione finisce in piu' vertici.
+// Se anche un solo angolo non ha l'attributo, l'attributo viene scartato
+// (normali ricalcolate, coordinate generate da OpenGL).
+void Mesh::splitVertices(io::ObjData &obj) {
+  auto complete = [](const std::vector<int32_t> &corners, size_t count) {
+    return count > 0 && std::all_of(corners.begin(), corners.end(),
+                                    [count](int32_t i) {
+                                      return i >= 0 && size_t(i) < count;
+                                    });
+  };
+  bool has_uv = complete(obj.tri_texcoords, obj.texcoords.size() / 2);
+  bool has_norm = complete(obj.tri_normals, obj.normals.size());
+
+  if (!has_uv && !has_norm) {
+    m_pos = std::move(obj.positions);
+    m_indices.assign(obj.tris.begin(), obj.tris.end());
+    return;
+  }
+  m_indices.resize(obj.tris.size());
+
+  struct Key {
+    int32_t v, t, n;
+    bool operator==(const Key &o) const {
+      return v == o.v && t == o.t && n == o.n;
+    }
+  };
+  struct KeyHash {
+    size_t operator()(const Key &k) const {
+      return (size_t(k.v) * 73856093) ^ (size_t(k.t) * 19349663) ^
+             (size_t(k.n) * 83492791);
+    }
+  };
+
+  std::unordered_map<Key, uint32_t, KeyHash> unique;
+  unique.reserve(obj.positions.size());
+  m_pos.resize(0);
+  m_pos.reserve(obj.positions.size());
+  m_uv.clear();
+  m_norm.resize(0);
+
+  for (size_t i = 0; i < obj.tris.size(); ++i) {
+    Key key{obj.tris[i], has_uv ? obj.tri_texcoords[i] : -1,
+            has_norm ? obj.tri_normals[i] : -1};
+    auto res = unique.emplace(key, m_pos.size());
+    if (res.second) {
+      m_pos.push_back(obj.positions.x[key.v], obj.positions.y[key.v],
+                      obj.positions.z[key.v]);
+      if (has_uv) {
+        m_uv.push_back(obj.texcoords[2 * key.t]);
+        m_uv.push_back(obj.texcoords[2 * key.t + 1]);
+      }
+      if (has_norm) {
+        m_norm.push_back(obj.normals.x[key.n], obj.normals.y[key.n],
+                         obj.normals.z[key.n]);
+      }
+    }
+    m_indices[i] = res.first->second;
+  }
+  m_authored_normals = has_norm;
+}
+
+// attributi in float, decodificati al volo se la mesh e' quantizzata
+inline Point3 Mesh::position(uint32_t v) const {
+  if (m_quantized) {
+    Point3 extent = bbmax - bbmin;
+    return Point3(quant::decodePos(m_qverts.x[v], bbmin.x, extent.x),
+                  quant::decodePos(m_qverts.y[v], bbmin.y, extent.y),
+                  quant::decodePos(m_qverts.z[v], bbmin.z, extent.z));
+  }
+  return m_pos.at(v);
+}
+
+inline Point3 Mesh::normal(uint32_t v) const {
+  return m_quantized ? quant::decodeOct(m_qverts.normals[v]) : m_norm.at(v);
+}
+
+inline Point3 Mesh::faceNormal(size_t f) const {
+  return m_quantized ? quant::decodeOct(m_qface_normals[f])
+                     : m_face_normals.at(f);
 }
 
-// renderizzo la mesh in wireframe
+// invio ad OpenGL degli attributi in modo immediato
+inline void Mesh::sendVertex(uint32_t v) const {
+  Point3 p = position(v);
+  glVertex3f(p.x, p.y, p.z);
+}
+
+inline void Mesh::sendNormal(uint32_t v) const {
+  Point3 n = normal(v);
+  glNormal3f(n.x, n.y, n.z);
+}
+
+inline void Mesh::sendTexCoord(uint32_t v) const {
+  glTexCoord2f(m_uv[2 * v], m_uv[2 * v + 1]);
+}
+
+inline void Mesh::sendFaceNormal(size_t f) const {
+  Point3 n = faceNormal(f);
+  glNormal3f(n.x, n.y, n.z);
+}
+
+// draw the meshes from GPU buffers
+static bool s_mesh_buffers = true;
+
+void setMeshBuffers(bool enabled) { s_mesh_buffers = enabled; }
+
+bool getMeshBuffers() { return s_mesh_buffers; }
+
+// Copia della mesh sulla GPU, fatta una volta sola al primo render (serve
+// il contesto GL, che il thread di caricamento non ha). I vertici sono
+// intercalati; le mesh quantizzate vengono decodificate qui, in memoria
+// centrale restano compresse.
+bool Mesh::upload(bool flat) {
+  static const auto TAG = __func__;
+
+  MeshBuffers &buffers = flat ? m_gpu_flat : m_gpu;
+  if (buffers.vbo) {
+    return true;
+  }
+  if (!buffersSupported()) {
+    return false;
+  }
+
+  // vertices: position, normal [, u v]; flat: one vertex per face corner
+  buffers.uv = hasTexCoords();
+  const size_t n_floats = buffers.uv ? 8 : 6;
+
+  size_t n_verts = flat ? m_indices.size() : numVertices();
+  std::vector<float> data;
+  data.reserve(n_verts * n_floats);
+  for (size_t i = 0; i < n_verts; ++i) {
+    uint32_t v = flat ? m_indices[i] : i;
+    Point3 p = position(v);
+    Point3 n = flat ? faceNormal(i / 3) : normal(v);
+    data.insert(data.end(), {p.x, p.y, p.z, n.x, n.y, n.z});
+    if (buffers.uv) {
+      data.insert(data.end(), {m_uv[2 * v], m_uv[2 * v + 1]});
+    }
+  }
+
+  // triangles, then the edges for the wireframe
+  std::vector<uint32_t> indices;
+  if (!flat) {
+    indices.reserve(m_indices.size() + 2 * m_edges.size());
+    indices = m_indices;
+    for (const auto &edge : m_edges) {
+      indices.insert(indices.end(), {edge.v[0], edge.v[1]});
+    }
+  }
+  createBuffers(buffers, data, indices);
+
+  lg::i(TAG, "%zu vertices, %zu faces%s: %.1f KB uploaded", n_verts,
+        numFaces(), flat ? " (flat)" : "", buffers.bytes / 1024.0);
+  return true;
+}
+
+// renderizzo la mesh in wireframe: un solo batch GL_LINES sulla lista
+// degli edge, ogni edge disegnato una volta sola
 void Mesh::renderWire() {
   glLineWidth(1.0);
-  // (nota: ogni edge viene disegnato due volte.
-  // sarebbe meglio avere ed usare la struttura edge)
-  glBegin(GL_LINE_LOOP);
-  for (auto &face : m_faces) {
-    face.normal.render();
-    for (auto vertex : face.verts) {
-      // render as vertex, don't send the normal
-      vertex->render(false);
+  glBegin(GL_LINES);
+  for (const auto &edge : m_edges) {
+    for (auto v : edge.v) {
+      sendNormal(v);
+      sendVertex(v);
     }
   }
   glEnd();
-
-  /*  {
-      glBegin(GL_LINE_LOOP);
-      f[i].n.getAsNormal();
-      (f[i].v[0])->p.getAsVertex();
-      (f[i].v[1])->p.getAsVertex();
-      (f[i].v[2])->p.getAsVertex();
-      glEnd();
-    }*/
 }
 
 // Render usando la normale per faccia (FLAT SHADING)
@@ -82,56 +328,68 @@ void Mesh::renderFlat(bool wireframe_on) { render(wireframe_on, false); }
 void Mesh::renderGouraud(bool wireframe_on) { render(wireframe_on, true); }
 
 // Render usando la normale per vertice (GOURAUD SHADING)
+// Dai buffer sulla GPU: una glDrawElements (o glDrawArrays per il flat)
+// per i triangoli, una per il wireframe. Altrimenti in modo immediato.
 void Mesh::render(bool wireframe_on, bool goraud_shading) {
+  bool buffers = s_mesh_buffers && upload(false) &&
+                 (goraud_shading || upload(true));
+
+  auto &env = get_env();
   if (wireframe_on) {
-    glDisable(GL_TEXTURE_2D);
-    glColor3f(.5, .5, .5);
-    renderWire();
-    glColor3f(1, 1, 1);
+    env.disable(GL_TEXTURE_2D);
+    env.setColor(Color(.5, .5, .5));
+    if (buffers) {
+      env.applyProgram(); // shader per lo stato corrente, vedi shaders.cxx
+      glLineWidth(1.0);
+      bindBuffers(m_gpu);
+      glDrawElements(GL_LINES, 2 * m_edges.size(), GL_UNSIGNED_INT,
+                     reinterpret_cast<const void *>(m_indices.size() *
+                                                    sizeof(uint32_t)));
+      unbindBuffers(m_gpu);
+    } else {
+      env.useProgram(0); // gli shader leggono solo i buffer
+      renderWire();
+    }
+    env.setColor(WHITE);
   }
 
-  glBegin(GL_TRIANGLES);
-
-  if (goraud_shading) {
-    // mandiamo tutti i triangoli a schermo
-    bool send_normals = goraud_shading;
-
-    for (const auto &face : m_faces) {
-      // If using flat shading
-      if (!send_normals) {
-        face.normal.render();
-      }
-
-      for (auto vert : face.verts) {
-        vert->render(send_normals);
-      }
+  if (buffers) {
+    env.applyProgram();
+    if (goraud_shading) {
+      bindBuffers(m_gpu);
+      glDrawElements(GL_TRIANGLES, m_indices.size(), GL_UNSIGNED_INT, nullptr);
+      unbindBuffers(m_gpu);
+    } else {
+      bindBuffers(m_gpu_flat);
+      glDrawArrays(GL_TRIANGLES, 0, m_indices.size());
+      unbindBuffers(m_gpu_flat);
     }
+    return;
   }
-  /*
-        for (int i = 0; i < f.size(); i++) {
-          (f[i].v[0])->n.getAsNormal();
-          (f[i].v[0])->p.getAsVertex();
 
-          (f[i].v[1])->n.getAsNormal();
-          (f[i].v[1])->p.getAsVertex();
+  // mandiamo tutti i triangoli a schermo
+  bool send_normals = goraud_shading;
+  bool send_uv = hasTexCoords();
 
-          (f[i].v[2])->n.getAsNormal();
-          (f[i].v[2])->p.getAsVertex();
-        }
+  env.useProgram(0);
+  glBegin(GL_TRIANGLES);
+  for (size_t f = 0; f < numFaces(); ++f) {
+    // If using flat shading
+    if (!send_normals) {
+      sendFaceNormal(f);
     }
-      else {
-        //flat shading
-        for (int i = 0; i < f.size(); i++) {
-          f[i].n.getAsNormal(); // flat shading
-
-          (f[i].v[0])->p.getAsVertex();
 
-          (f[i].v[1])->p.getAsVertex();
-
-          (f[i].v[2])->p.getAsVertex();
-        }
+    for (size_t k = 0; k < 3; ++k) {
+      auto v = m_indices[3 * f + k];
+      if (send_normals) {
+        sendNormal(v);
+      }
+      if (send_uv) {
+        sendTexCoord(v);
+      }
+      sendVertex(v);
     }
-  */
+  }
   glEnd();
 }
 
@@ -139,33 +397,241 @@ void Mesh::render(bool wireframe_on, bool goraud_shading) {
 void Mesh::computeBoundingBox() {
   // basta trovare la min x, y, e z, e la max x, y, e z di tutti i vertici
   // (nota: non e' necessario usare le facce: perche?)
-  // init var to worse value
-  float min_x, min_y, min_z = INFINITY;
-  float max_x, max_y, max_z = -INFINITY;
+  kernels::bounds(m_pos, bbmin, bbmax);
+}
+
+// Point3 Mesh::center() { return (bbmin + bbmax) / 2.0; };
 
-  // find maximum and minimum among vertices
-  for (const auto &vertex : m_verts) {
-    min_x = std::min(min_x, vertex.point.x);
-    min_y = std::min(min_y, vertex.point.y);
-    min_z = std::min(min_z, vertex.point.z);
+// init face and vertex normals and bounding box. Authored normals (vn) are
+// only renormalized.
+void Mesh::init() {
+  computeFaceNormals();
+  if (m_authored_normals) {
+    kernels::normalize(m_norm);
+  } else {
+    computeNormalsPerVertex();
+  }
+  computeBoundingBox();
+  computeEdges();
+}
 
-    max_x = std::max(max_x, vertex.point.x);
-    max_y = std::max(max_y, vertex.point.y);
-    max_z = std::max(max_z, vertex.point.z);
+// Riordino facce e vertici per la cache dei vertici trasformati e per il
+// fetch dei vertici (vedi mesh_opt.h). Va fatto prima di init(): le normali
+// vengono calcolate nel nuovo ordine.
+void Mesh::optimizeVertexCache() {
+  opt::reorderFaces(m_indices.data(), m_indices.size(), m_pos.size());
+
+  std::vector<uint32_t> remap;
+  opt::reorderVertices(m_indices.data(), m_indices.size(), m_pos.size(),
+                       remap);
+
+  Vec3Array pos, norm;
+  pos.resize(m_pos.size());
+  norm.resize(m_norm.size());
+  std::vector<float> uv(m_uv.size());
+  for (size_t v = 0; v < m_pos.size(); ++v) {
+    pos.set(remap[v], m_pos.at(v));
+    if (m_norm.size() > 0) {
+      norm.set(remap[v], m_norm.at(v));
+    }
+    if (!m_uv.empty()) {
+      uv[2 * remap[v]] = m_uv[2 * v];
+      uv[2 * remap[v] + 1] = m_uv[2 * v + 1];
+    }
   }
+  m_pos = std::move(pos);
+  m_norm = std::move(norm);
+  m_uv = std::move(uv);
+}
+
+// compressed vertex format for the meshes of the scene
+static bool s_quantize_meshes = false;
+
+void setMeshQuantization(bool enabled) { s_quantize_meshes = enabled; }
+
+bool getMeshQuantization() { return s_quantize_meshes; }
+
+// vertex cache optimization of the meshes parsed from OBJ
+static bool s_optimize_meshes = true;
 
-  bbmin = Point3(min_x, min_y, min_z);
-  bbmax = Point3(max_x, max_y, max_z);
+void setMeshOptimization(bool enabled) { s_optimize_meshes = enabled; }
+
+bool getMeshOptimization() { return s_optimize_meshes; }
+
+float Mesh::radius() const {
+  Point3 diag = bbmax - bbmin;
+  return std::sqrt(diag.x * diag.x + diag.y * diag.y + diag.z * diag.z) / 2.0f;
 }
 
-// Point3 Mesh::center() { return (bbmin + bbmax) / 2.0; };
+// diametro proiettato (in pixel) sopra il quale si usa la mesh completa:
+// ogni dimezzamento scende di un livello di dettaglio
+static const float LOD_FULL_DETAIL_PX = 400.0f;
 
-// init vertex normals and bounding box
-void Mesh::init() {
-  computeNormalsPerVertex();
-  computeBoundingBox();
+// Catena di livelli di dettaglio: ogni livello e' la semplificazione del
+// precedente, con normali e ordine dei triangoli ricalcolati.
+void Mesh::buildLods(size_t n_levels, float ratio) {
+  static const auto TAG = __func__;
+  using clock = std::chrono::steady_clock;
+
+  if (m_quantized) {
+    lg::e(TAG, "Levels of detail must be built before quantizing the mesh");
+    return;
+  }
+
+  auto start = clock::now();
+  m_lods.clear();
+  const Mesh *prev = this;
+  for (size_t level = 1; level <= n_levels; ++level) {
+    size_t target = size_t(prev->numFaces() * ratio);
+    std::unique_ptr<Mesh> lod(new Mesh());
+    std::vector<uint32_t> origin;
+    opt::simplify(prev->m_pos, prev->m_indices, target, lod->m_pos,
+                  lod->m_indices, &origin);
+    if (lod->m_indices.empty() ||
+        lod->m_indices.size() == prev->m_indices.size()) {
+      break; // non si semplifica piu'
+    }
+
+    // coordinate di texture e normali dell'OBJ: quelle del vertice
+    // sopravvissuto al collasso
+    if (prev->hasTexCoords()) {
+      lod->m_uv.resize(2 * origin.size());
+      for (size_t v = 0; v < origin.size(); ++v) {
+        lod->m_uv[2 * v] = prev->m_uv[2 * origin[v]];
+        lod->m_uv[2 * v + 1] = prev->m_uv[2 * origin[v] + 1];
+      }
+    }
+    if (prev->m_authored_normals) {
+      lod->m_norm.resize(origin.size());
+      for (size_t v = 0; v < origin.size(); ++v) {
+        lod->m_norm.set(v, prev->m_norm.at(origin[v]));
+      }
+      lod->m_authored_normals = true;
+    }
+
+    if (s_optimize_meshes) {
+      lod->optimizeVertexCache();
+    }
+    lod->init();
+    m_lods.push_back(std::move(lod));
+    prev = m_lods.back().get();
+  }
+
+  std::chrono::duration<double> elapsed = clock::now() - start;
+  std::string faces = std::to_string(numFaces());
+  for (const auto &lod : m_lods) {
+    faces += " -> " + std::to_string(lod->numFaces());
+  }
+  lg::i(TAG, "%zu levels of detail (%s faces) built in %.2f ms", numLods(),
+        faces.c_str(), elapsed.count() * 1000.0);
 }
 
+// Albero di collisione sui triangoli del livello 0 (vedi bvh.h). Tiene una
+// copia dei vertici, per cui resta valido anche dopo quantize().
+void Mesh::buildBvh() {
+  static const auto TAG = __func__;
+  using clock = std::chrono::steady_clock;
+
+  if (m_quantized) {
+    lg::e(TAG, "The BVH must be built before quantizing the mesh");
+    return;
+  }
+
+  auto start = clock::now();
+  m_bvh.reset(new Bvh(m_pos, m_indices));
+  std::chrono::duration<double> elapsed = clock::now() - start;
+  lg::i(TAG, "BVH: %zu nodes over %zu faces built in %.2f ms",
+        m_bvh->numNodes(), m_bvh->numTriangles(), elapsed.count() * 1000.0);
+}
+
+Mesh &Mesh::lod(size_t level) {
+  return level == 0 ? *this : *m_lods.at(std::min(level, m_lods.size()) - 1);
+}
+
+size_t Mesh::selectLod(float pixels) const {
+  if (!(pixels < LOD_FULL_DETAIL_PX)) {
+    return 0;
+  }
+  float level = std::log2(LOD_FULL_DETAIL_PX / std::max(pixels, 1.0f));
+  return std::min(size_t(level) + 1, numLods() - 1);
+}
+
+// Formato compresso (vedi mesh_quant.h): posizioni a 16 bit nel bounding
+// box, normali ottaedriche a 2 x 16 bit. I float vengono liberati, il
+// render decodifica al volo. Va fatto per ultimo (dopo LOD ecc.).
+void Mesh::quantize() {
+  static const auto TAG = __func__;
+  if (m_quantized) {
+    return;
+  }
+
+  size_t n_verts = m_pos.size();
+  size_t float_bytes = (2 * n_verts + numFaces()) * 3 * sizeof(float);
+
+  Point3 extent = bbmax - bbmin;
+  m_qverts.x.resize(n_verts);
+  m_qverts.y.resize(n_verts);
+  m_qverts.z.resize(n_verts);
+  m_qverts.normals.resize(n_verts);
+  m_qface_normals.resize(numFaces());
+
+  // errore massimo: distanza dei vertici e angolo delle normali
+  double max_pos_err = 0.0, max_angle = 0.0;
+  auto angleErr = [](const Point3 &a, const Point3 &b) {
+    double dot = a.x * b.x + a.y * b.y + a.z * b.z;
+    return std::acos(std::min(std::max(dot, -1.0), 1.0)) * 180.0 / M_PI;
+  };
+
+  for (size_t v = 0; v < n_verts; ++v) {
+    m_qverts.x[v] = quant::encodePos(m_pos.x[v], bbmin.x, extent.x);
+    m_qverts.y[v] = quant::encodePos(m_pos.y[v], bbmin.y, extent.y);
+    m_qverts.z[v] = quant::encodePos(m_pos.z[v], bbmin.z, extent.z);
+    m_qverts.normals[v] =
+        quant::encodeOct(m_norm.x[v], m_norm.y[v], m_norm.z[v]);
+
+    Point3 err = m_pos.at(v) -
+                 Point3(quant::decodePos(m_qverts.x[v], bbmin.x, extent.x),
+                        quant::decodePos(m_qverts.y[v], bbmin.y, extent.y),
+                        quant::decodePos(m_qverts.z[v], bbmin.z, extent.z));
+    max_pos_err = std::max(
+        max_pos_err, std::sqrt(double(err.x * err.x + err.y * err.y +
+                                      err.z * err.z)));
+    if (m_norm.x[v] != 0.0f || m_norm.y[v] != 0.0f || m_norm.z[v] != 0.0f) {
+      max_angle = std::max(
+          max_angle,
+          angleErr(m_norm.at(v), quant::decodeOct(m_qverts.normals[v])));
+    }
+  }
+  for (size_t f = 0; f < numFaces(); ++f) {
+    m_qface_normals[f] = quant::encodeOct(
+        m_face_normals.x[f], m_face_normals.y[f], m_face_normals.z[f]);
+  }
+
+  // da qui in poi solo il formato compresso
+  m_pos = Vec3Array();
+  m_norm = Vec3Array();
+  m_face_normals = Vec3Array();
+  m_quantized = true;
+
+  size_t quant_bytes = n_verts * (3 * sizeof(uint16_t) + sizeof(uint32_t)) +
+                       m_qface_normals.size() * sizeof(uint32_t);
+  lg::i(TAG, "%zu vertices: %.1f KB -> %.1f KB of vertex data, max error %g "
+        "(%.2g%% of the diagonal), normals %.3f deg",
+        n_verts, float_bytes / 1024.0, quant_bytes / 1024.0, max_pos_err,
+        100.0 * max_pos_err / std::max(2.0f * radius(), 1e-30f), max_angle);
+
+  for (auto &lod : m_lods) {
+    lod->quantize();
+  }
+}
+
+// worker threads used to parse big OBJ files, 0 = one per core
+static size_t s_loader_threads = 0;
+
+void setMeshLoaderThreads(size_t n_threads) { s_loader_threads = n_threads; }
+
+size_t getMeshLoaderThreads() { return s_loader_threads; }
+
 //   carica la mesh da un file in formato Obj
 //   Nota: nel file, possono essere presenti sia quads che tris
 //   ma nella rappresentazione interna (classe Mesh) abbiamo solo tris.
@@ -173,239 +639,149 @@ void Mesh::init() {
 // Friend class, must be used instead of the constructor
 std::unique_ptr<Mesh> loadMesh(const char *filename) {
   static const auto TAG = __func__;
+  using clock = std::chrono::steady_clock;
 
   lg::i(TAG, "Loading mesh from file %s", filename);
 
   std::unique_ptr<Mesh> ret(new Mesh());
 
-  FILE *file = fopen(filename, "rt"); // apriamo il file in lettura
-  if (!file) {
-    // whenever I've spare time, an exception class must be added
-    lg::e(TAG, "Cannot load mesh from %s", filename);
-    exit(EXIT_FAILURE);
-  }
-
-  // make a first pass through the file to get a count of the number
-  // of vertices, normals, texcoords & triangles
-  char buf[128];
-  int nv, nf, nt;
-  float x, y, z;
-  int va, vb, vc, vd;
-  int na, nb, nc, nd;
-  int ta, tb, tc, td;
-
-  nv = 0;
-  nf = 0;
-  nt = 0;
-  while (std::fscanf(file, "%s", buf) != EOF) {
-    switch (buf[0]) {
-    case '#': // comment
-      // eat up rest of line
-      std::fgets(buf, sizeof(buf), file);
-      break;
-    case 'v': // v, vn, vt
-      switch (buf[1]) {
-      case '\0': // vertex
-        // eat up rest of line
-        std::fgets(buf, sizeof(buf), file);
-        nv++;
-        break;
-      default:
-        break;
-      }
-      break;
-    case 'f': // face
-      std::fscanf(file, "%s", buf);
-      // can be one of %d, %d//%d, %d/%d, %d/%d/%d %d//%d
-      if (std::strstr(buf, "//")) {
-        // v//n
-        std::sscanf(buf, "%d//%d", &va, &na);
-        std::fscanf(file, "%d//%d", &vb, &nb);
-        std::fscanf(file, "%d//%d", &vc, &nc);
-        nf++;
-        nt++;
-        while (std::fscanf(file, "%d//%d", &vd, &nd) > 0) {
-          nt++;
-        }
-      } else if (std::sscanf(buf, "%d/%d/%d", &va, &ta, &na) == 3) {
-        // v/t/n
-        std::fscanf(file, "%d/%d/%d", &vb, &tb, &nb);
-        std::fscanf(file, "%d/%d/%d", &vc, &tc, &nc);
-        nf++;
-        nt++;
-        while (std::fscanf(file, "%d/%d/%d", &vd, &td, &nd) > 0) {
-          nt++;
-        }
-      } else if (std::sscanf(buf, "%d/%d", &va, &ta) == 2) {
-        // v/t
-        std::fscanf(file, "%d/%d", &vb, &tb);
-        std::fscanf(file, "%d/%d", &vc, &tc);
-        nf++;
-        nt++;
-        while (std::fscanf(file, "%d/%d", &vd, &td) > 0) {
-          nt++;
-        }
-      } else {
-        // v
-        std::fscanf(file, "%d", &va);
-        std::fscanf(file, "%d", &vb);
-        nf++;
-        nt++;
-        while (std::fscanf(file, "%d", &vc) > 0) {
-          nt++;
-        }
-      }
-      break;
+  // fast path: binary cache generated by a previous load
+  auto start = clock::now();
+  auto cache_filename = io::cachePath(filename);
+  if (ret->readCache(cache_filename.c_str(), filename)) {
+    ret->computeEdges();
+    std::chrono::duration<double> elapsed = clock::now() - start;
+    lg::i(TAG, "%s: %zu vertices, %zu faces, loaded from cache in %.2f ms",
+          filename, ret->numVertices(), ret->numFaces(),
+          elapsed.count() * 1000.0);
+    return ret;
+  }
 
-    default:
-      // eat up rest of line
-      std::fgets(buf, sizeof(buf), file);
-      break;
-    }
+  // the errors are only logged: this may run on a loader thread, while the
+  // render thread keeps drawing (see loadMeshAsync)
+  io::MappedFile file(filename);
+  if (!file.isOpen()) {
+    lg::e(TAG, "Cannot load mesh from %s", filename);
+    return nullptr;
   }
 
-  // printf("dopo FirstPass nv=%d nf=%d nt=%d\n",nv,nf,nt);
-
-  // allochiamo spazio per nv vertici
-  ret->m_verts.resize(nv);
-
-  // rewind to beginning of file and read in the data this pass
-  rewind(file);
-
-  // on the second pass through the file, read all the data into the
-  // allocated arrays
-
-  nv = 0;
-  nt = 0;
-  while (std::fscanf(file, "%s", buf) != EOF) {
-    switch (buf[0]) {
-    case '#': // comment
-      // eat up rest of line
-      std::fgets(buf, sizeof(buf), file);
-      break;
-    case 'v': // v, vn, vt
-      switch (buf[1]) {
-      case '\0': // vertex
-        std::fscanf(file, "%f %f %f", &x, &y, &z);
-        ret->m_verts[nv] = Point3(x, y, z);
-        nv++;
-        break;
-      default:
-        break;
-      }
-      break;
-    case 'f': // face
-      std::fscanf(file, "%s", buf);
-      // can be one of %d, %d//%d, %d/%d, %d/%d/%d %d//%d
-      if (std::strstr(buf, "//")) {
-        // v//n
-        std::sscanf(buf, "%d//%d", &va, &na);
-        std::fscanf(file, "%d//%d", &vb, &nb);
-        std::fscanf(file, "%d//%d", &vc, &nc);
-        va--;
-        vb--;
-        vc--;
-
-        // create on place a new face and save it at the end of the face
-        // vector
-        ret->m_faces.emplace_back(&(ret->m_verts[va]), &(ret->m_verts[vc]),
-                                  &(ret->m_verts[vb]));
-
-        nt++;
-        vb = vc;
-        while (std::fscanf(file, "%d//%d", &vc, &nc) > 0) {
-          vc--;
-          ret->m_faces.emplace_back(&(ret->m_verts[va]), &(ret->m_verts[vc]),
-                                    &(ret->m_verts[vb]));
-
-          nt++;
-          vb = vc;
-        }
-      } else if (std::sscanf(buf, "%d/%d/%d", &va, &ta, &na) == 3) {
-        // v/t/n
-        std::fscanf(file, "%d/%d/%d", &vb, &tb, &nb);
-        std::fscanf(file, "%d/%d/%d", &vc, &tc, &nc);
-        va--;
-        vb--;
-        vc--;
-
-        ret->m_faces.emplace_back(&(ret->m_verts[va]), &(ret->m_verts[vc]),
-                                  &(ret->m_verts[vb]));
-
-        nt++;
-        vb = vc;
-        while (std::fscanf(file, "%d/%d/%d", &vc, &tc, &nc) > 0) {
-          vc--;
-
-          ret->m_faces.emplace_back(&(ret->m_verts[va]), &(ret->m_verts[vc]),
-                                    &(ret->m_verts[vb]));
-
-          nt++;
-          vb = vc;
-        }
-      } else if (std::sscanf(buf, "%d/%d", &va, &ta) == 2) {
-        // v/t
-        std::fscanf(file, "%d/%d", &va, &ta);
-        std::fscanf(file, "%d/%d", &va, &ta);
-        va--;
-        vb--;
-        vc--;
-
-        ret->m_faces.emplace_back(&(ret->m_verts[va]), &(ret->m_verts[vc]),
-                                  &(ret->m_verts[vb]));
-
-        nt++;
-        vb = vc;
-        while (std::fscanf(file, "%d/%d", &vc, &tc) > 0) {
-          vc--;
-
-          ret->m_faces.emplace_back(&(ret->m_verts[va]), &(ret->m_verts[vc]),
-                                    &(ret->m_verts[vb]));
-
-          nt++;
-          vb = vc;
-        }
-      } else {
-        // v
-        std::sscanf(buf, "%d", &va);
-        std::fscanf(file, "%d", &vb);
-        std::fscanf(file, "%d", &vc);
-        va--;
-        vb--;
-        vc--;
-
-        ret->m_faces.emplace_back(&(ret->m_verts[va]), &(ret->m_verts[vc]),
-                                  &(ret->m_verts[vb]));
-
-        nt++;
-        vb = vc;
-        while (std::fscanf(file, "%d", &vc) > 0) {
-          vc--;
-
-          ret->m_faces.emplace_back(&(ret->m_verts[va]), &(ret->m_verts[vc]),
-                                    &(ret->m_verts[vb]));
-
-          nt++;
-          vb = vc;
-        }
-      }
-      break;
+  // single pass over the mapped file (in parallel chunks if big enough)
+  start = clock::now();
+  io::ObjData obj;
+  if (!io::parseObjParallel(file.data(), file.end(), obj, s_loader_threads)) {
+    lg::e(TAG, "Cannot parse mesh %s", filename);
+    return nullptr;
+  }
 
-    default:
-      // eat up rest of line
-      std::fgets(buf, sizeof(buf), file);
-      break;
+  // validate the indices and move everything in the index buffer
+  const int32_t n_positions = obj.positions.size();
+  for (size_t i = 0; i < obj.tris.size(); ++i) {
+    if (obj.tris[i] < 0 || obj.tris[i] >= n_positions) {
+      lg::e(TAG, "Face %zu of %s refers to a missing vertex", i / 3, filename);
+      return nullptr;
     }
   }
 
-  // printf("dopo SecondPass nv=%d nt=%d\n",nv,nt);
+  ret->splitVertices(obj);
+  size_t n_split = ret->numVertices();
+  ret->weldVertices();
+  if (!obj.texcoords.empty() && !ret->hasTexCoords()) {
+    lg::i(TAG, "%s: some faces have no texture coordinates, using texgen",
+          filename);
+  }
+  if (obj.normals.size() > 0 && !ret->m_authored_normals) {
+    lg::i(TAG, "%s: some faces have no normals, computing them", filename);
+  }
 
-  std::fclose(file);
+  std::chrono::duration<double> elapsed = clock::now() - start;
+  double secs = std::max(elapsed.count(), 1e-9);
+  double mbytes = file.size() / (1024.0 * 1024.0);
+  lg::i(TAG, "%s: %zu vertices (%zu positions, %zu welded), %zu faces, "
+        "%.2f MB parsed in %.2f ms (%.1f MB/s, %.0f faces/s)",
+        filename, ret->numVertices(), size_t(n_positions),
+        n_split - ret->numVertices(), ret->m_indices.size() / 3, mbytes,
+        secs * 1000.0, mbytes / secs, ret->m_indices.size() / 3 / secs);
+
+  if (s_optimize_meshes) {
+    start = clock::now();
+    double acmr_before = opt::acmr(ret->m_indices.data(), ret->m_indices.size());
+    ret->optimizeVertexCache();
+    double acmr_after = opt::acmr(ret->m_indices.data(), ret->m_indices.size());
+    elapsed = clock::now() - start;
+    lg::i(TAG, "%s: ACMR %.3f -> %.3f (FIFO %zu), reordered in %.2f ms",
+          filename, acmr_before, acmr_after, opt::ACMR_CACHE_SIZE,
+          elapsed.count() * 1000.0);
+  }
 
   // compute vertex normals and BB
+  start = clock::now();
   ret->init();
-  ret->computeBoundingBox();
+  elapsed = clock::now() - start;
+  lg::i(TAG, "%s: normals (%s%s) and bounding box computed in %.2f ms (%s)",
+        filename, ret->m_authored_normals ? "from the OBJ" : "computed",
+        ret->hasTexCoords() ? ", with texture coordinates" : "",
+        elapsed.count() * 1000.0, kernels::isaName(kernels::currentIsa()));
+
+  // save all the work above for the next time
+  ret->writeCache(cache_filename.c_str(), filename,
+                  io::hashBytes(file.data(), file.size()));
 
   return ret;
 }
+
+MeshHandle::MeshHandle() : m_has_bounds(false), m_failed(false) {}
+
+MeshHandle::MeshHandle(const std::string &filename,
+                       std::future<std::unique_ptr<Mesh>> loading,
+                       bool has_bounds, const Point3 &bbmin,
+                       const Point3 &bbmax)
+    : m_filename(filename), m_loading(std::move(loading)), m_bbmin(bbmin),
+      m_bbmax(bbmax), m_has_bounds(has_bounds), m_failed(false) {}
+
+Mesh *MeshHandle::get() const {
+  static const auto TAG = __func__;
+
+  if (!m_mesh && m_loading.valid() &&
+      m_loading.wait_for(std::chrono::seconds(0)) ==
+          std::future_status::ready) {
+    m_mesh = m_loading.get();
+    // the future is now invalid: this is logged once
+    if (!m_mesh) {
+      m_failed = true;
+      lg::e(TAG, "Mesh %s not loaded, keeping its placeholder",
+            m_filename.c_str());
+    }
+  }
+  return m_mesh.get();
+}
+
+bool MeshHandle::bounds(Point3 &bbmin, Point3 &bbmax) const {
+  // quella della mesh se e' pronta, altrimenti quella letta dalla cache
+  if (auto *mesh = get()) {
+    bbmin = mesh->bbmin;
+    bbmax = mesh->bbmax;
+    return true;
+  }
+  bbmin = m_bbmin;
+  bbmax = m_bbmax;
+  return m_has_bounds;
+}
+
+MeshHandle loadMeshAsync(const char *mesh_filename,
+                         std::function<void(Mesh &)> prepare) {
+  Point3 bbmin, bbmax;
+  bool has_bounds = io::cachedBounds(mesh_filename, bbmin, bbmax);
+
+  std::string filename(mesh_filename);
+  auto loading = std::async(std::launch::async, [filename, prepare] {
+    auto mesh = loadMesh(filename.c_str());
+    if (mesh && prepare) {
+      prepare(*mesh);
+    }
+    return mesh;
+  });
+
+  return MeshHandle(filename, std::move(loading), has_bounds, bbmin, bbmax);
+}
+
 } // namespace agl
@@ -0,0 +1,302 @@
+#include "mesh_io.h"
+
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+
+#include <sys/stat.h>
+
+/*
+ * Binary mesh cache (.agm).
+ *
+ * The first time a mesh is loaded from OBJ, the fully initialized Mesh
+ * (vertices with their normals and texture coordinates, faces with their
+ * normals and bounding box)
+ * is dumped next to the OBJ file. Following loads map the cache and copy
+ * the arrays straight into the Mesh: no parsing, no normal computation,
+ * no welding. Every section is a single memcpy.
+ *
+ * Layout (native endianness, everything 4-byte aligned), the arrays follow
+ * the structure-of-arrays layout of the Mesh:
+ *   AgmHeader
+ *   3 * n_verts  float  vertex positions: all x, all y, all z
+ *   3 * n_verts  float  vertex normals:   all x, all y, all z
+ *   2 * n_verts  float  texture coordinates, { u v } per vertex
+ *                       (only with AGM_TEXCOORDS)
+ *   3 * n_faces  uint32 vertex indices, { a b c } per face
+ *   3 * n_faces  float  face normals:     all x, all y, all z
+ *
+ * The cache is valid only for the source it was generated from: the size
+ * and mtime of the OBJ are stored in the header. When only the mtime
+ * differs (e.g. after a fresh checkout) the source is hashed and compared
+ * against the stored hash before giving up on the cache; if it matches, the
+ * cache is stamped with the new mtime so the hash is computed only once.
+ */
+
+namespace agl {
+
+namespace {
+
+const char AGM_MAGIC[4] = {'A', 'G', 'M', '\0'};
+const uint32_t AGM_VERSION = 4;
+
+// AgmHeader::flags
+const uint32_t AGM_TEXCOORDS = 1;        // texture coordinates follow
+const uint32_t AGM_AUTHORED_NORMALS = 2; // normals come from the OBJ
+
+struct AgmHeader {
+  char magic[4];
+  uint32_t version;
+  uint64_t src_size;
+  int64_t src_mtime; // nanoseconds
+  uint64_t src_hash; // FNV-1a of the whole source file
+  uint32_t n_verts;
+  uint32_t n_faces;
+  float bbmin[3];
+  float bbmax[3];
+  uint32_t flags;
+  uint32_t reserved;
+};
+
+static_assert(sizeof(AgmHeader) == 72, "AgmHeader must not be padded");
+
+// one memcpy per component array
+void readArray(const char *&p, Vec3Array &array, size_t n) {
+  array.resize(n);
+  for (auto *component : {&array.x, &array.y, &array.z}) {
+    std::memcpy(component->data(), p, n * sizeof(float));
+    p += n * sizeof(float);
+  }
+}
+
+bool writeArray(FILE *file, const Vec3Array &array) {
+  for (const auto *component : {&array.x, &array.y, &array.z}) {
+    if (std::fwrite(component->data(), sizeof(float), component->size(),
+                    file) != component->size()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// size and modification time of the source mesh. False if it doesn't exist.
+bool sourceStamp(const char *filename, uint64_t &size, int64_t &mtime) {
+  struct stat st;
+  if (stat(filename, &st) < 0) {
+    return false;
+  }
+
+  size = st.st_size;
+  mtime = int64_t(st.st_mtim.tv_sec) * 1000000000LL + st.st_mtim.tv_nsec;
+  return true;
+}
+
+// Rewrites the cache with the new mtime of its (unchanged) source, through a
+// temporary file like writeCache: the hash check is paid only once.
+void restampCache(const char *cache_filename, const char *cache_data,
+                  size_t cache_size, AgmHeader hdr, int64_t src_mtime) {
+  static const auto TAG = __func__;
+
+  hdr.src_mtime = src_mtime;
+  std::string tmp_filename = std::string(cache_filename) + ".tmp";
+  FILE *file = std::fopen(tmp_filename.c_str(), "wb");
+  if (!file) {
+    return;
+  }
+  size_t body = cache_size - sizeof(hdr);
+  bool ok = std::fwrite(&hdr, sizeof(hdr), 1, file) == 1 &&
+            std::fwrite(cache_data + sizeof(hdr), 1, body, file) == body;
+  ok = (std::fclose(file) == 0) && ok;
+
+  if (!ok || std::rename(tmp_filename.c_str(), cache_filename) != 0) {
+    lg::i(TAG, "Cannot update mesh cache %s", cache_filename);
+    std::remove(tmp_filename.c_str());
+  }
+}
+
+} // namespace
+
+namespace io {
+
+uint64_t hashBytes(const char *data, size_t size) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+std::string cachePath(const char *mesh_filename) {
+  std::string path(mesh_filename);
+  auto dot = path.find_last_of('.');
+  auto slash = path.find_last_of('/');
+
+  // replace the extension, if any
+  if (dot != std::string::npos && (slash == std::string::npos || dot > slash)) {
+    path.erase(dot);
+  }
+  return path + ".agm";
+}
+
+bool cachedBounds(const char *mesh_filename, Point3 &min, Point3 &max) {
+  FILE *file = std::fopen(cachePath(mesh_filename).c_str(), "rb");
+  if (!file) {
+    return false;
+  }
+
+  AgmHeader hdr;
+  bool ok = std::fread(&hdr, sizeof(hdr), 1, file) == 1 &&
+            !std::memcmp(hdr.magic, AGM_MAGIC, sizeof(AGM_MAGIC)) &&
+            hdr.version == AGM_VERSION;
+  std::fclose(file);
+
+  // bounds of another version of the source are worse than none. No hash
+  // here: readCache checks it, and restamps the cache if it still matches
+  uint64_t src_size;
+  int64_t src_mtime;
+  ok = ok && sourceStamp(mesh_filename, src_size, src_mtime) &&
+       src_size == hdr.src_size && src_mtime == hdr.src_mtime;
+
+  if (ok) {
+    min = Point3(hdr.bbmin[0], hdr.bbmin[1], hdr.bbmin[2]);
+    max = Point3(hdr.bbmax[0], hdr.bbmax[1], hdr.bbmax[2]);
+  }
+  return ok;
+}
+
+} // namespace io
+
+// Fill the mesh from the cache. Returns false if the cache is missing, stale
+// or corrupted: the caller has to go through the OBJ then.
+bool Mesh::readCache(const char *cache_filename, const char *mesh_filename) {
+  static const auto TAG = __func__;
+
+  io::MappedFile cache(cache_filename);
+  if (!cache.isOpen() || cache.size() < sizeof(AgmHeader)) {
+    return false;
+  }
+
+  AgmHeader hdr;
+  std::memcpy(&hdr, cache.data(), sizeof(hdr));
+
+  if (std::memcmp(hdr.magic, AGM_MAGIC, sizeof(AGM_MAGIC)) ||
+      hdr.version != AGM_VERSION) {
+    lg::i(TAG, "%s: unknown format, ignoring it", cache_filename);
+    return false;
+  }
+
+  bool has_uv = hdr.flags & AGM_TEXCOORDS;
+  size_t expected = sizeof(AgmHeader) +
+                    size_t(hdr.n_verts) * (has_uv ? 8 : 6) * sizeof(float) +
+                    size_t(hdr.n_faces) * 3 * sizeof(uint32_t) +
+                    size_t(hdr.n_faces) * 3 * sizeof(float);
+  if (cache.size() != expected) {
+    lg::i(TAG, "%s: truncated, ignoring it", cache_filename);
+    return false;
+  }
+
+  // is it still the cache of this very source?
+  uint64_t src_size;
+  int64_t src_mtime;
+  if (!sourceStamp(mesh_filename, src_size, src_mtime) ||
+      src_size != hdr.src_size) {
+    return false;
+  }
+  if (src_mtime != hdr.src_mtime) {
+    io::MappedFile src(mesh_filename);
+    if (!src.isOpen() || io::hashBytes(src.data(), src.size()) != hdr.src_hash) {
+      lg::i(TAG, "%s: out of date", cache_filename);
+      return false;
+    }
+    restampCache(cache_filename, cache.data(), cache.size(), hdr, src_mtime);
+  }
+
+  const char *p = cache.data() + sizeof(AgmHeader);
+
+  readArray(p, m_pos, hdr.n_verts);
+  readArray(p, m_norm, hdr.n_verts);
+  m_uv.resize(has_uv ? size_t(hdr.n_verts) * 2 : 0);
+  std::memcpy(m_uv.data(), p, m_uv.size() * sizeof(float));
+  p += m_uv.size() * sizeof(float);
+  m_authored_normals = hdr.flags & AGM_AUTHORED_NORMALS;
+
+  m_indices.resize(size_t(hdr.n_faces) * 3);
+  std::memcpy(m_indices.data(), p, m_indices.size() * sizeof(uint32_t));
+  p += m_indices.size() * sizeof(uint32_t);
+
+  readArray(p, m_face_normals, hdr.n_faces);
+
+  // a corrupted index would make us read out of the vertex array later
+  for (auto index : m_indices) {
+    if (index >= hdr.n_verts) {
+      lg::i(TAG, "%s: corrupted, ignoring it", cache_filename);
+      m_pos.resize(0);
+      m_norm.resize(0);
+      m_uv.clear();
+      m_indices.clear();
+      m_face_normals.resize(0);
+      return false;
+    }
+  }
+
+  bbmin = Point3(hdr.bbmin[0], hdr.bbmin[1], hdr.bbmin[2]);
+  bbmax = Point3(hdr.bbmax[0], hdr.bbmax[1], hdr.bbmax[2]);
+
+  return true;
+}
+
+// Dump the (initialized) mesh next to its source. Failures are not fatal:
+// the mesh will just be parsed again next time.
+void Mesh::writeCache(const char *cache_filename, const char *mesh_filename,
+                      uint64_t src_hash) const {
+  static const auto TAG = __func__;
+
+  AgmHeader hdr;
+  std::memcpy(hdr.magic, AGM_MAGIC, sizeof(AGM_MAGIC));
+  hdr.version = AGM_VERSION;
+  hdr.src_hash = src_hash;
+  hdr.n_verts = numVertices();
+  hdr.n_faces = numFaces();
+  hdr.bbmin[0] = bbmin.x;
+  hdr.bbmin[1] = bbmin.y;
+  hdr.bbmin[2] = bbmin.z;
+  hdr.bbmax[0] = bbmax.x;
+  hdr.bbmax[1] = bbmax.y;
+  hdr.bbmax[2] = bbmax.z;
+  hdr.flags = (hasTexCoords() ? AGM_TEXCOORDS : 0) |
+              (m_authored_normals ? AGM_AUTHORED_NORMALS : 0);
+  hdr.reserved = 0;
+
+  if (!sourceStamp(mesh_filename, hdr.src_size, hdr.src_mtime)) {
+    return;
+  }
+
+  // write to a temporary file and move it in place when complete, so that
+  // a crash never leaves a half-written cache behind
+  std::string tmp_filename = std::string(cache_filename) + ".tmp";
+  FILE *file = std::fopen(tmp_filename.c_str(), "wb");
+  if (!file) {
+    lg::i(TAG, "Cannot write mesh cache %s", cache_filename);
+    return;
+  }
+
+  bool ok = std::fwrite(&hdr, sizeof(hdr), 1, file) == 1;
+  ok = ok && writeArray(file, m_pos) && writeArray(file, m_norm);
+  ok = ok && std::fwrite(m_uv.data(), sizeof(float), m_uv.size(), file) ==
+                 m_uv.size();
+  ok = ok && std::fwrite(m_indices.data(), sizeof(uint32_t), m_indices.size(),
+                         file) == m_indices.size();
+  ok = ok && writeArray(file, m_face_normals);
+  ok = (std::fclose(file) == 0) && ok;
+
+  if (!ok || std::rename(tmp_filename.c_str(), cache_filename) != 0) {
+    lg::i(TAG, "Cannot write mesh cache %s", cache_filename);
+    std::remove(tmp_filename.c_str());
+    return;
+  }
+
+  lg::i(TAG, "Mesh cache written to %s", cache_filename);
+}
+
+} // namespace agl
@@ -0,0 +1,84 @@
+#ifndef _MESH_IO_H_
+#define _MESH_IO_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "agl.h"
+
+/*
+ * Internals of the mesh loader: read-only memory mapped files and the OBJ
+ * tokenizer used by agl::loadMesh.
+ * The game code should not need anything from here, use loadMesh instead.
+ */
+
+namespace agl {
+namespace io {
+
+// Maps a whole file in memory (read-only). The mapping is released
+// by the destructor.
+class MappedFile {
+private:
+  const char *m_data;
+  size_t m_size;
+  bool m_open;
+
+public:
+  explicit MappedFile(const char *filename);
+  virtual ~MappedFile();
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  inline bool isOpen() const { return m_open; }
+  inline const char *data() const { return m_data; }
+  inline const char *end() const { return m_data + m_size; }
+  inline size_t size() const { return m_size; }
+};
+
+// Raw content of an OBJ file, as produced by the tokenizer
+struct ObjData {
+  Vec3Array positions;          // "v" lines
+  std::vector<float> texcoords; // "vt" lines, u v
+  Vec3Array normals;            // "vn" lines
+  // three 0-based position indices per triangle. Polygons are already
+  // fan-triangulated, keeping the winding of the original loader (a, c, b).
+  std::vector<int32_t> tris;
+  // texture and normal indices of each entry of tris, -1 if the corner
+  // doesn't have one
+  std::vector<int32_t> tri_texcoords, tri_normals;
+  // entries of tris (tri_texcoords, tri_normals) holding an index relative
+  // to the first element of this chunk (negative OBJ indices): they must be
+  // rebased when merging chunks
+  std::vector<size_t> relative, relative_texcoords, relative_normals;
+};
+
+// Parses the OBJ text in [begin, end) in a single pass, appending to out.
+// Handles the v, v/t, v//n and v/t/n face syntaxes and negative (relative)
+// indices, reads vt and vn lines. Returns false (and logs the line) on malformed input.
+// file_begin is only used to report the line number of errors.
+bool parseObj(const char *begin, const char *end, ObjData &out,
+              const char *file_begin = nullptr);
+
+// Splits [begin, end) at line boundaries and parses the chunks on n_threads
+// worker threads (0 = one per core), then merges them into out rebasing the
+// indices. Small files are parsed on the calling thread.
+bool parseObjParallel(const char *begin, const char *end, ObjData &out,
+                      size_t n_threads = 0);
+
+// 64-bit FNV-1a hash of a memory block, used to validate the mesh cache
+uint64_t hashBytes(const char *data, size_t size);
+
+// path of the binary cache (.agm) sitting next to a mesh file
+std::string cachePath(const char *mesh_filename);
+
+// Bounding box stored in the cache header of a mesh, without loading it
+// (used as a placeholder while the mesh loads). False if there's no cache.
+bool cachedBounds(const char *mesh_filename, Point3 &min, Point3 &max);
+
+} // namespace io
+} // namespace agl
+
+#endif // _MESH_IO_H_
@@ -0,0 +1,397 @@
+#include "mesh_kernels.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AGL_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+ * SoA mesh kernels. See mesh_kernels.h
+ *
+ * Face normals need a gather (three indexed vertices per face): the lanes
+ * are filled from the index buffer, then cross product and normalization
+ * run 4 (SSE) or 8 (AVX) faces at a time. Normalization and bounding box
+ * stream straight over the x[], y[], z[] arrays.
+ * Accumulation is a scatter into the vertices around each face, which SIMD
+ * doesn't help with: it is shared by all the instruction sets.
+ *
+ * All versions perform the same float operations in the same order, so they
+ * give bit-identical results.
+ */
+
+namespace agl {
+namespace kernels {
+
+namespace {
+
+// ---- scalar ---- //
+
+inline void normalize3(float &x, float &y, float &z) {
+  float len = std::sqrt(x * x + y * y + z * z);
+  if (len > 0.0f) {
+    x /= len;
+    y /= len;
+    z /= len;
+  }
+}
+
+void faceNormalsScalar(const Vec3Array &pos, const uint32_t *idx, size_t begin,
+                       size_t end, Vec3Array &out) {
+  for (size_t f = begin; f < end; ++f) {
+    uint32_t a = idx[3 * f], b = idx[3 * f + 1], c = idx[3 * f + 2];
+
+    float e1x = pos.x[b] - pos.x[a], e1y = pos.y[b] - pos.y[a],
+          e1z = pos.z[b] - pos.z[a];
+    float e2x = pos.x[c] - pos.x[a], e2y = pos.y[c] - pos.y[a],
+          e2z = pos.z[c] - pos.z[a];
+
+    // negated cross product e1 x e2
+    float nx = -(e1y * e2z - e1z * e2y);
+    float ny = (e1x * e2z - e1z * e2x);
+    float nz = -(e1x * e2y - e1y * e2x);
+    normalize3(nx, ny, nz);
+
+    out.x[f] = nx;
+    out.y[f] = ny;
+    out.z[f] = nz;
+  }
+}
+
+void normalizeScalar(Vec3Array &v, size_t begin, size_t end) {
+  for (size_t i = begin; i < end; ++i) {
+    normalize3(v.x[i], v.y[i], v.z[i]);
+  }
+}
+
+void boundsScalar(const Vec3Array &p, size_t begin, size_t end, float min[3],
+                  float max[3]) {
+  for (size_t i = begin; i < end; ++i) {
+    min[0] = std::min(min[0], p.x[i]);
+    min[1] = std::min(min[1], p.y[i]);
+    min[2] = std::min(min[2], p.z[i]);
+    max[0] = std::max(max[0], p.x[i]);
+    max[1] = std::max(max[1], p.y[i]);
+    max[2] = std::max(max[2], p.z[i]);
+  }
+}
+
+#ifdef AGL_X86
+
+// ---- SSE: 4 lanes ---- //
+
+inline __m128 gather4(const float *v, const uint32_t *idx, size_t k) {
+  return _mm_set_ps(v[idx[9 + k]], v[idx[6 + k]], v[idx[3 + k]], v[idx[k]]);
+}
+
+// x / len where len > 0, x elsewhere
+inline __m128 safeDiv4(__m128 x, __m128 len, __m128 mask) {
+  return _mm_or_ps(_mm_and_ps(mask, _mm_div_ps(x, len)),
+                   _mm_andnot_ps(mask, x));
+}
+
+void faceNormalsSSE(const Vec3Array &pos, const uint32_t *idx, size_t n_faces,
+                    Vec3Array &out) {
+  const __m128 sign = _mm_set1_ps(-0.0f);
+  size_t f = 0;
+  for (; f + 4 <= n_faces; f += 4) {
+    const uint32_t *i = idx + 3 * f;
+    __m128 ax = gather4(pos.x.data(), i, 0), bx = gather4(pos.x.data(), i, 1),
+           cx = gather4(pos.x.data(), i, 2);
+    __m128 ay = gather4(pos.y.data(), i, 0), by = gather4(pos.y.data(), i, 1),
+           cy = gather4(pos.y.data(), i, 2);
+    __m128 az = gather4(pos.z.data(), i, 0), bz = gather4(pos.z.data(), i, 1),
+           cz = gather4(pos.z.data(), i, 2);
+
+    __m128 e1x = _mm_sub_ps(bx, ax), e1y = _mm_sub_ps(by, ay),
+           e1z = _mm_sub_ps(bz, az);
+    __m128 e2x = _mm_sub_ps(cx, ax), e2y = _mm_sub_ps(cy, ay),
+           e2z = _mm_sub_ps(cz, az);
+
+    __m128 nx = _mm_xor_ps(
+        sign, _mm_sub_ps(_mm_mul_ps(e1y, e2z), _mm_mul_ps(e1z, e2y)));
+    __m128 ny = _mm_sub_ps(_mm_mul_ps(e1x, e2z), _mm_mul_ps(e1z, e2x));
+    __m128 nz = _mm_xor_ps(
+        sign, _mm_sub_ps(_mm_mul_ps(e1x, e2y), _mm_mul_ps(e1y, e2x)));
+
+    __m128 len = _mm_sqrt_ps(
+        _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)),
+                   _mm_mul_ps(nz, nz)));
+    __m128 mask = _mm_cmpgt_ps(len, _mm_setzero_ps());
+
+    _mm_storeu_ps(out.x.data() + f, safeDiv4(nx, len, mask));
+    _mm_storeu_ps(out.y.data() + f, safeDiv4(ny, len, mask));
+    _mm_storeu_ps(out.z.data() + f, safeDiv4(nz, len, mask));
+  }
+  faceNormalsScalar(pos, idx, f, n_faces, out);
+}
+
+void normalizeSSE(Vec3Array &v) {
+  size_t i = 0, n = v.size();
+  for (; i + 4 <= n; i += 4) {
+    __m128 x = _mm_loadu_ps(v.x.data() + i), y = _mm_loadu_ps(v.y.data() + i),
+           z = _mm_loadu_ps(v.z.data() + i);
+    __m128 len = _mm_sqrt_ps(_mm_add_ps(
+        _mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z)));
+    __m128 mask = _mm_cmpgt_ps(len, _mm_setzero_ps());
+
+    _mm_storeu_ps(v.x.data() + i, safeDiv4(x, len, mask));
+    _mm_storeu_ps(v.y.data() + i, safeDiv4(y, len, mask));
+    _mm_storeu_ps(v.z.data() + i, safeDiv4(z, len, mask));
+  }
+  normalizeScalar(v, i, n);
+}
+
+void boundsSSE(const Vec3Array &p, float min[3], float max[3]) {
+  __m128 minx = _mm_set1_ps(INFINITY), miny = minx, minz = minx;
+  __m128 maxx = _mm_set1_ps(-INFINITY), maxy = maxx, maxz = maxx;
+
+  size_t i = 0, n = p.size();
+  for (; i + 4 <= n; i += 4) {
+    __m128 x = _mm_loadu_ps(p.x.data() + i), y = _mm_loadu_ps(p.y.data() + i),
+           z = _mm_loadu_ps(p.z.data() + i);
+    minx = _mm_min_ps(minx, x);
+    miny = _mm_min_ps(miny, y);
+    minz = _mm_min_ps(minz, z);
+    maxx = _mm_max_ps(maxx, x);
+    maxy = _mm_max_ps(maxy, y);
+    maxz = _mm_max_ps(maxz, z);
+  }
+
+  // horizontal reduction of the 4 lanes
+  alignas(16) float lanes[6][4];
+  _mm_store_ps(lanes[0], minx);
+  _mm_store_ps(lanes[1], miny);
+  _mm_store_ps(lanes[2], minz);
+  _mm_store_ps(lanes[3], maxx);
+  _mm_store_ps(lanes[4], maxy);
+  _mm_store_ps(lanes[5], maxz);
+  for (size_t k = 0; k < 3; ++k) {
+    min[k] = *std::min_element(lanes[k], lanes[k] + 4);
+    max[k] = *std::max_element(lanes[3 + k], lanes[3 + k] + 4);
+  }
+
+  boundsScalar(p, i, n, min, max);
+}
+
+// ---- AVX: 8 lanes, compiled for AVX and only called if supported ---- //
+
+#define AGL_AVX __attribute__((target("avx")))
+
+AGL_AVX inline __m256 gather8(const float *v, const uint32_t *idx, size_t k) {
+  return _mm256_set_ps(v[idx[21 + k]], v[idx[18 + k]], v[idx[15 + k]],
+                       v[idx[12 + k]], v[idx[9 + k]], v[idx[6 + k]],
+                       v[idx[3 + k]], v[idx[k]]);
+}
+
+AGL_AVX inline __m256 safeDiv8(__m256 x, __m256 len, __m256 mask) {
+  return _mm256_blendv_ps(x, _mm256_div_ps(x, len), mask);
+}
+
+AGL_AVX void faceNormalsAVX(const Vec3Array &pos, const uint32_t *idx,
+                            size_t n_faces, Vec3Array &out) {
+  const __m256 sign = _mm256_set1_ps(-0.0f);
+  size_t f = 0;
+  for (; f + 8 <= n_faces; f += 8) {
+    const uint32_t *i = idx + 3 * f;
+    __m256 ax = gather8(pos.x.data(), i, 0), bx = gather8(pos.x.data(), i, 1),
+           cx = gather8(pos.x.data(), i, 2);
+    __m256 ay = gather8(pos.y.data(), i, 0), by = gather8(pos.y.data(), i, 1),
+           cy = gather8(pos.y.data(), i, 2);
+    __m256 az = gather8(pos.z.data(), i, 0), bz = gather8(pos.z.data(), i, 1),
+           cz = gather8(pos.z.data(), i, 2);
+
+    __m256 e1x = _mm256_sub_ps(bx, ax), e1y = _mm256_sub_ps(by, ay),
+           e1z = _mm256_sub_ps(bz, az);
+    __m256 e2x = _mm256_sub_ps(cx, ax), e2y = _mm256_sub_ps(cy, ay),
+           e2z = _mm256_sub_ps(cz, az);
+
+    __m256 nx = _mm256_xor_ps(
+        sign, _mm256_sub_ps(_mm256_mul_ps(e1y, e2z), _mm256_mul_ps(e1z, e2y)));
+    __m256 ny = _mm256_sub_ps(_mm256_mul_ps(e1x, e2z), _mm256_mul_ps(e1z, e2x));
+    __m256 nz = _mm256_xor_ps(
+        sign, _mm256_sub_ps(_mm256_mul_ps(e1x, e2y), _mm256_mul_ps(e1y, e2x)));
+
+    __m256 len = _mm256_sqrt_ps(_mm256_add_ps(
+        _mm256_add_ps(_mm256_mul_ps(nx, nx), _mm256_mul_ps(ny, ny)),
+        _mm256_mul_ps(nz, nz)));
+    __m256 mask = _mm256_cmp_ps(len, _mm256_setzero_ps(), _CMP_GT_OQ);
+
+    _mm256_storeu_ps(out.x.data() + f, safeDiv8(nx, len, mask));
+    _mm256_storeu_ps(out.y.data() + f, safeDiv8(ny, len, mask));
+    _mm256_storeu_ps(out.z.data() + f, safeDiv8(nz, len, mask));
+  }
+  faceNormalsScalar(pos, idx, f, n_faces, out);
+}
+
+AGL_AVX void normalizeAVX(Vec3Array &v) {
+  size_t i = 0, n = v.size();
+  for (; i + 8 <= n; i += 8) {
+    __m256 x = _mm256_loadu_ps(v.x.data() + i),
+           y = _mm256_loadu_ps(v.y.data() + i),
+           z = _mm256_loadu_ps(v.z.data() + i);
+    __m256 len = _mm256_sqrt_ps(
+        _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)),
+                      _mm256_mul_ps(z, z)));
+    __m256 mask = _mm256_cmp_ps(len, _mm256_setzero_ps(), _CMP_GT_OQ);
+
+    _mm256_storeu_ps(v.x.data() + i, safeDiv8(x, len, mask));
+    _mm256_storeu_ps(v.y.data() + i, safeDiv8(y, len, mask));
+    _mm256_storeu_ps(v.z.data() + i, safeDiv8(z, len, mask));
+  }
+  normalizeScalar(v, i, n);
+}
+
+AGL_AVX void boundsAVX(const Vec3Array &p, float min[3], float max[3]) {
+  __m256 minx = _mm256_set1_ps(INFINITY), miny = minx, minz = minx;
+  __m256 maxx = _mm256_set1_ps(-INFINITY), maxy = maxx, maxz = maxx;
+
+  size_t i = 0, n = p.size();
+  for (; i + 8 <= n; i += 8) {
+    __m256 x = _mm256_loadu_ps(p.x.data() + i),
+           y = _mm256_loadu_ps(p.y.data() + i),
+           z = _mm256_loadu_ps(p.z.data() + i);
+    minx = _mm256_min_ps(minx, x);
+    miny = _mm256_min_ps(miny, y);
+    minz = _mm256_min_ps(minz, z);
+    maxx = _mm256_max_ps(maxx, x);
+    maxy = _mm256_max_ps(maxy, y);
+    maxz = _mm256_max_ps(maxz, z);
+  }
+
+  alignas(32) float lanes[6][8];
+  _mm256_store_ps(lanes[0], minx);
+  _mm256_store_ps(lanes[1], miny);
+  _mm256_store_ps(lanes[2], minz);
+  _mm256_store_ps(lanes[3], maxx);
+  _mm256_store_ps(lanes[4], maxy);
+  _mm256_store_ps(lanes[5], maxz);
+  for (size_t k = 0; k < 3; ++k) {
+    min[k] = *std::min_element(lanes[k], lanes[k] + 8);
+    max[k] = *std::max_element(lanes[3 + k], lanes[3 + k] + 8);
+  }
+
+  boundsScalar(p, i, n, min, max);
+}
+
+#endif // AGL_X86
+
+Isa detectIsa() {
+#ifdef AGL_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx")) {
+    return AVX;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return SSE;
+  }
+#endif
+  return SCALAR;
+}
+
+Isa s_isa = detectIsa();
+
+} // namespace
+
+Isa bestIsa() { return detectIsa(); }
+
+Isa currentIsa() { return s_isa; }
+
+bool setIsa(Isa isa) {
+  if (isa >= N_ISA || isa > bestIsa()) {
+    return false;
+  }
+  s_isa = isa;
+  return true;
+}
+
+const char *isaName(Isa isa) {
+  switch (isa) {
+  case SCALAR:
+    return "scalar";
+  case SSE:
+    return "sse";
+  case AVX:
+    return "avx";
+  default:
+    return "unknown";
+  }
+}
+
+void faceNormals(const Vec3Array &pos, const uint32_t *indices, size_t n_faces,
+                 Vec3Array &out) {
+  switch (s_isa) {
+#ifdef AGL_X86
+  case AVX:
+    faceNormalsAVX(pos, indices, n_faces, out);
+    break;
+  case SSE:
+    faceNormalsSSE(pos, indices, n_faces, out);
+    break;
+#endif
+  default:
+    faceNormalsScalar(pos, indices, 0, n_faces, out);
+    break;
+  }
+}
+
+void accumulateNormals(const Vec3Array &face_normals, const uint32_t *indices,
+                       size_t n_faces, Vec3Array &out) {
+  std::fill(out.x.begin(), out.x.end(), 0.0f);
+  std::fill(out.y.begin(), out.y.end(), 0.0f);
+  std::fill(out.z.begin(), out.z.end(), 0.0f);
+
+  for (size_t f = 0; f < n_faces; ++f) {
+    float nx = face_normals.x[f], ny = face_normals.y[f],
+          nz = face_normals.z[f];
+    for (size_t k = 0; k < 3; ++k) {
+      uint32_t v = indices[3 * f + k];
+      out.x[v] += nx;
+      out.y[v] += ny;
+      out.z[v] += nz;
+    }
+  }
+}
+
+void normalize(Vec3Array &vecs) {
+  switch (s_isa) {
+#ifdef AGL_X86
+  case AVX:
+    normalizeAVX(vecs);
+    break;
+  case SSE:
+    normalizeSSE(vecs);
+    break;
+#endif
+  default:
+    normalizeScalar(vecs, 0, vecs.size());
+    break;
+  }
+}
+
+void bounds(const Vec3Array &pos, Point3 &min, Point3 &max) {
+  float lo[3] = {INFINITY, INFINITY, INFINITY};
+  float hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+
+  switch (s_isa) {
+#ifdef AGL_X86
+  case AVX:
+    boundsAVX(pos, lo, hi);
+    break;
+  case SSE:
+    boundsSSE(pos, lo, hi);
+    break;
+#endif
+  default:
+    boundsScalar(pos, 0, pos.size(), lo, hi);
+    break;
+  }
+
+  min = Point3(lo[0], lo[1], lo[2]);
+  max = Point3(hi[0], hi[1], hi[2]);
+}
+
+} // namespace kernels
+} // namespace agl
@@ -0,0 +1,47 @@
+#ifndef _MESH_KERNELS_H_
+#define _MESH_KERNELS_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "agl.h"
+
+/*
+ * Data-parallel kernels working on the structure-of-arrays mesh layout
+ * (see agl::Vec3Array). Each one has a scalar, an SSE and an AVX version:
+ * the best one supported by the CPU is selected at startup, setIsa() can
+ * force another one (used by the benchmarks).
+ */
+
+namespace agl {
+namespace kernels {
+
+enum Isa { SCALAR, SSE, AVX, N_ISA };
+
+// best instruction set available on this CPU
+Isa bestIsa();
+// currently used instruction set
+Isa currentIsa();
+// select the kernels to use. False if the CPU doesn't support them.
+bool setIsa(Isa isa);
+const char *isaName(Isa isa);
+
+// out[f] = normalized, negated cross product of the edges of triangle f.
+// Degenerate triangles get a zero normal. out must hold n_faces elements.
+void faceNormals(const Vec3Array &pos, const uint32_t *indices, size_t n_faces,
+                 Vec3Array &out);
+
+// out[v] = sum of the normals of the faces around v (out is zeroed first)
+void accumulateNormals(const Vec3Array &face_normals, const uint32_t *indices,
+                       size_t n_faces, Vec3Array &out);
+
+// normalize every vector in place, zero-length ones are left untouched
+void normalize(Vec3Array &vecs);
+
+// component-wise minimum and maximum of all the points
+void bounds(const Vec3Array &pos, Point3 &min, Point3 &max);
+
+} // namespace kernels
+} // namespace agl
+
+#endif // _MESH_KERNELS_H_
@@ -0,0 +1,533 @@
+#include "mesh_opt.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <queue>
+#include <unordered_map>
+
+/*
+ * Vertex cache optimization. See mesh_opt.h
+ *
+ * reorderFaces is Tom Forsyth's "Linear-Speed Vertex Cache Optimisation":
+ * every vertex gets a score from its position in a simulated LRU cache and
+ * from the number of triangles still using it, every triangle the sum of the
+ * scores of its vertices. The triangle with the best score among the ones
+ * touching the cache is emitted next; when none is left (the cache is a dead
+ * end) the next triangle in input order is taken.
+ */
+
+namespace agl {
+namespace opt {
+
+namespace {
+
+const size_t MAX_CACHE = 32;
+const float CACHE_DECAY_POWER = 1.5f;
+const float LAST_TRI_SCORE = 0.75f;
+const float VALENCE_BOOST_SCALE = 2.0f;
+const float VALENCE_BOOST_POWER = 0.5f;
+// vertices used by more triangles than this all get the same valence boost
+const size_t MAX_VALENCE = 32;
+
+const uint32_t NONE = UINT32_MAX;
+
+// scores, indexed by [cache position + 1][remaining triangles]
+struct ScoreTable {
+  float score[MAX_CACHE + 1][MAX_VALENCE + 1];
+
+  ScoreTable() {
+    for (size_t pos = 0; pos <= MAX_CACHE; ++pos) {
+      for (size_t live = 0; live <= MAX_VALENCE; ++live) {
+        score[pos][live] = compute(int(pos) - 1, live);
+      }
+    }
+  }
+
+  static float compute(int cache_pos, size_t live) {
+    if (live == 0) {
+      // no triangle needs it anymore
+      return -1.0f;
+    }
+
+    float score = 0.0f;
+    if (cache_pos >= 3) {
+      float scaler = 1.0f / (MAX_CACHE - 3);
+      score = std::pow(1.0f - (cache_pos - 3) * scaler, CACHE_DECAY_POWER);
+    } else if (cache_pos >= 0) {
+      // used by the last triangle: fixed score, so that strips are not
+      // favoured over other orderings
+      score = LAST_TRI_SCORE;
+    }
+
+    // bonus for vertices with few triangles left, to get rid of them
+    return score +
+           VALENCE_BOOST_SCALE * std::pow(float(live), -VALENCE_BOOST_POWER);
+  }
+
+  inline float operator()(int cache_pos, size_t live) const {
+    return score[cache_pos + 1][std::min(live, MAX_VALENCE)];
+  }
+};
+
+} // namespace
+
+double acmr(const uint32_t *indices, size_t n_indices, size_t cache_size) {
+  if (n_indices < 3) {
+    return 0.0;
+  }
+
+  // with a FIFO a vertex is still cached if less than cache_size misses
+  // happened since it was loaded
+  uint32_t max_index = *std::max_element(indices, indices + n_indices);
+  std::vector<size_t> loaded_at(size_t(max_index) + 1, 0);
+  size_t misses = 0;
+
+  for (size_t i = 0; i < n_indices; ++i) {
+    size_t &stamp = loaded_at[indices[i]];
+    if (stamp == 0 || misses - stamp >= cache_size) {
+      stamp = ++misses;
+    }
+  }
+
+  return double(misses) / (n_indices / 3);
+}
+
+void reorderFaces(uint32_t *indices, size_t n_indices, size_t n_verts) {
+  static const ScoreTable vertexScore;
+
+  size_t n_tris = n_indices / 3;
+  if (n_tris == 0) {
+    return;
+  }
+
+  // vertex -> triangles adjacency (compressed rows). The first live[v]
+  // entries of each row are the triangles not yet emitted.
+  std::vector<uint32_t> live(n_verts, 0);
+  for (size_t i = 0; i < 3 * n_tris; ++i) {
+    ++live[indices[i]];
+  }
+  std::vector<uint32_t> offset(n_verts + 1, 0);
+  for (size_t v = 0; v < n_verts; ++v) {
+    offset[v + 1] = offset[v] + live[v];
+  }
+  std::vector<uint32_t> adjacency(3 * n_tris);
+  {
+    std::vector<uint32_t> fill(offset.begin(), offset.end() - 1);
+    for (size_t i = 0; i < 3 * n_tris; ++i) {
+      adjacency[fill[indices[i]]++] = i / 3;
+    }
+  }
+
+  std::vector<int32_t> cache_pos(n_verts, -1);
+  std::vector<float> vert_score(n_verts);
+  for (size_t v = 0; v < n_verts; ++v) {
+    vert_score[v] = vertexScore(-1, live[v]);
+  }
+  std::vector<float> tri_score(n_tris, 0.0f);
+  for (size_t i = 0; i < 3 * n_tris; ++i) {
+    tri_score[i / 3] += vert_score[indices[i]];
+  }
+
+  std::vector<bool> emitted(n_tris, false);
+  std::vector<uint32_t> out;
+  out.reserve(3 * n_tris);
+
+  uint32_t cache[MAX_CACHE + 3];
+  uint32_t new_cache[MAX_CACHE + 3];
+  size_t cache_size = 0;
+
+  size_t next_in_order = 0;
+  uint32_t best = NONE;
+
+  while (out.size() < 3 * n_tris) {
+    if (best == NONE) {
+      while (emitted[next_in_order]) {
+        ++next_in_order;
+      }
+      best = next_in_order;
+    }
+
+    const uint32_t *tri = indices + 3 * best;
+    emitted[best] = true;
+    out.insert(out.end(), tri, tri + 3);
+
+    // the triangle is not live anymore for its vertices
+    for (size_t k = 0; k < 3; ++k) {
+      uint32_t *row = adjacency.data() + offset[tri[k]];
+      uint32_t &n_live = live[tri[k]];
+      std::swap(*std::find(row, row + n_live, best), row[n_live - 1]);
+      --n_live;
+    }
+
+    // LRU: the vertices of the triangle go on top of the cache
+    size_t new_size = 0;
+    for (size_t k = 0; k < 3; ++k) {
+      if (std::find(new_cache, new_cache + new_size, tri[k]) ==
+          new_cache + new_size) {
+        new_cache[new_size++] = tri[k];
+      }
+    }
+    for (size_t i = 0; i < cache_size; ++i) {
+      if (cache[i] != tri[0] && cache[i] != tri[1] && cache[i] != tri[2]) {
+        new_cache[new_size++] = cache[i];
+      }
+    }
+
+    // update the scores of the vertices that moved (or fell out of the
+    // cache) and of their triangles
+    for (size_t i = 0; i < new_size; ++i) {
+      uint32_t v = new_cache[i];
+      cache_pos[v] = i < MAX_CACHE ? int32_t(i) : -1;
+
+      float score = vertexScore(cache_pos[v], live[v]);
+      float delta = score - vert_score[v];
+      vert_score[v] = score;
+
+      const uint32_t *row = adjacency.data() + offset[v];
+      for (size_t j = 0; j < live[v]; ++j) {
+        tri_score[row[j]] += delta;
+      }
+    }
+
+    // next one: the best triangle touching the cache
+    float best_score = -INFINITY;
+    best = NONE;
+    for (size_t i = 0; i < std::min(new_size, MAX_CACHE); ++i) {
+      uint32_t v = new_cache[i];
+      const uint32_t *row = adjacency.data() + offset[v];
+      for (size_t j = 0; j < live[v]; ++j) {
+        if (tri_score[row[j]] > best_score) {
+          best_score = tri_score[row[j]];
+          best = row[j];
+        }
+      }
+    }
+
+    cache_size = std::min(new_size, MAX_CACHE);
+    std::copy(new_cache, new_cache + cache_size, cache);
+  }
+
+  std::copy(out.begin(), out.end(), indices);
+}
+
+void reorderVertices(uint32_t *indices, size_t n_indices, size_t n_verts,
+                     std::vector<uint32_t> &remap) {
+  remap.assign(n_verts, NONE);
+
+  uint32_t next = 0;
+  for (size_t i = 0; i < n_indices; ++i) {
+    uint32_t &v = remap[indices[i]];
+    if (v == NONE) {
+      v = next++;
+    }
+    indices[i] = v;
+  }
+
+  for (auto &v : remap) {
+    if (v == NONE) {
+      v = next++;
+    }
+  }
+}
+
+namespace {
+
+// weight of the planes keeping open borders in place
+const double BORDER_WEIGHT = 1000.0;
+
+// Symmetric 4x4 matrix: sum of the (squared) distances from a set of planes
+struct Quadric {
+  // a00 a01 a02 a03 a11 a12 a13 a22 a23 a33
+  double a[10] = {};
+
+  // plane n.p + d = 0, n unit length
+  void addPlane(double nx, double ny, double nz, double d, double w) {
+    a[0] += w * nx * nx;
+    a[1] += w * nx * ny;
+    a[2] += w * nx * nz;
+    a[3] += w * nx * d;
+    a[4] += w * ny * ny;
+    a[5] += w * ny * nz;
+    a[6] += w * ny * d;
+    a[7] += w * nz * nz;
+    a[8] += w * nz * d;
+    a[9] += w * d * d;
+  }
+
+  Quadric &operator+=(const Quadric &o) {
+    for (size_t i = 0; i < 10; ++i) {
+      a[i] += o.a[i];
+    }
+    return *this;
+  }
+
+  double error(double x, double y, double z) const {
+    return a[0] * x * x + 2 * a[1] * x * y + 2 * a[2] * x * z + 2 * a[3] * x +
+           a[4] * y * y + 2 * a[5] * y * z + 2 * a[6] * y + a[7] * z * z +
+           2 * a[8] * z + a[9];
+  }
+
+  // point of minimum error (Cramer's rule). False if the matrix is singular,
+  // e.g. all the planes are parallel.
+  bool optimum(double &x, double &y, double &z) const {
+    double det = a[0] * (a[4] * a[7] - a[5] * a[5]) -
+                 a[1] * (a[1] * a[7] - a[5] * a[2]) +
+                 a[2] * (a[1] * a[5] - a[4] * a[2]);
+    if (std::fabs(det) < 1e-12) {
+      return false;
+    }
+
+    double bx = -a[3], by = -a[6], bz = -a[8];
+    x = (bx * (a[4] * a[7] - a[5] * a[5]) - a[1] * (by * a[7] - a[5] * bz) +
+         a[2] * (by * a[5] - a[4] * bz)) /
+        det;
+    y = (a[0] * (by * a[7] - a[5] * bz) - bx * (a[1] * a[7] - a[5] * a[2]) +
+         a[2] * (a[1] * bz - by * a[2])) /
+        det;
+    z = (a[0] * (a[4] * bz - by * a[5]) - a[1] * (a[1] * bz - by * a[2]) +
+         bx * (a[1] * a[5] - a[4] * a[2])) /
+        det;
+    return true;
+  }
+};
+
+struct Collapse {
+  double cost;
+  uint32_t v0, v1; // v1 collapses into v0
+  uint32_t s0, s1; // stamps of v0 and v1: stale if they changed since
+  float x, y, z;   // new position of v0
+
+  bool operator>(const Collapse &o) const { return cost > o.cost; }
+};
+
+// (unnormalized) normal of a triangle
+Point3 triNormal(const Point3 &a, const Point3 &b, const Point3 &c) {
+  return (b - a) % (c - a);
+}
+
+inline float dot(const Point3 &a, const Point3 &b) {
+  return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+} // namespace
+
+void simplify(const Vec3Array &in_pos, const std::vector<uint32_t> &indices,
+              size_t target_faces, Vec3Array &out_pos,
+              std::vector<uint32_t> &out_indices,
+              std::vector<uint32_t> *origin) {
+  size_t n_verts = in_pos.size();
+  size_t n_faces = indices.size() / 3;
+
+  std::vector<Point3> pos(n_verts);
+  for (size_t v = 0; v < n_verts; ++v) {
+    pos[v] = in_pos.at(v);
+  }
+  std::vector<uint32_t> tris(indices.begin(), indices.begin() + 3 * n_faces);
+  std::vector<bool> face_alive(n_faces, true);
+  std::vector<bool> vert_alive(n_verts, true);
+  std::vector<uint32_t> stamp(n_verts, 0);
+
+  // vertex -> faces. Dead faces are skipped, not removed.
+  std::vector<std::vector<uint32_t>> vert_faces(n_verts);
+  for (size_t i = 0; i < 3 * n_faces; ++i) {
+    vert_faces[tris[i]].push_back(i / 3);
+  }
+
+  // quadrics of the planes of the faces around each vertex, area weighted
+  std::vector<Quadric> quadrics(n_verts);
+  std::unordered_map<uint64_t, uint32_t> edge_faces;
+  auto edgeKey = [](uint32_t a, uint32_t b) {
+    return a < b ? (uint64_t(a) << 32) | b : (uint64_t(b) << 32) | a;
+  };
+  for (size_t f = 0; f < n_faces; ++f) {
+    const uint32_t *t = &tris[3 * f];
+    Point3 n = triNormal(pos[t[0]], pos[t[1]], pos[t[2]]);
+    double area = 0.5 * std::sqrt(dot(n, n));
+    if (area > 0.0) {
+      n = n.normalize();
+      double d = -dot(n, pos[t[0]]);
+      for (size_t k = 0; k < 3; ++k) {
+        quadrics[t[k]].addPlane(n.x, n.y, n.z, d, area);
+      }
+    }
+    for (size_t k = 0; k < 3; ++k) {
+      ++edge_faces[edgeKey(t[k], t[(k + 1) % 3])];
+    }
+  }
+
+  // open borders: a plane through the border edge, orthogonal to its face,
+  // with a big weight keeps the vertices on the border
+  for (size_t f = 0; f < n_faces; ++f) {
+    const uint32_t *t = &tris[3 * f];
+    Point3 n = triNormal(pos[t[0]], pos[t[1]], pos[t[2]]);
+    for (size_t k = 0; k < 3; ++k) {
+      uint32_t a = t[k], b = t[(k + 1) % 3];
+      if (edge_faces[edgeKey(a, b)] != 1) {
+        continue;
+      }
+      Point3 edge = pos[b] - pos[a];
+      Point3 side = edge % n;
+      double len2 = dot(side, side);
+      if (len2 <= 0.0) {
+        continue;
+      }
+      side = side.normalize();
+      double d = -dot(side, pos[a]);
+      double w = BORDER_WEIGHT * dot(edge, edge);
+      quadrics[a].addPlane(side.x, side.y, side.z, d, w);
+      quadrics[b].addPlane(side.x, side.y, side.z, d, w);
+    }
+  }
+
+  std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>>
+      heap;
+  auto pushEdge = [&](uint32_t v0, uint32_t v1) {
+    Quadric q = quadrics[v0];
+    q += quadrics[v1];
+
+    // the midpoint, unless something better is found (all the errors can
+    // be NaN or inf on degenerate quadrics)
+    Point3 mid = (pos[v0] + pos[v1]) / 2.0f;
+    double x = mid.x, y = mid.y, z = mid.z;
+    if (!q.optimum(x, y, z)) {
+      // the best among the two ends and the midpoint
+      Point3 candidates[3] = {pos[v0], pos[v1], mid};
+      double best = INFINITY;
+      for (const auto &c : candidates) {
+        double err = q.error(c.x, c.y, c.z);
+        if (err < best) {
+          best = err;
+          x = c.x;
+          y = c.y;
+          z = c.z;
+        }
+      }
+    }
+
+    heap.push({std::max(0.0, q.error(x, y, z)), v0, v1, stamp[v0], stamp[v1],
+               float(x), float(y), float(z)});
+  };
+
+  for (const auto &edge : edge_faces) {
+    uint32_t a = edge.first >> 32, b = edge.first & 0xffffffff;
+    if (a != b) {
+      pushEdge(a, b);
+    }
+  }
+  edge_faces.clear();
+
+  // would moving v0 and v1 to p flip (or collapse) any surviving face?
+  auto flips = [&](uint32_t v0, uint32_t v1, const Point3 &p) {
+    for (uint32_t v : {v0, v1}) {
+      for (uint32_t f : vert_faces[v]) {
+        if (!face_alive[f]) {
+          continue;
+        }
+        const uint32_t *t = &tris[3 * f];
+        bool has0 = t[0] == v0 || t[1] == v0 || t[2] == v0;
+        bool has1 = t[0] == v1 || t[1] == v1 || t[2] == v1;
+        if (has0 && has1) {
+          continue; // it will be removed
+        }
+
+        Point3 p_old[3], p_new[3];
+        for (size_t k = 0; k < 3; ++k) {
+          p_old[k] = pos[t[k]];
+          p_new[k] = t[k] == v ? p : pos[t[k]];
+        }
+        Point3 n_old = triNormal(p_old[0], p_old[1], p_old[2]);
+        Point3 n_new = triNormal(p_new[0], p_new[1], p_new[2]);
+        if (dot(n_old, n_new) <= 0.0f) {
+          return true;
+        }
+      }
+    }
+    return false;
+  };
+
+  size_t alive = n_faces;
+  std::vector<uint32_t> neighbours;
+  while (alive > target_faces && !heap.empty()) {
+    Collapse c = heap.top();
+    heap.pop();
+
+    if (!vert_alive[c.v0] || !vert_alive[c.v1] || c.s0 != stamp[c.v0] ||
+        c.s1 != stamp[c.v1]) {
+      continue; // stale
+    }
+
+    Point3 p(c.x, c.y, c.z);
+    if (flips(c.v0, c.v1, p)) {
+      continue;
+    }
+
+    // v1 goes into v0
+    pos[c.v0] = p;
+    quadrics[c.v0] += quadrics[c.v1];
+    vert_alive[c.v1] = false;
+    ++stamp[c.v0];
+
+    for (uint32_t f : vert_faces[c.v1]) {
+      if (!face_alive[f]) {
+        continue;
+      }
+      uint32_t *t = &tris[3 * f];
+      if (t[0] == c.v0 || t[1] == c.v0 || t[2] == c.v0) {
+        face_alive[f] = false;
+        --alive;
+        continue;
+      }
+      for (size_t k = 0; k < 3; ++k) {
+        t[k] = t[k] == c.v1 ? c.v0 : t[k];
+      }
+      vert_faces[c.v0].push_back(f);
+    }
+    vert_faces[c.v1].clear();
+
+    // new costs for the edges around v0
+    neighbours.clear();
+    for (uint32_t f : vert_faces[c.v0]) {
+      if (!face_alive[f]) {
+        continue;
+      }
+      for (size_t k = 0; k < 3; ++k) {
+        uint32_t w = tris[3 * f + k];
+        if (w != c.v0 &&
+            std::find(neighbours.begin(), neighbours.end(), w) ==
+                neighbours.end()) {
+          neighbours.push_back(w);
+          pushEdge(c.v0, w);
+        }
+      }
+    }
+  }
+
+  // compact what's left
+  std::vector<uint32_t> remap(n_verts, NONE);
+  out_pos.resize(0);
+  out_indices.clear();
+  if (origin) {
+    origin->clear();
+  }
+  for (size_t f = 0; f < n_faces; ++f) {
+    if (!face_alive[f]) {
+      continue;
+    }
+    for (size_t k = 0; k < 3; ++k) {
+      uint32_t &v = remap[tris[3 * f + k]];
+      if (v == NONE) {
+        v = out_pos.size();
+        const Point3 &q = pos[tris[3 * f + k]];
+        out_pos.push_back(q.x, q.y, q.z);
+        if (origin) {
+          origin->push_back(tris[3 * f + k]);
+        }
+      }
+      out_indices.push_back(v);
+    }
+  }
+}
+
+} // namespace opt
+} // namespace agl
@@ -0,0 +1,52 @@
+#ifndef _MESH_OPT_H_
+#define _MESH_OPT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "agl.h"
+
+/*
+ * Load-time optimization of indexed triangle lists: triangle and vertex order
+ * for the post-transform vertex cache and for vertex fetch, simplification
+ * for the levels of detail.
+ */
+
+namespace agl {
+namespace opt {
+
+// entries of the simulated FIFO cache used to measure the ACMR
+const size_t ACMR_CACHE_SIZE = 16;
+
+// Average Cache Miss Ratio: vertices transformed per triangle with a FIFO
+// post-transform cache of cache_size entries. 3 is the worst case, ~0.5-0.7
+// is the best a regular grid can do.
+double acmr(const uint32_t *indices, size_t n_indices,
+            size_t cache_size = ACMR_CACHE_SIZE);
+
+// Reorder the triangles for vertex cache locality (Tom Forsyth's linear-speed
+// algorithm). The vertex indices of each triangle keep their winding.
+void reorderFaces(uint32_t *indices, size_t n_indices, size_t n_verts);
+
+// Renumber the vertices in order of first use by the index buffer, so that
+// vertex fetch walks memory sequentially. Unused vertices go last.
+// remap[old] = new; the vertex arrays have to be permuted accordingly.
+void reorderVertices(uint32_t *indices, size_t n_indices, size_t n_verts,
+                     std::vector<uint32_t> &remap);
+
+// Quadric error metric simplification (Garland & Heckbert): the edge whose
+// collapse moves the surface the least is collapsed first, until at most
+// target_faces triangles are left (or nothing can be collapsed anymore).
+// Collapses flipping a triangle are refused, open borders are preserved.
+// If origin is given, (*origin)[v] is the input vertex that output vertex v
+// comes from, to carry over the other vertex attributes.
+void simplify(const Vec3Array &pos, const std::vector<uint32_t> &indices,
+              size_t target_faces, Vec3Array &out_pos,
+              std::vector<uint32_t> &out_indices,
+              std::vector<uint32_t> *origin = nullptr);
+
+} // namespace opt
+} // namespace agl
+
+#endif // _MESH_OPT_H_
@@ -0,0 +1,80 @@
+#ifndef _MESH_QUANT_H_
+#define _MESH_QUANT_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "agl.h"
+
+/*
+ * Compressed vertex format (see Mesh::quantize):
+ *  - positions: 16 bit unsigned per component, the mesh bounding box is
+ *    mapped to 0..65535
+ *  - normals: octahedral encoding, the unit sphere is projected on the
+ *    octahedron |x| + |y| + |z| = 1, unfolded on the [-1, 1] square and
+ *    stored as two 16 bit snorm values packed in 32 bits
+ */
+
+namespace agl {
+namespace quant {
+
+const float POS_MAX = 65535.0f;
+const float OCT_MAX = 32767.0f;
+
+inline uint16_t encodePos(float v, float min, float extent) {
+  if (extent <= 0.0f) {
+    return 0;
+  }
+  float t = std::min(std::max((v - min) / extent, 0.0f), 1.0f);
+  return uint16_t(std::lround(t * POS_MAX));
+}
+
+inline float decodePos(uint16_t q, float min, float extent) {
+  return min + q * (extent / POS_MAX);
+}
+
+inline float signNotZero(float v) { return v >= 0.0f ? 1.0f : -1.0f; }
+
+// zero vectors are encoded as +Z
+inline uint32_t encodeOct(float x, float y, float z) {
+  float l1 = std::fabs(x) + std::fabs(y) + std::fabs(z);
+  if (l1 <= 0.0f) {
+    return 0;
+  }
+  x /= l1;
+  y /= l1;
+
+  // lower hemisphere: fold the triangles over the diagonals
+  if (z < 0.0f) {
+    float fx = (1.0f - std::fabs(y)) * signNotZero(x);
+    float fy = (1.0f - std::fabs(x)) * signNotZero(y);
+    x = fx;
+    y = fy;
+  }
+
+  auto snorm = [](float v) {
+    return uint16_t(int16_t(std::lround(std::min(std::max(v, -1.0f), 1.0f) *
+                                        OCT_MAX)));
+  };
+  return uint32_t(snorm(x)) | (uint32_t(snorm(y)) << 16);
+}
+
+inline Point3 decodeOct(uint32_t packed) {
+  float x = std::max(int16_t(packed & 0xffff) / OCT_MAX, -1.0f);
+  float y = std::max(int16_t(packed >> 16) / OCT_MAX, -1.0f);
+  float z = 1.0f - std::fabs(x) - std::fabs(y);
+
+  // unfold the lower hemisphere
+  float t = std::max(-z, 0.0f);
+  x += x >= 0.0f ? -t : t;
+  y += y >= 0.0f ? -t : t;
+
+  float len = std::sqrt(x * x + y * y + z * z);
+  return Point3(x / len, y / len, z / len);
+}
+
+} // namespace quant
+} // namespace agl
+
+#endif // _MESH_QUANT_H_
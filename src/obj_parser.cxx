@@ -0,0 +1,339 @@
+#include "mesh_io.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Memory mapped OBJ tokenizer. See mesh_io.h
+ *
+ * The whole file is mapped and scanned once: no fscanf, no fixed-size
+ * token buffer and no second pass to count the elements. Numbers are
+ * converted in place with std::from_chars.
+ * Big files are split in chunks at line boundaries and parsed in parallel,
+ * each worker filling its own ObjData which are merged at the end.
+ */
+
+namespace agl {
+namespace io {
+
+MappedFile::MappedFile(const char *filename)
+    : m_data(nullptr), m_size(0), m_open(false) {
+  static const auto TAG = __func__;
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    lg::e(TAG, "Cannot stat %s", filename);
+    close(fd);
+    return;
+  }
+
+  m_size = st.st_size;
+  m_open = true;
+
+  // mmap refuses empty mappings, an empty file is still a valid one
+  if (m_size > 0) {
+    void *addr = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+      lg::e(TAG, "Cannot map %s in memory", filename);
+      m_size = 0;
+      m_open = false;
+    } else {
+      m_data = static_cast<const char *>(addr);
+      // we are going to read it front to back exactly once
+      madvise(addr, m_size, MADV_SEQUENTIAL);
+    }
+  }
+
+  // the mapping stays valid after closing the descriptor
+  close(fd);
+}
+
+MappedFile::~MappedFile() {
+  if (m_data) {
+    munmap(const_cast<char *>(m_data), m_size);
+  }
+}
+
+namespace {
+
+inline bool isBlank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+inline const char *skipBlanks(const char *p, const char *end) {
+  while (p < end && isBlank(*p)) {
+    ++p;
+  }
+  return p;
+}
+
+// returns the first char of the next line
+inline const char *skipLine(const char *p, const char *end) {
+  auto nl = static_cast<const char *>(std::memchr(p, '\n', end - p));
+  return nl ? nl + 1 : end;
+}
+
+inline bool isLineEnd(const char *p, const char *end) {
+  return p >= end || *p == '\n' || *p == '#';
+}
+
+// parse a float, skipping the leading blanks. nullptr on failure.
+inline const char *parseFloat(const char *p, const char *end, float &out) {
+  p = skipBlanks(p, end);
+  // from_chars doesn't accept an explicit plus sign
+  if (p < end && *p == '+') {
+    ++p;
+  }
+  auto res = std::from_chars(p, end, out);
+  return res.ec == std::errc() ? res.ptr : nullptr;
+}
+
+// line number of p, only computed when reporting an error
+size_t lineOf(const char *begin, const char *p) {
+  return std::count(begin, p, '\n') + 1;
+}
+
+} // namespace
+
+bool parseObj(const char *begin, const char *end, ObjData &out,
+              const char *file_begin) {
+  static const auto TAG = __func__;
+
+  if (!file_begin) {
+    file_begin = begin;
+  }
+
+  const char *p = begin;
+  while (p < end) {
+    p = skipBlanks(p, end);
+    if (p >= end) {
+      break;
+    }
+
+    const char *line = p;
+    bool ok = true;
+
+    if (p + 1 < end && p[0] == 'v' && isBlank(p[1])) {
+      // vertex position: v x y z [w]
+      float x, y, z;
+      ok = (p = parseFloat(p + 1, end, x)) && (p = parseFloat(p, end, y)) &&
+           (p = parseFloat(p, end, z));
+      if (ok) {
+        out.positions.push_back(x, y, z);
+      }
+    } else if (p + 2 < end && p[0] == 'v' && p[1] == 't' && isBlank(p[2])) {
+      // texture coordinates: vt u [v [w]]
+      float u, v = 0.0f;
+      ok = (p = parseFloat(p + 2, end, u)) != nullptr;
+      if (ok && !isLineEnd(skipBlanks(p, end), end)) {
+        ok = (p = parseFloat(p, end, v)) != nullptr;
+      }
+      if (ok) {
+        out.texcoords.push_back(u);
+        out.texcoords.push_back(v);
+      }
+    } else if (p + 2 < end && p[0] == 'v' && p[1] == 'n' && isBlank(p[2])) {
+      // normal: vn x y z
+      float x, y, z;
+      ok = (p = parseFloat(p + 2, end, x)) && (p = parseFloat(p, end, y)) &&
+           (p = parseFloat(p, end, z));
+      if (ok) {
+        out.normals.push_back(x, y, z);
+      }
+    } else if (p + 1 < end && p[0] == 'f' && isBlank(p[1])) {
+      // face: f v1 v2 v3 ... each corner can be one of v, v/t, v//n, v/t/n
+      // Polygons are triangulated as a fan around the first corner.
+      const int32_t counts[3] = {int32_t(out.positions.size()),
+                                 int32_t(out.texcoords.size() / 2),
+                                 int32_t(out.normals.size())};
+      std::vector<int32_t> *indices[3] = {&out.tris, &out.tri_texcoords,
+                                          &out.tri_normals};
+      std::vector<size_t> *relative[3] = {&out.relative,
+                                          &out.relative_texcoords,
+                                          &out.relative_normals};
+
+      // position, texture and normal index of a corner (-1 = none)
+      struct Corner {
+        int32_t index[3];
+        bool rel[3];
+      } a, b, c;
+      size_t corners = 0;
+
+      p = skipBlanks(p + 1, end);
+      while (ok && !isLineEnd(p, end)) {
+        for (size_t k = 0; k < 3; ++k) {
+          c.index[k] = -1;
+          c.rel[k] = false;
+        }
+
+        for (size_t k = 0; k < 3 && ok; ++k) {
+          // an empty field (v//n) or a missing one (v, v/t)
+          if (k > 0 && (p >= end || *p != '/')) {
+            break;
+          }
+          if (k > 0 && ++p < end && *p == '/') {
+            continue;
+          }
+
+          int32_t idx;
+          auto res = std::from_chars(p, end, idx);
+          if (res.ec != std::errc() || idx == 0) {
+            ok = false;
+            break;
+          }
+          p = res.ptr;
+          // OBJ indices are 1-based, negative ones are relative to the
+          // elements read so far (in this chunk, see ObjData::relative)
+          c.index[k] = idx > 0 ? idx - 1 : counts[k] + idx;
+          c.rel[k] = idx < 0;
+        }
+        if (!ok || (p < end && !isBlank(*p) && *p != '\n')) {
+          ok = false;
+          break;
+        }
+        p = skipBlanks(p, end);
+
+        if (corners == 0) {
+          a = c;
+        } else if (corners >= 2) {
+          auto base = out.tris.size();
+          for (size_t k = 0; k < 3; ++k) {
+            indices[k]->push_back(a.index[k]);
+            indices[k]->push_back(c.index[k]);
+            indices[k]->push_back(b.index[k]);
+
+            if (a.rel[k]) {
+              relative[k]->push_back(base);
+            }
+            if (c.rel[k]) {
+              relative[k]->push_back(base + 1);
+            }
+            if (b.rel[k]) {
+              relative[k]->push_back(base + 2);
+            }
+          }
+        }
+        b = c;
+        ++corners;
+      }
+      ok = ok && corners >= 3;
+    }
+    // anything else (comments, groups, materials...) is ignored
+
+    if (!ok) {
+      lg::e(TAG, "Malformed OBJ at line %zu", lineOf(file_begin, line));
+      return false;
+    }
+
+    p = skipLine(p, end);
+  }
+
+  return true;
+}
+
+bool parseObjParallel(const char *begin, const char *end, ObjData &out,
+                      size_t n_threads) {
+  // below this size per thread, spawning is not worth it
+  static const size_t MIN_CHUNK_SIZE = 1 << 20;
+
+  if (n_threads == 0) {
+    n_threads = std::max(1U, std::thread::hardware_concurrency());
+  }
+  size_t size = end - begin;
+  n_threads = std::max<size_t>(1, std::min(n_threads, size / MIN_CHUNK_SIZE));
+
+  // chunk boundaries, always at the beginning of a line
+  std::vector<const char *> bounds{begin};
+  for (size_t i = 1; i < n_threads; ++i) {
+    const char *p = std::max(bounds.back(), begin + size * i / n_threads);
+    bounds.push_back(p == begin ? p : skipLine(p - 1, end));
+  }
+  bounds.push_back(end);
+
+  std::vector<ObjData> chunks(n_threads);
+  // std::vector<bool> is not safe to write from different threads
+  std::vector<char> ok(n_threads, 1);
+
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < n_threads; ++i) {
+    workers.emplace_back([&, i] {
+      ok[i] = parseObj(bounds[i], bounds[i + 1], chunks[i], begin);
+    });
+  }
+  // the calling thread takes care of the first chunk
+  ok[0] = parseObj(bounds[0], bounds[1], chunks[0], begin);
+
+  for (auto &worker : workers) {
+    worker.join();
+  }
+
+  if (std::find(ok.begin(), ok.end(), 0) != ok.end()) {
+    return false;
+  }
+
+  // merge: positions, texture coordinates and normals are appended,
+  // relative indices rebased on the first element of their chunk
+  size_t n_positions = out.positions.size(), n_tris = out.tris.size();
+  size_t n_texcoords = out.texcoords.size(), n_normals = out.normals.size();
+  for (const auto &chunk : chunks) {
+    n_positions += chunk.positions.size();
+    n_texcoords += chunk.texcoords.size();
+    n_normals += chunk.normals.size();
+    n_tris += chunk.tris.size();
+  }
+  out.positions.reserve(n_positions);
+  out.texcoords.reserve(n_texcoords);
+  out.normals.reserve(n_normals);
+  out.tris.reserve(n_tris);
+  out.tri_texcoords.reserve(n_tris);
+  out.tri_normals.reserve(n_tris);
+
+  auto append = [](Vec3Array &dst, const Vec3Array &src) {
+    dst.x.insert(dst.x.end(), src.x.begin(), src.x.end());
+    dst.y.insert(dst.y.end(), src.y.begin(), src.y.end());
+    dst.z.insert(dst.z.end(), src.z.begin(), src.z.end());
+  };
+
+  for (const auto &chunk : chunks) {
+    const int32_t offset = out.positions.size();
+    const int32_t tex_offset = out.texcoords.size() / 2;
+    const int32_t norm_offset = out.normals.size();
+    const size_t base = out.tris.size();
+
+    append(out.positions, chunk.positions);
+    append(out.normals, chunk.normals);
+    out.texcoords.insert(out.texcoords.end(), chunk.texcoords.begin(),
+                         chunk.texcoords.end());
+    out.tris.insert(out.tris.end(), chunk.tris.begin(), chunk.tris.end());
+    out.tri_texcoords.insert(out.tri_texcoords.end(),
+                             chunk.tri_texcoords.begin(),
+                             chunk.tri_texcoords.end());
+    out.tri_normals.insert(out.tri_normals.end(), chunk.tri_normals.begin(),
+                           chunk.tri_normals.end());
+
+    for (auto k : chunk.relative) {
+      out.tris[base + k] += offset;
+    }
+    for (auto k : chunk.relative_texcoords) {
+      out.tri_texcoords[base + k] += tex_offset;
+    }
+    for (auto k : chunk.relative_normals) {
+      out.tri_normals[base + k] += norm_offset;
+    }
+  }
+
+  return true;
+}
+
+} // namespace io
+} // namespace agl
@@ -1,6 +1,8 @@
 #include "agl.h"
 #include <SDL2/SDL_ttf.h>
 
+#include <algorithm>
+
 namespace agl {
 
 /*
@@ -11,9 +13,14 @@ namespace agl {
  * - it dispatch the keys to the proper handler callbacks
  * - calls the action handler to update the game status
  * - finally, calls the rendering handler lambda: m_render_handler()
+ * With a frame limit (setFrameLimit) the loop quits by itself and logs how
+ * fast the frames went.
  */
 
 void Env::renderLoop() {
+  static const auto TAG = __func__;
+  auto start = getTicks();
+
   // main event loop
 
   m_render_handler();
@@ -96,6 +103,14 @@ void Env::renderLoop() {
           handler(Key::F5);
           break;
 
+        case SDLK_F6:
+          handler(Key::F6);
+          break;
+
+        case SDLK_F7:
+          handler(Key::F7);
+          break;
+
         default:
           break;
         } // switch(key)
@@ -139,6 +154,10 @@ void Env::renderLoop() {
 
     } // if(SDL_PollEvent)
 
+    if (quit) {
+      break; // no frame past the limit of setFrameLimit
+    }
+
     m_action_handler();
 
     // Render once each cycle
@@ -146,6 +165,13 @@ void Env::renderLoop() {
 
   } // while loop
 
+  if (m_frame_limit) {
+    double seconds = std::max(getTicks() - start, 1u) / 1000.0;
+    lg::i(TAG, "%zu frames in %.2f s: %.1f fps", m_frames, seconds,
+          m_frames / seconds);
+    logTimers(TAG);
+  }
+
 } // function mainLoop
 
 // inject a SDL_QUIT event, thus quitting the game
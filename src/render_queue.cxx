@@ -0,0 +1,135 @@
+#include "agl.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace agl {
+
+/*
+ * Render Queue:
+ * -------------
+ * The elements of the scene don't draw themselves in a hardcoded order:
+ * they submit draw items, which are sorted by a 64 bit key and executed in
+ * order by flushQueue().
+ *
+ *   | pass (8 bits) | material (24 bits) | depth (32 bits) |
+ *
+ * Opaque items are grouped by material (texture) to save state switches,
+ * then drawn front to back so that the depth test discards the hidden
+ * fragments early. Transparent items are drawn back to front, the material
+ * is not used or blending would be wrong.
+ *
+ * beginQueue also extracts the view frustum (Gribb-Hartmann, from
+ * projection * modelview) so that the elements can skip what the camera
+ * can't see before submitting it, see isVisible().
+ */
+
+namespace {
+
+// positive floats compare as their bits
+uint32_t depthBits(float depth) {
+  depth = std::max(depth, 0.0f);
+  uint32_t bits;
+  std::memcpy(&bits, &depth, sizeof(bits));
+  return bits;
+}
+
+} // namespace
+
+void Env::beginQueue() {
+  m_queue.clear();
+  std::memcpy(m_view, modelview().data(), sizeof(m_view));
+
+  const Matrix4 &proj = projection();
+  GLfloat clip[16];
+  // column major: clip[4 * col + row]
+  for (size_t col = 0; col < 4; ++col) {
+    for (size_t row = 0; row < 4; ++row) {
+      clip[4 * col + row] = 0.0f;
+      for (size_t k = 0; k < 4; ++k) {
+        clip[4 * col + row] += proj[4 * k + row] * m_view[4 * col + k];
+      }
+    }
+  }
+
+  // left, right, bottom, top, near, far: last row +- one of the others
+  for (size_t i = 0; i < 6; ++i) {
+    size_t row = i / 2;
+    float sign = i % 2 == 0 ? 1.0f : -1.0f;
+    for (size_t col = 0; col < 4; ++col) {
+      m_frustum[i][col] = clip[4 * col + 3] + sign * clip[4 * col + row];
+    }
+    float len = std::sqrt(m_frustum[i][0] * m_frustum[i][0] +
+                          m_frustum[i][1] * m_frustum[i][1] +
+                          m_frustum[i][2] * m_frustum[i][2]);
+    for (size_t col = 0; col < 4 && len > 0.0f; ++col) {
+      m_frustum[i][col] /= len;
+    }
+  }
+
+  m_visible = m_culled = 0;
+}
+
+bool Env::isVisible(const Point3 &center, float radius) {
+  if (m_culling) {
+    for (const auto &plane : m_frustum) {
+      float dist = plane[0] * center.x + plane[1] * center.y +
+                   plane[2] * center.z + plane[3];
+      if (dist < -radius) {
+        ++m_culled;
+        return false;
+      }
+    }
+  }
+  ++m_visible;
+  return true;
+}
+
+void Env::setCulling(bool enabled) { m_culling = enabled; }
+
+float Env::eyeDepth(const Point3 &p) const {
+  return -(m_view[2] * p.x + m_view[6] * p.y + m_view[10] * p.z + m_view[14]);
+}
+
+void Env::submit(RenderPass pass, uint32_t material, const Point3 &center,
+                 std::function<void()> draw) {
+  uint64_t depth = depthBits(eyeDepth(center));
+  if (pass == RenderPass::TRANSPARENT) {
+    depth = ~depth & 0xffffffffULL; // back to front
+    material = 0;
+  }
+  uint64_t key = uint64_t(pass) << 56 | uint64_t(material & 0xffffff) << 32 |
+                 depth;
+  m_queue.push_back({key, std::move(draw)});
+}
+
+void Env::flushQueue() {
+  std::stable_sort(
+      m_queue.begin(), m_queue.end(),
+      [](const DrawItem &a, const DrawItem &b) { return a.key < b.key; });
+
+  for (auto &stats : m_pass_stats) {
+    stats = PassStats();
+  }
+  // the scene is drawn with the shaders, the rest (HUD, menus) is not
+  m_shading = m_pipeline == Pipeline::GLSL && shadersSupported();
+  if (m_shading) {
+    prepareShadowReceivers();
+  }
+  for (const auto &item : m_queue) {
+    PassStats &stats = m_pass_stats[item.key >> 56];
+    size_t issued = m_state_issued;
+    item.draw();
+    ++stats.items;
+    stats.state_changes += m_state_issued - issued;
+  }
+  if (m_shading) {
+    useProgram(0);
+    m_shading = false;
+  }
+  m_shadow_frame = false; // the caster updates it again next frame
+  m_queue.clear();
+}
+
+} // namespace agl
@@ -0,0 +1,476 @@
+#include "agl.h"
+
+#include <cmath>
+#include <cstring>
+#include <string>
+
+namespace agl {
+
+/*
+ * GLSL pipeline:
+ * --------------
+ * The scene can be drawn by shaders instead of the fixed function lighting
+ * and sphere map texgen, which drivers like llvmpipe emulate slowly.
+ * The game keeps setting the same GL state (enable(GL_LIGHTING),
+ * textureDrawing...): before each draw of the render queue applyProgram()
+ * reads it from the state cache and binds the program compiled for that
+ * combination of features. Programs are compiled on first use and kept.
+ *
+ * Shared values live in two uniform blocks, uploaded only when they change:
+ * Camera (the projection) and Lights (sun, headlight spot, material and
+ * the eye to shadow map matrix, in eye coords). The model view and normal
+ * matrices and the colour are per object uniforms, taken from the copies
+ * Env keeps (matrices.cxx, setColor): nothing is read back from the driver.
+ * The shaders use no compatibility built-in: the vertices come from the
+ * generic attributes of VertexAttrib, set up by the vertex buffers of
+ * buffers.cxx next to the fixed function arrays. What is still drawn in
+ * immediate mode goes through the fixed function. The instances of
+ * instancedDrawing use the same programs, with the pose (and colour) of
+ * each copy in the instance attributes.
+ */
+
+namespace {
+
+// features of a program, from the GL state at draw time
+enum Feature : uint32_t {
+  LIGHTING = 1 << 0,
+  TEXTURE = 1 << 1,
+  TEXGEN_SPHERE = 1 << 2, // environment map
+  TEXGEN_LINEAR = 1 << 3, // object linear
+  SPOT = 1 << 4,
+  SHADOW_MAP = 1 << 5, // receives the shadow map (see shadow_map.cxx)
+  INSTANCED = 1 << 6,  // one draw for many copies (see renderInstances)
+  INSTANCE_COLORS = 1 << 7, // each copy has its own colour
+};
+
+// binding points of the uniform blocks
+const GLuint CAMERA_BLOCK = 0, LIGHTS_BLOCK = 1;
+
+// declared by both stages, the fragment shader reads the shadow parameters
+const char *UNIFORM_BLOCKS = R"(
+layout(std140) uniform Camera {
+  mat4 projection;
+};
+
+layout(std140) uniform Lights {
+  vec4 sun_direction;
+  vec4 scene_ambient;
+  vec4 sun_diffuse;
+  vec4 sun_specular;
+  vec4 spot_position;
+  vec4 spot_direction;
+  vec4 spot_diffuse;
+  vec4 spot_ambient;
+  vec4 spot_params; // exponent, constant and linear attenuation, cos(cutoff)
+  vec4 material;    // specular and shininess
+  mat4 eye_to_shadow;
+  vec4 shadow_params; // darkness
+};
+)";
+
+const char *VERTEX_SHADER = R"(
+in vec4 position;
+in vec3 normal;
+in vec2 texcoord;
+
+uniform mat4 modelview;
+uniform mat3 normal_matrix;
+uniform vec4 current_color; // glColor
+#ifdef INSTANCED
+in vec4 instance_pose; // x, y, z, angle around Y in degrees
+in vec4 instance_color;
+#endif
+
+out vec4 color;
+out vec2 uv;
+#ifdef SHADOW
+out vec4 shadow_coord;
+#endif
+
+void main() {
+#ifdef INSTANCED
+  // the copy in the model coords, as if translated and rotated by Env
+  float a = radians(instance_pose.w);
+  mat3 rot = mat3(cos(a), 0.0, -sin(a), 0.0, 1.0, 0.0, sin(a), 0.0, cos(a));
+  vec4 model = vec4(rot * position.xyz + instance_pose.xyz, 1.0);
+  vec3 model_normal = rot * normal;
+#else
+  vec4 model = position;
+  vec3 model_normal = normal;
+#endif
+#ifdef INSTANCE_COLORS
+  vec4 base = instance_color;
+#else
+  vec4 base = current_color;
+#endif
+
+  vec4 eye = modelview * model;
+  gl_Position = projection * eye;
+#ifdef SHADOW
+  shadow_coord = eye_to_shadow * eye;
+#endif
+  vec3 n = normalize(normal_matrix * model_normal);
+
+  color = base;
+#ifdef LIGHTING
+  // colour material on ambient and diffuse, as set up by SmartWindow
+  float diffuse = max(dot(n, sun_direction.xyz), 0.0);
+  vec3 lit = (scene_ambient.rgb + diffuse * sun_diffuse.rgb) * base.rgb;
+  if (diffuse > 0.0) {
+    vec3 h = normalize(sun_direction.xyz + vec3(0.0, 0.0, 1.0));
+    lit += pow(max(dot(n, h), 0.0), material.w) * material.rgb *
+           sun_specular.rgb;
+  }
+#ifdef SPOT
+  vec3 to_light = spot_position.xyz - eye.xyz;
+  float dist = length(to_light);
+  vec3 l = to_light / dist;
+  float cos_angle = dot(-l, spot_direction.xyz);
+  if (cos_angle >= spot_params.w) {
+    float attenuation = pow(max(cos_angle, 0.0), spot_params.x) /
+                        (spot_params.y + spot_params.z * dist);
+    lit += attenuation * base.rgb *
+           (spot_ambient.rgb + max(dot(n, l), 0.0) * spot_diffuse.rgb);
+  }
+#endif
+  color = vec4(min(lit, vec3(1.0)), base.a);
+#endif
+
+#if defined(TEXGEN_SPHERE)
+  vec3 r = reflect(normalize(eye.xyz), n);
+  float m = 2.0 * sqrt(r.x * r.x + r.y * r.y + (r.z + 1.0) * (r.z + 1.0));
+  uv = r.xy / m + 0.5;
+#elif defined(TEXGEN_LINEAR)
+  uv = position.xy;
+#else
+  uv = texcoord;
+#endif
+}
+)";
+
+const char *FRAGMENT_SHADER = R"(
+in vec4 color;
+in vec2 uv;
+out vec4 frag_color;
+
+#ifdef TEXTURE
+uniform sampler2D tex;
+#endif
+#ifdef SHADOW
+in vec4 shadow_coord;
+uniform sampler2DShadow shadow_map;
+#endif
+
+void main() {
+  frag_color = color;
+#ifdef TEXTURE
+  frag_color *= texture(tex, uv); // GL_MODULATE
+#endif
+#ifdef SHADOW
+  float lit = textureProj(shadow_map, shadow_coord);
+  frag_color.rgb *= mix(shadow_params.x, 1.0, lit);
+#endif
+}
+)";
+
+GLuint compileShader(GLenum type, const std::string &header,
+                     const char *source) {
+  static const auto TAG = __func__;
+
+  const char *sources[] = {header.c_str(), source};
+  GLuint shader = glCreateShader(type);
+  glShaderSource(shader, 2, sources, nullptr);
+  glCompileShader(shader);
+  GLint ok;
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+  if (!ok) {
+    char log[1024];
+    glGetShaderInfoLog(shader, sizeof(log), nullptr, log);
+    lg::e(TAG, "Scene shader: %s", log);
+    glDeleteShader(shader);
+    return 0;
+  }
+  return shader;
+}
+
+// eye coords of the direction d, transformed by the 3x3 part of mv
+void eyeDirection(const Matrix4 &mv, const Vec3 &d, GLfloat *out) {
+  Point3 e(mv[0] * d.x + mv[4] * d.y + mv[8] * d.z,
+           mv[1] * d.x + mv[5] * d.y + mv[9] * d.z,
+           mv[2] * d.x + mv[6] * d.y + mv[10] * d.z);
+  e = e.normalize();
+  out[0] = e.x;
+  out[1] = e.y;
+  out[2] = e.z;
+  out[3] = 0.0f;
+}
+
+void copyColor(const Color &c, GLfloat *out) {
+  out[0] = c.r;
+  out[1] = c.g;
+  out[2] = c.b;
+  out[3] = c.a;
+}
+
+} // namespace
+
+void Env::setPipeline(Pipeline pipeline) { m_pipeline = pipeline; }
+
+// Creates the uniform blocks the first time. false if the driver doesn't
+// have them: then the fixed function pipeline is used.
+bool Env::shadersSupported() {
+  static const auto TAG = __func__;
+
+  if (m_camera_ubo) {
+    return true;
+  }
+  if (!GLEW_VERSION_3_2) {
+    lg::i(TAG, "GLSL 1.50 not supported, using the fixed function pipeline");
+    m_pipeline = Pipeline::FIXED_FUNCTION;
+    return false;
+  }
+
+  glGenBuffers(1, &m_camera_ubo);
+  glBindBuffer(GL_UNIFORM_BUFFER, m_camera_ubo);
+  glBufferData(GL_UNIFORM_BUFFER, sizeof(m_camera), nullptr, GL_DYNAMIC_DRAW);
+  glGenBuffers(1, &m_lights_ubo);
+  glBindBuffer(GL_UNIFORM_BUFFER, m_lights_ubo);
+  glBufferData(GL_UNIFORM_BUFFER, sizeof(m_lights), nullptr, GL_DYNAMIC_DRAW);
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  glBindBufferBase(GL_UNIFORM_BUFFER, CAMERA_BLOCK, m_camera_ubo);
+  glBindBufferBase(GL_UNIFORM_BUFFER, LIGHTS_BLOCK, m_lights_ubo);
+
+  // sent with the first draw
+  std::memset(m_camera, 0, sizeof(m_camera));
+  m_lights_dirty = true;
+  // the initial normal of GL, for the buffers without normals
+  glVertexAttrib3f(ATTRIB_NORMAL, 0.0f, 0.0f, 1.0f);
+  return true;
+}
+
+const ShaderProgram &Env::shaderProgram(uint32_t features) {
+  static const auto TAG = __func__;
+
+  auto it = m_programs.find(features);
+  if (it != m_programs.end()) {
+    return it->second;
+  }
+  ShaderProgram &program = m_programs[features];
+
+  std::string header = "#version 150\n";
+  const std::pair<Feature, const char *> defines[] = {
+      {LIGHTING, "LIGHTING"},
+      {TEXTURE, "TEXTURE"},
+      {TEXGEN_SPHERE, "TEXGEN_SPHERE"},
+      {TEXGEN_LINEAR, "TEXGEN_LINEAR"},
+      {SPOT, "SPOT"},
+      {SHADOW_MAP, "SHADOW"},
+      {INSTANCED, "INSTANCED"},
+      {INSTANCE_COLORS, "INSTANCE_COLORS"}};
+  for (const auto &define : defines) {
+    if (features & define.first) {
+      header += std::string("#define ") + define.second + "\n";
+    }
+  }
+  header += UNIFORM_BLOCKS;
+
+  GLuint vs = compileShader(GL_VERTEX_SHADER, header, VERTEX_SHADER);
+  GLuint fs = compileShader(GL_FRAGMENT_SHADER, header, FRAGMENT_SHADER);
+  if (!vs || !fs) {
+    glDeleteShader(vs);
+    glDeleteShader(fs);
+    return program; // id 0: drawn with the fixed function
+  }
+
+  GLuint id = glCreateProgram();
+  glAttachShader(id, vs);
+  glAttachShader(id, fs);
+  glBindAttribLocation(id, ATTRIB_POSITION, "position");
+  glBindAttribLocation(id, ATTRIB_NORMAL, "normal");
+  glBindAttribLocation(id, ATTRIB_TEXCOORD, "texcoord");
+  glBindAttribLocation(id, ATTRIB_INSTANCE_POSE, "instance_pose");
+  glBindAttribLocation(id, ATTRIB_INSTANCE_COLOR, "instance_color");
+  glBindFragDataLocation(id, 0, "frag_color");
+  glLinkProgram(id);
+  glDeleteShader(vs); // freed with the program
+  glDeleteShader(fs);
+  GLint ok;
+  glGetProgramiv(id, GL_LINK_STATUS, &ok);
+  if (!ok) {
+    char log[1024];
+    glGetProgramInfoLog(id, sizeof(log), nullptr, log);
+    lg::e(TAG, "Scene shader: %s", log);
+    glDeleteProgram(id);
+    return program;
+  }
+
+  glUniformBlockBinding(id, glGetUniformBlockIndex(id, "Camera"),
+                        CAMERA_BLOCK);
+  // without lighting the block is optimized out
+  GLuint lights = glGetUniformBlockIndex(id, "Lights");
+  if (lights != GL_INVALID_INDEX) {
+    glUniformBlockBinding(id, lights, LIGHTS_BLOCK);
+  }
+  program.id = id;
+  program.modelview_loc = glGetUniformLocation(id, "modelview");
+  program.normal_matrix_loc = glGetUniformLocation(id, "normal_matrix");
+  program.color_loc = glGetUniformLocation(id, "current_color");
+  if (features & TEXTURE) {
+    useProgram(id);
+    glUniform1i(glGetUniformLocation(id, "tex"), 0);
+  }
+  if (features & SHADOW_MAP) {
+    useProgram(id);
+    glUniform1i(glGetUniformLocation(id, "shadow_map"), 1);
+  }
+
+  lg::i(TAG, "Compiled scene program %u for features 0x%x", id, features);
+  return program;
+}
+
+bool Env::applyProgram(bool instanced) {
+  if (!m_shading) {
+    return false;
+  }
+
+  uint32_t features = 0;
+  if (instanced) {
+    features |= INSTANCED;
+    if (m_instances->colored()) {
+      features |= INSTANCE_COLORS;
+    }
+  }
+  if (isEnabled(GL_LIGHTING)) {
+    features |= LIGHTING;
+    if (m_spot_light && isEnabled(m_spot_light)) {
+      features |= SPOT;
+    }
+  }
+  if (isEnabled(GL_TEXTURE_2D)) {
+    features |= TEXTURE;
+    if (isEnabled(GL_TEXTURE_GEN_S)) {
+      features |= m_envmap ? TEXGEN_SPHERE : TEXGEN_LINEAR;
+    }
+  }
+  if (m_shadow_receiver && m_shadow_frame) {
+    features |= SHADOW_MAP;
+  }
+
+  const ShaderProgram &program = shaderProgram(features);
+  useProgram(program.id);
+  if (!program.id) {
+    return false;
+  }
+
+  const Matrix4 &mv = modelview();
+  const Matrix4 &proj = projection();
+  if (std::memcmp(proj.data(), m_camera, sizeof(m_camera)) != 0) {
+    std::memcpy(m_camera, proj.data(), sizeof(m_camera));
+    glBindBuffer(GL_UNIFORM_BUFFER, m_camera_ubo);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(m_camera), m_camera);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  }
+  if (m_lights_dirty) {
+    glBindBuffer(GL_UNIFORM_BUFFER, m_lights_ubo);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(m_lights), &m_lights);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    m_lights_dirty = false;
+  }
+
+  // cofactors of the 3x3 part, column major: the inverse transpose up to a
+  // scale factor, the shader normalizes anyway
+  GLfloat n[9] = {mv[5] * mv[10] - mv[6] * mv[9],
+                  mv[6] * mv[8] - mv[4] * mv[10],
+                  mv[4] * mv[9] - mv[5] * mv[8],
+                  mv[9] * mv[2] - mv[10] * mv[1],
+                  mv[10] * mv[0] - mv[8] * mv[2],
+                  mv[8] * mv[1] - mv[9] * mv[0],
+                  mv[1] * mv[6] - mv[2] * mv[5],
+                  mv[2] * mv[4] - mv[0] * mv[6],
+                  mv[0] * mv[5] - mv[1] * mv[4]};
+  glUniformMatrix4fv(program.modelview_loc, 1, GL_FALSE, mv.data());
+  glUniformMatrix3fv(program.normal_matrix_loc, 1, GL_FALSE, n);
+  glUniform4f(program.color_loc, m_color.r, m_color.g, m_color.b, m_color.a);
+  return true;
+}
+
+void Env::releaseShaders() {
+  if (hasGLContext()) {
+    for (const auto &entry : m_programs) {
+      if (entry.second.id) {
+        glDeleteProgram(entry.second.id);
+      }
+    }
+    if (m_camera_ubo) {
+      glDeleteBuffers(1, &m_camera_ubo);
+      glDeleteBuffers(1, &m_lights_ubo);
+    }
+  }
+  m_programs.clear();
+  m_camera_ubo = m_lights_ubo = 0;
+  m_program_known = false;
+}
+
+void Env::setupLightPosition() {
+  // last component = 0 ==> directional light
+  float light_position[4] = {0, 1, 2, 0};
+  glLightfv(GL_LIGHT0, GL_POSITION, light_position);
+
+  // like GL, in eye coords with the current model view
+  eyeDirection(modelview(),
+               Vec3(light_position[0], light_position[1], light_position[2]),
+               m_lights.sun_direction);
+  m_lights_dirty = true;
+}
+
+void Env::setupModelLights() {
+  // setup lights for the model
+  static float params[4] = {1, 1, 1, 1};
+  glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, params);
+  glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 127);
+  m_lights.material[0] = m_lights.material[1] = m_lights.material[2] = 1.0f;
+  m_lights.material[3] = 127.0f;
+  m_lights_dirty = true;
+
+  enable(GL_LIGHTING);
+}
+
+void Env::setupSpotLight(GLenum light, const SpotLight &spot) {
+  const GLfloat position[4] = {spot.position.x, spot.position.y,
+                               spot.position.z, 1};
+  const GLfloat direction[4] = {spot.direction.x, spot.direction.y,
+                                spot.direction.z, 0};
+  GLfloat diffuse[4], ambient[4];
+  copyColor(spot.diffuse, diffuse);
+  copyColor(spot.ambient, ambient);
+
+  enable(light);
+  glLightfv(light, GL_DIFFUSE, diffuse);
+  glLightfv(light, GL_AMBIENT, ambient);
+  glLightfv(light, GL_POSITION, position);
+  glLightfv(light, GL_SPOT_DIRECTION, direction);
+  glLightf(light, GL_SPOT_CUTOFF, spot.cutoff);
+  glLightf(light, GL_SPOT_EXPONENT, spot.exponent);
+  glLightf(light, GL_CONSTANT_ATTENUATION, spot.constant_attenuation);
+  glLightf(light, GL_LINEAR_ATTENUATION, spot.linear_attenuation);
+
+  // the shaders have a single spot, the last one set up
+  const Matrix4 &mv = modelview();
+  for (size_t k = 0; k < 3; ++k) {
+    m_lights.spot_position[k] = mv[12 + k] + mv[k] * position[0] +
+                                mv[4 + k] * position[1] +
+                                mv[8 + k] * position[2];
+  }
+  m_lights.spot_position[3] = 1.0f;
+  eyeDirection(mv, spot.direction, m_lights.spot_direction);
+  std::memcpy(m_lights.spot_diffuse, diffuse, sizeof(diffuse));
+  std::memcpy(m_lights.spot_ambient, ambient, sizeof(ambient));
+  m_lights.spot_params[0] = spot.exponent;
+  m_lights.spot_params[1] = spot.constant_attenuation;
+  m_lights.spot_params[2] = spot.linear_attenuation;
+  m_lights.spot_params[3] = std::cos(spot.cutoff * M_PI / 180.0);
+  m_spot_light = light;
+  m_lights_dirty = true;
+}
+
+} // namespace agl
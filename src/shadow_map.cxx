@@ -0,0 +1,269 @@
+#include "agl.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+namespace agl {
+
+/*
+ * Shadow Map:
+ * -----------
+ * The ship casts its shadow on the floor, the rings and the cubes. It is
+ * drawn from the sun into a depth texture (the shadow map), then the
+ * receivers, drawn with the GLSL pipeline inside shadowedDrawing(), look
+ * up their position in it and get darker where something is closer to the
+ * light.
+ *
+ * The light projection is an orthographic box fitted around the bounding
+ * sphere of the caster, so the whole resolution is spent on the ship, and
+ * the map is redrawn only when the caster moves: a ship standing still
+ * costs nothing. The CPU cost of a redraw is kept in ShadowStats, its GPU
+ * cost in the "shadow" timer (see gpu_timer.cxx).
+ *
+ * Without shaders or framebuffer objects, or with ShadowQuality::BLOB, the
+ * ship drops a blob under itself instead (see Spaceship::submitShadow).
+ */
+
+namespace {
+
+// towards the sun of the shadows, in world coords. The sun of
+// setupLightPosition follows the camera, this one stays put: it is where
+// the old squashed shadow came from (offset by 2, 2 at 2 units high)
+const Point3 SHADOW_LIGHT = Point3(-1.0f, 1.0f, -1.0f).normalize();
+// colour left to the shadowed fragments
+const float SHADOW_DARKNESS = 0.45f;
+// depth range behind the caster: enough to reach the floor and the cubes
+const float SHADOW_DEPTH = 60.0f;
+// texture unit of the shadow map, the scene textures use unit 0
+const GLenum SHADOW_UNIT = GL_TEXTURE1;
+
+// out = a * b, column major
+void multiply(const GLfloat *a, const GLfloat *b, GLfloat *out) {
+  for (size_t col = 0; col < 4; ++col) {
+    for (size_t row = 0; row < 4; ++row) {
+      out[4 * col + row] = 0.0f;
+      for (size_t k = 0; k < 4; ++k) {
+        out[4 * col + row] += a[4 * k + row] * b[4 * col + k];
+      }
+    }
+  }
+}
+
+// inverse of an affine transformation (the camera of setCamera)
+void invertAffine(const GLfloat *m, GLfloat *out) {
+  // cofactors of the 3x3 part over the determinant
+  GLfloat c[9] = {m[5] * m[10] - m[6] * m[9],  m[2] * m[9] - m[1] * m[10],
+                  m[1] * m[6] - m[2] * m[5],   m[6] * m[8] - m[4] * m[10],
+                  m[0] * m[10] - m[2] * m[8],  m[2] * m[4] - m[0] * m[6],
+                  m[4] * m[9] - m[5] * m[8],   m[1] * m[8] - m[0] * m[9],
+                  m[0] * m[5] - m[1] * m[4]};
+  GLfloat det = m[0] * c[0] + m[4] * c[1] + m[8] * c[2];
+  GLfloat inv = det != 0.0f ? 1.0f / det : 0.0f;
+
+  for (size_t col = 0; col < 3; ++col) {
+    for (size_t row = 0; row < 3; ++row) {
+      out[4 * col + row] = c[3 * col + row] * inv;
+    }
+    out[4 * col + 3] = 0.0f;
+  }
+  for (size_t row = 0; row < 3; ++row) {
+    out[12 + row] = -(out[row] * m[12] + out[4 + row] * m[13] +
+                      out[8 + row] * m[14]);
+  }
+  out[15] = 1.0f;
+}
+
+} // namespace
+
+void Env::setShadowMapSize(size_t size) {
+  size = std::min<size_t>(std::max<size_t>(size, 64), 8192);
+  if (GLsizei(size) != m_shadow_size) {
+    m_shadow_size = size;
+    releaseShadowMap(); // created again with the new size
+  }
+}
+
+bool Env::isShadowMapActive() {
+  return m_shadow_quality == ShadowQuality::MAP &&
+         m_pipeline == Pipeline::GLSL && shadowMapSupported();
+}
+
+// Creates the depth texture and its framebuffer the first time. false if
+// the driver can't: the blob shadow is used from then on.
+bool Env::shadowMapSupported() {
+  static const auto TAG = __func__;
+
+  if (m_shadow_fbo) {
+    return true;
+  }
+  if (!shadersSupported()) {
+    return false;
+  }
+  if (!GLEW_VERSION_3_0 && !GLEW_ARB_framebuffer_object) {
+    lg::i(TAG, "Framebuffer objects not supported, using blob shadows");
+    m_shadow_quality = ShadowQuality::BLOB;
+    return false;
+  }
+
+  glGenTextures(1, &m_shadow_tex);
+  glActiveTexture(SHADOW_UNIT);
+  glBindTexture(GL_TEXTURE_2D, m_shadow_tex);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, m_shadow_size,
+               m_shadow_size, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, nullptr);
+  // linear filtering of the comparisons: 2x2 percentage closer filtering
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  // outside the map nothing is in shadow
+  const GLfloat border[4] = {1, 1, 1, 1};
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+  glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, border);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE,
+                  GL_COMPARE_REF_TO_TEXTURE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+  glActiveTexture(GL_TEXTURE0);
+
+  GLint bound;
+  glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &bound);
+  glGenFramebuffers(1, &m_shadow_fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, m_shadow_fbo);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D,
+                         m_shadow_tex, 0);
+  glDrawBuffer(GL_NONE); // depth only
+  glReadBuffer(GL_NONE);
+  GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+  glBindFramebuffer(GL_FRAMEBUFFER, bound);
+  if (status != GL_FRAMEBUFFER_COMPLETE) {
+    lg::e(TAG, "Shadow map framebuffer incomplete (0x%x), using blob shadows",
+          status);
+    releaseShadowMap();
+    m_shadow_quality = ShadowQuality::BLOB;
+    return false;
+  }
+
+  lg::i(TAG, "Shadow map %dx%d", m_shadow_size, m_shadow_size);
+  return true;
+}
+
+void Env::updateShadowMap(const Point3 &center, float radius, bool moved,
+                          std::function<void()> draw) {
+  if (!isShadowMapActive()) {
+    return;
+  }
+
+  m_shadow_frame = true;
+  const GLfloat caster[4] = {center.x, center.y, center.z, radius};
+  if (m_shadow_valid && !moved &&
+      std::memcmp(caster, m_shadow_caster, sizeof(caster)) == 0) {
+    ++m_shadow_stats.reused;
+    return;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+
+  // what the pass changes, to put it back
+  GLint viewport[4], bound;
+  GLfloat offset_factor, offset_units;
+  glGetIntegerv(GL_VIEWPORT, viewport);
+  glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &bound);
+  glGetFloatv(GL_POLYGON_OFFSET_FACTOR, &offset_factor);
+  glGetFloatv(GL_POLYGON_OFFSET_UNITS, &offset_units);
+  const GLenum caps[] = {GL_LIGHTING, GL_TEXTURE_2D, GL_BLEND,
+                         GL_POLYGON_OFFSET_FILL};
+  bool enabled[4];
+  for (size_t i = 0; i < 4; ++i) {
+    enabled[i] = isEnabled(caps[i]);
+  }
+
+  // the whole pass, in and out of the map framebuffer, is the "shadow" time
+  GLfloat proj[16], view[16], light[16];
+  timedScope("shadow", [&] {
+    glBindFramebuffer(GL_FRAMEBUFFER, m_shadow_fbo);
+    glViewport(0, 0, m_shadow_size, m_shadow_size);
+    glClear(GL_DEPTH_BUFFER_BIT);
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    disable(GL_LIGHTING);
+    disable(GL_TEXTURE_2D);
+    disable(GL_BLEND);
+    // pushes the depths away from the light: no self shadowing acne
+    enable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(2.0f, 4.0f);
+
+    matrixMode(GL_PROJECTION);
+    pushMatrix();
+    loadIdentity();
+    ortho(-radius, radius, -radius, radius, 0.0, 2.0 * radius + SHADOW_DEPTH);
+    std::memcpy(proj, projection().data(), sizeof(proj));
+    matrixMode(GL_MODELVIEW);
+    pushMatrix();
+    loadIdentity();
+    Point3 eye(center.x + SHADOW_LIGHT.x * radius,
+               center.y + SHADOW_LIGHT.y * radius,
+               center.z + SHADOW_LIGHT.z * radius);
+    setCamera(eye.x, eye.y, eye.z, center.x, center.y, center.z, 0, 1, 0);
+    std::memcpy(view, modelview().data(), sizeof(view));
+
+    draw();
+
+    popMatrix();
+    matrixMode(GL_PROJECTION);
+    popMatrix();
+    matrixMode(GL_MODELVIEW);
+
+    glPolygonOffset(offset_factor, offset_units);
+    for (size_t i = 0; i < 4; ++i) {
+      setEnabled(caps[i], enabled[i]);
+    }
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    glBindFramebuffer(GL_FRAMEBUFFER, bound);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+  });
+
+  // world -> light clip coords -> [0, 1] texture coords and depth
+  const GLfloat bias[16] = {.5f, 0, 0, 0, 0, .5f, 0, 0,
+                            0, 0, .5f, 0, .5f, .5f, .5f, 1};
+  multiply(proj, view, light);
+  multiply(bias, light, m_shadow_matrix);
+  std::memcpy(m_shadow_caster, caster, sizeof(caster));
+  m_shadow_valid = true;
+
+  ++m_shadow_stats.updates;
+  m_shadow_stats.cpu_ms = std::chrono::duration<double, std::milli>(
+                              std::chrono::steady_clock::now() - start)
+                              .count();
+}
+
+void Env::prepareShadowReceivers() {
+  if (!m_shadow_frame) {
+    return;
+  }
+  // eye -> world (camera of beginQueue) -> shadow map
+  GLfloat eye_to_world[16];
+  invertAffine(m_view, eye_to_world);
+  multiply(m_shadow_matrix, eye_to_world, m_lights.eye_to_shadow);
+  m_lights.shadow_params[0] = SHADOW_DARKNESS;
+  m_lights_dirty = true;
+}
+
+void Env::shadowedDrawing(std::function<void()> callback) {
+  m_shadow_receiver = true;
+  callback();
+  m_shadow_receiver = false;
+}
+
+void Env::releaseShadowMap() {
+  if (hasGLContext()) {
+    if (m_shadow_fbo) {
+      glDeleteFramebuffers(1, &m_shadow_fbo);
+    }
+    if (m_shadow_tex) {
+      glDeleteTextures(1, &m_shadow_tex);
+    }
+  }
+  m_shadow_fbo = m_shadow_tex = 0;
+  m_shadow_valid = false;
+}
+
+} // namespace agl
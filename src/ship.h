@@ -50,9 +50,11 @@ protected:
   std::queue<spaceship::Command> m_cmds;
 
   agl::Env &m_env;
-  agl::TexID m_tex;
-  std::unique_ptr<agl::Mesh>
-      m_mesh; // mesh structure for the Aventador Spaceship
+  agl::TexRef m_tex;
+  // mesh structure for the Aventador Spaceship, loaded in background
+  std::shared_ptr<agl::MeshHandle> m_mesh;
+  // position, facing and steering when the shadow map was last drawn
+  std::array<float, 5> m_shadow_pose = {};
   // angles, grip and friction
 
   // protected constructor to ensure singleton instance
@@ -60,9 +62,13 @@ protected:
   Spaceship(const char *texture_filename, const char *mesh_filename);
 
   // drawing methods
+  // translation and rotations of the ship in the world (see render())
+  void applyPose() const;
   void draw() const;
   void drawFlicker() const;
   void drawHeadlight(float x, float y, float z, int lightN) const;
+  size_t lodLevel(const agl::Mesh &mesh) const;
+  void drawPlaceholder() const;
 
   // inner logic and physics of the spaceship
   bool get_state(spaceship::Motion mt);
@@ -101,7 +107,18 @@ public:
 
   // render the Spaceship: TexID + Mesh
   virtual void render(bool flicker = false);
-  void shadow();
+  // blob shadow, when the shadow map is not available (see submitShadow)
+  void blobShadow(float radius);
+  // queue render() (see agl::Env::submit), unless it is out of the view
+  // frustum
+  void submit(bool flicker = false);
+  // shadow of the ship: updates the shadow map (see agl::Env::
+  // updateShadowMap), or queues blobShadow()
+  void submitShadow();
+  bool boundingSphere(agl::Point3 &center, float &radius) const;
+  // box of the mesh in the world, for the collisions with the door. The
+  // tilt of the steering is left out. false while the bounds are unknown
+  bool boundingBox(agl::Obb &box) const;
 };
 
 class FlappyShip : Spaceship {
@@ -7,41 +7,70 @@
  * SmartWindow is a class that represents a graphical window, it's basically
  * a wrapper on top of an SDL_Window.
  * The class takes also care of initializing the GL Context
+ * Headless (see headless.cxx) it has no SDL_Window: an EGL context draws
+ * into a framebuffer object instead.
  */
 
 namespace agl {
 // creates a new Window with the required parameters.
 SmartWindow::SmartWindow(std::string &name, size_t x, size_t y, size_t w,
                          size_t h)
-    : m_name(name), m_width(w), m_height(h), m_env(get_env()) {
+    : m_win(nullptr), m_GLcontext(nullptr), m_name(name), m_env(get_env()),
+      m_headless(getHeadless()), m_egl_display(nullptr),
+      m_egl_surface(nullptr), m_egl_context(nullptr), m_fbo(0),
+      m_fbo_buffers(), m_frame(0), m_width(w), m_height(h) {
 
   static const auto TAG = __func__;
 
   lg::i(TAG, "creating SmartWindow(\"%s\", %zu, %zu, %zu, %zu)", name.c_str(),
         x, y, w, h);
 
-  m_win = SDL_CreateWindow(m_name.c_str(), x, y, w, h, SDL_WINDOW_OPENGL);
+  if (m_headless) {
+    createHeadlessContext();
+  } else {
+    m_win = SDL_CreateWindow(m_name.c_str(), x, y, w, h, SDL_WINDOW_OPENGL);
 
-  if (!m_win) {
-    lg::e(TAG, "Window error: ", SDL_GetError());
+    if (!m_win) {
+      lg::e(TAG, "Window error: ", SDL_GetError());
+    }
+
+    m_GLcontext = SDL_GL_CreateContext(m_win);
+    if (!m_GLcontext) {
+      lg::e(TAG, "Window error: ", SDL_GetError());
+    }
   }
 
-  m_GLcontext = SDL_GL_CreateContext(m_win);
-  if (!m_GLcontext) {
-    lg::e(TAG, "Window error: ", SDL_GetError());
+  // entry points of the GL extensions (vertex buffers...), needs the context
+  glewExperimental = GL_TRUE;
+  GLenum glew_status = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+  // a GLX build of GLEW finds no X display behind the EGL context, but the
+  // GL entry points are all there
+  if (m_headless && glew_status == GLEW_ERROR_NO_GLX_DISPLAY) {
+    glew_status = GLEW_OK;
+  }
+#endif
+  if (glew_status != GLEW_OK) {
+    lg::e(TAG, "GLEW error: %s", glewGetErrorString(glew_status));
+  }
+  if (m_headless) {
+    createHeadlessFramebuffer();
   }
 
   lg::i(TAG, "init...");
 
-  glEnable(GL_DEPTH_TEST); // zbuffer
-  glEnable(GL_LIGHTING);   // lighting
-  glEnable(GL_LIGHT0);     // light0
-  glEnable(GL_NORMALIZE);  // normalize the vectors
+  // a new context: nothing is known of its state
+  m_env.invalidateState();
+
+  m_env.enable(GL_DEPTH_TEST); // zbuffer
+  m_env.enable(GL_LIGHTING);   // lighting
+  m_env.enable(GL_LIGHT0);     // light0
+  m_env.enable(GL_NORMALIZE);  // normalize the vectors
 
   glFrontFace(GL_CW); // Front facing faces are taken clockwise
-  glEnable(GL_COLOR_MATERIAL);
+  m_env.enable(GL_COLOR_MATERIAL);
   glColorMaterial(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE);
-  glEnable(GL_POLYGON_OFFSET_FILL);
+  m_env.enable(GL_POLYGON_OFFSET_FILL);
 
   // move fragment generated by rasterization back
   glPolygonOffset(1.0f, 1.0f); // set back
@@ -52,55 +81,74 @@ SmartWindow::~SmartWindow() {
   static const auto TAG = __func__;
 
   lg::i(TAG, "deleting context and window");
+  m_env.releasePrimitives();
+  if (m_headless) {
+    releaseHeadlessContext();
+    return;
+  }
   SDL_GL_DeleteContext(m_GLcontext);
   SDL_DestroyWindow(m_win);
 }
 
 // hides the window
-void SmartWindow::hide() { SDL_HideWindow(m_win); }
+void SmartWindow::hide() {
+  if (m_win) {
+    SDL_HideWindow(m_win);
+  }
+}
 
 // sets up the viewport to match the window size.
 void SmartWindow::setupViewport() { glViewport(0, 0, m_width, m_height); }
 
 // shows the window
-void SmartWindow::show() { SDL_ShowWindow(m_win); }
+void SmartWindow::show() {
+  if (m_win) {
+    SDL_ShowWindow(m_win);
+  }
+}
 
 void SmartWindow::refresh() {
-  // wait for it
-  glFinish();
-  SDL_GL_SwapWindow(m_win);
+  if (m_headless) {
+    // nothing to swap: the frame is in the framebuffer object
+    dumpFrame();
+    glFlush();
+  } else {
+    SDL_GL_SwapWindow(m_win);
+  }
+  // bounded latency, without draining the GPU every frame
+  m_env.paceFrame();
 }
 
 // Helper function:
 // Set the world coords to map into the screen
 // Accepts a function fn to be executed afterwards
 void SmartWindow::printOnScreen(std::function<void()> fn) {
-  glDisable(GL_LIGHTING);
-  glDisable(GL_DEPTH_TEST);
+  m_env.disable(GL_LIGHTING);
+  m_env.disable(GL_DEPTH_TEST);
 
-  glMatrixMode(GL_PROJECTION);
-  glLoadIdentity();
+  m_env.matrixMode(GL_PROJECTION);
+  m_env.loadIdentity();
 
-  glMatrixMode(GL_MODELVIEW);
+  m_env.matrixMode(GL_MODELVIEW);
 
   m_env.mat_scope([&] {
-    glLoadIdentity();
+    m_env.loadIdentity();
 
-    glTranslatef(-1, -1, 0);
+    m_env.translate(-1, -1, 0);
 
-    glScalef(2.0 / m_width, 2.0 / m_height, 1);
+    m_env.scale(2.0 / m_width, 2.0 / m_height, 1);
 
     fn();
   });
 
-  glEnable(GL_DEPTH_TEST);
-  glEnable(GL_LIGHTING);
+  m_env.enable(GL_DEPTH_TEST);
+  m_env.enable(GL_LIGHTING);
 }
 
 // color the whole window with a solid Color
 void SmartWindow::colorWindow(const Color &color) {
   printOnScreen([&] {
-    glColor3f(color.r, color.g, color.b);
+    m_env.setColor(Color(color.r, color.g, color.b));
 
     glBegin(GL_POLYGON);
     {
@@ -119,9 +167,9 @@ void SmartWindow::colorWindow(const Color &color) {
 // Apply a texture on the whole window to show a background image
 void SmartWindow::textureWindow(TexID texbind) {
   printOnScreen([&] {
-    glColor3f(1.0f, 1.0f, 1.0f);
-    glEnable(GL_TEXTURE_2D);
-    glBindTexture(GL_TEXTURE_2D, texbind);
+    m_env.setColor(WHITE);
+    m_env.enable(GL_TEXTURE_2D);
+    m_env.bindTexture(texbind);
 
     glBegin(GL_POLYGON);
     {
@@ -139,7 +187,7 @@ void SmartWindow::textureWindow(TexID texbind) {
     }
     glEnd();
 
-    glDisable(GL_TEXTURE_2D);
+    m_env.disable(GL_TEXTURE_2D);
   });
 }
 
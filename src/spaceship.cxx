@@ -1,4 +1,7 @@
 #include "ship.h"
+#include "bvh.h"
+#include "elements.h"
+#include <algorithm>
 
 namespace elements {
 /*                                *
@@ -33,9 +36,8 @@ std::unique_ptr<Spaceship> get_spaceship(const char *texture_filename,
 Spaceship::Spaceship(const char *texture_filename,
                      const char *mesh_filename) // da finire
     : m_env(agl::get_env()),
-      m_tex(m_env.loadTexture(texture_filename)), // no texture for now
-      m_mesh(agl::loadMesh(mesh_filename))        // TODO
-{
+      m_tex(agl::get_assets().texture(texture_filename)),
+      m_mesh(agl::get_assets().mesh(mesh_filename, prepareSceneMesh)) {
   init();
 }
 
@@ -81,34 +83,66 @@ void Spaceship::init(bool truman) {
 // draw the ship as a textured mesh, using the helper functions defined
 // in the Env class.
 void Spaceship::draw() const {
-  m_env.textureDrawing(m_tex, [&] {
-    m_env.mat_scope([&] {
-      m_env.scale(m_scaleX, m_scaleY, m_scaleZ);
+  m_env.mat_scope([&] {
+    m_env.scale(m_scaleX, m_scaleY, m_scaleZ);
 
-      m_mesh->renderGouraud(m_env.isWireframe());
-    });
-  }); // generate coords automatically, true by default
+    auto *mesh = m_mesh->get();
+    if (!mesh) {
+      drawPlaceholder();
+      return;
+    }
+    size_t level = lodLevel(*mesh);
+    // texture coordinates from the OBJ, or generated by OpenGL
+    auto &lod = mesh->lod(level);
+    m_env.lodDrawing(
+        *m_tex, level, [&] { lod.renderGouraud(m_env.isWireframe()); },
+        !lod.hasTexCoords());
+  });
 
   // if headlight is on in the Env, then draw headlights
   if (m_env.isHeadlight()) {
     // lg::i(__func__, "Headlights toggled!");
-    drawHeadlight(0, 0, -1, 8);
+    drawHeadlight(0, 0, -1, 0);
+  } else {
+    m_env.disable(GL_LIGHT1);
   }
 }
 
 void Spaceship::drawFlicker() const {
-  m_env.textureDrawing(m_tex, [&] {
-    m_env.mat_scope([&] {
-      m_env.scale(m_scaleX, m_scaleY, m_scaleZ);
+  m_env.mat_scope([&] {
+    m_env.scale(m_scaleX, m_scaleY, m_scaleZ);
 
-      m_mesh->renderGouraud(true);
-    });
-  }); // generate coords automatically, true by default
+    auto *mesh = m_mesh->get();
+    if (!mesh) {
+      drawPlaceholder();
+      return;
+    }
+    size_t level = lodLevel(*mesh);
+    // texture coordinates from the OBJ, or generated by OpenGL
+    auto &lod = mesh->lod(level);
+    m_env.lodDrawing(*m_tex, level, [&] { lod.renderGouraud(true); },
+                     !lod.hasTexCoords());
+  });
 
   // if headlight is on in the Env, then draw headlights
   if (m_env.isHeadlight()) {
     // lg::i(__func__, "Headlights toggled!");
-    drawHeadlight(0, 0, -1, 8);
+    drawHeadlight(0, 0, -1, 0);
+  } else {
+    m_env.disable(GL_LIGHT1);
+  }
+}
+
+// level of detail of the mesh, from its size on screen with the current
+// transformations
+size_t Spaceship::lodLevel(const agl::Mesh &mesh) const {
+  return mesh.selectLod(m_env.projectedSize(mesh.center(), mesh.radius()));
+}
+
+// the mesh is still loading: draw its bounding box, if known
+void Spaceship::drawPlaceholder() const {
+  if (m_mesh->hasBounds()) {
+    m_env.drawBoundingBox(m_mesh->bbmin(), m_mesh->bbmax());
   }
 }
 
@@ -117,25 +151,17 @@ void Spaceship::drawHeadlight(float x, float y, float z, int lightN) const {
 
   int usedLight = GL_LIGHT1 + lightN;
 
-  glEnable(usedLight);
-
-  float col0[4] = {0.8, 0.8, 0.0, 1};
-  glLightfv(usedLight, GL_DIFFUSE, col0);
-
-  float col1[4] = {0.5, 0.5, 0.0, 1};
-  glLightfv(usedLight, GL_AMBIENT, col1);
-
-  float tmpPos[4] = {x, y, z, 1}; // ultima comp=1 => luce posizionale
-  glLightfv(usedLight, GL_POSITION, tmpPos);
-
-  float tmpDir[4] = {0, 0, -1, 0}; // ultima comp=1 => luce posizionale
-  glLightfv(usedLight, GL_SPOT_DIRECTION, tmpDir);
-
-  glLightf(usedLight, GL_SPOT_CUTOFF, 30);
-  glLightf(usedLight, GL_SPOT_EXPONENT, 5);
-
-  glLightf(usedLight, GL_CONSTANT_ATTENUATION, 0);
-  glLightf(usedLight, GL_LINEAR_ATTENUATION, 1);
+  agl::SpotLight spot;
+  spot.position = agl::Point3(x, y, z); // luce posizionale
+  spot.direction = agl::Vec3(0, 0, -1);
+  spot.diffuse = {0.8, 0.8, 0.0, 1};
+  spot.ambient = {0.5, 0.5, 0.0, 1};
+  spot.cutoff = 30;
+  spot.exponent = 5;
+  spot.constant_attenuation = 0;
+  spot.linear_attenuation = 1;
+  // fixed function o shader, vedi agl::Env::setupSpotLight
+  m_env.setupSpotLight(usedLight, spot);
 }
 
 void Spaceship::doMotion() {
@@ -280,22 +306,25 @@ void Spaceship::processCommand() {
   }
 }
 
-void Spaceship::render(bool flicker) {
-  m_env.mat_scope([&] {
+void Spaceship::applyPose() const {
+  // translate the camera to follow the ship movements
+  m_env.translate(m_px, m_py, m_pz);
 
-    // translate the camera to follow the ship movements
-    m_env.translate(m_px, m_py, m_pz);
+  // rotate the ship according to the facing direction
+  m_env.rotate(m_facing, m_viewUP);
 
-    // rotate the ship according to the facing direction
-    m_env.rotate(m_facing, m_viewUP);
+  // the Mesh is loaded on the other side
+  m_env.rotate(m_rotation_angle, m_viewUP);
 
-    // the Mesh is loaded on the other side
-    m_env.rotate(m_rotation_angle, m_viewUP);
+  // rotate the ship acc. to steering val, to represent tilting
+  int sign = m_rotation_angle == ENVOS_ANGLE ? -1 : 1;
+  m_env.rotate(sign * m_steering, m_front_axis);
+  //   m_env.rotate(sign * m_steering, front_boat);
+}
 
-    // rotate the ship acc. to steering val, to represent tilting
-    int sign = m_rotation_angle == ENVOS_ANGLE ? -1 : 1;
-    m_env.rotate(sign * m_steering, m_front_axis);
-    //   m_env.rotate(sign * m_steering, front_boat);
+void Spaceship::render(bool flicker) {
+  m_env.mat_scope([&] {
+    applyPose();
 
     if (flicker) {
       drawFlicker();
@@ -321,28 +350,107 @@ void Spaceship::scale(float x, float y, float z) {
   m_scaleZ = z;
 }
 
-void Spaceship::shadow() {
-  m_env.mat_scope([&] {
-    const auto c = agl::SHADOW;
+void Spaceship::submit(bool flicker) {
+  agl::Point3 center;
+  float radius;
+  if (boundingSphere(center, radius) && !m_env.isVisible(center, radius)) {
+    return;
+  }
+  m_env.submit(agl::RenderPass::OPAQUE, *m_tex,
+               agl::Point3(m_px, m_py, m_pz),
+               [this, flicker] {
+                 m_env.timedScope("ship", [&] { render(flicker); });
+               });
+}
 
-    m_env.setColor(c);
+bool Spaceship::boundingSphere(agl::Point3 &center, float &radius) const {
+  float scale = std::max({m_scaleX, m_scaleY, m_scaleZ});
+  return meshBoundingSphere(*m_mesh, agl::Point3(m_px, m_py, m_pz), scale,
+                            center, radius);
+}
+
+bool Spaceship::boundingBox(agl::Obb &box) const {
+  agl::Point3 bbmin, bbmax;
+  if (!m_mesh->bounds(bbmin, bbmax)) {
+    return false;
+  }
+
+  // the rotations of applyPose around the vertical axis
+  float angle = (m_facing + m_rotation_angle) * M_PI / 180.0f;
+  float c = cosf(angle), s = sinf(angle);
+  auto rotate = [c, s](const agl::Point3 &p) {
+    return agl::Point3(p.x * c + p.z * s, p.y, -p.x * s + p.z * c);
+  };
+
+  agl::Point3 mid = (bbmin + bbmax) / 2.0f;
+  box.center = agl::Point3(m_px, m_py, m_pz) +
+               rotate(agl::Point3(mid.x * m_scaleX, mid.y * m_scaleY,
+                                  mid.z * m_scaleZ));
+  box.axis[0] = rotate(agl::Point3(1, 0, 0));
+  box.axis[1] = agl::Point3(0, 1, 0);
+  box.axis[2] = rotate(agl::Point3(0, 0, 1));
+  box.half[0] = (bbmax.x - bbmin.x) / 2.0f * m_scaleX;
+  box.half[1] = (bbmax.y - bbmin.y) / 2.0f * m_scaleY;
+  box.half[2] = (bbmax.z - bbmin.z) / 2.0f * m_scaleZ;
+  return true;
+}
+
+void Spaceship::submitShadow() {
+  agl::Point3 center;
+  float radius;
+  if (!boundingSphere(center, radius)) {
+    return; // still loading
+  }
+
+  if (m_env.isShadowMapActive()) {
+    auto *mesh = m_mesh->get();
+    if (!mesh) {
+      return; // only the bounds for now
+    }
+    // drawn now from the sun, the floor, rings and cubes read it when the
+    // queue is flushed
+    std::array<float, 5> pose = {m_px, m_py, m_pz, m_facing, m_steering};
+    bool moved = pose != m_shadow_pose;
+    m_shadow_pose = pose;
+    m_env.updateShadowMap(center, radius, moved, [this, mesh] {
+      m_env.mat_scope([&] {
+        applyPose();
+        m_env.scale(m_scaleX, m_scaleY, m_scaleZ);
+        mesh->lod(lodLevel(*mesh)).renderGouraud();
+      });
+    });
+    return;
+  }
+
+  // the blob lies where the ship would cast its shadow from the sun of the
+  // shadow map, towards (-1, 1, -1)
+  agl::Point3 blob(m_px + m_py, 0.01, m_pz + m_py);
+  if (!m_env.isVisible(blob, radius)) {
+    return;
+  }
+  m_env.submit(agl::RenderPass::TRANSPARENT, 0, blob,
+               [this, radius] {
+                 m_env.timedScope("shadow", [&] { blobShadow(radius); });
+               });
+}
+
+void Spaceship::blobShadow(float radius) {
+  m_env.mat_scope([&] {
     m_env.disableLighting();
+    if (m_env.isBlending()) {
+      m_env.enable(GL_BLEND);
+      m_env.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+      m_env.setColor(agl::SHADOW_BLOB);
+    } else {
+      m_env.setColor(agl::SHADOW);
+    }
+
+    // lying on the floor, a bit above it to avoid z-fighting
+    m_env.translate(m_px + m_py, 0.01, m_pz + m_py);
+    m_env.rotate(90, agl::Vec3(1, 0, 0));
+    m_env.drawCircle(0, 0, radius);
 
-    m_env.translate(m_px + 2.0, 0.01,
-                    m_pz + 2.0); // avoid z-fighting with the floor
-    // rotate the ship according to the facing direction
-    m_env.rotate(m_facing, m_viewUP);
-    // the Mesh is loaded on the other side
-    m_env.rotate(ENVOS_ANGLE, m_viewUP);
-    // rotate the ship acc. to steering val, to represent tilting
-    int sign = -1;
-    m_env.rotate(sign * m_steering, m_front_axis);
-
-    m_env.scale(ENVOS_SCALE * 1.01, ENVOS_SCALE * 0.0,
-                ENVOS_SCALE * 1.01); // squash on Y, 1% scaling-up on X and Z
-
-    // render the ship without lighting and squashed!
-    m_mesh->renderGouraud(m_env.isWireframe());
+    m_env.disable(GL_BLEND);
     m_env.enableLighting();
   });
 }
@@ -42,6 +42,9 @@ const Color GREEN = {.447f, .643f, .074f};
 const Color YELLOW = {.913f, .643f, .074f};
 const Color LIGHT_YELLOW = {245.0f, 246.0f, 206.0f};
 const Color SHADOW = {.3f, .3f, .3f};
+const Color SHADOW_BLOB = {.0f, .0f, .0f, .5f}; // translucent blob shadow
+// debug colors of the levels of detail, from the finest one
+const Color LOD_COLORS[] = {GREEN, YELLOW, RED, {.250f, .411f, .882f}};
 
 static const auto PHYS_SAMPLING_STEP = 10U; // millisec of a Physics sim step
 static const auto FPS_SAMPLE = 10U;         // interval length
@@ -84,6 +87,8 @@ enum Key {
   F3,
   F4,
   F5,
+  F6,
+  F7,
   N_KEYS
 };
 enum MouseEvent { MOTION, WHEEL };